@@ -2,123 +2,52 @@
 #define NYAS_AZDO_H
 
 #include "nyas.h"
-#include <glad/glad.h>
-#include <vector>
 
-enum BufferType
+// Layout of GL's DrawElementsIndirectCommand.
+typedef struct NyDrawIndirect
 {
-    Vertex,
-    Index,
-    DrawIndirect
-};
-
-template<typename T>
-struct NyasBuffer
-{
-
-    NyasBuffer(BufferType type) : InternalID(-1), Type(type), Dirty(false) {}
-    std::vector<T> Data;
-    unsigned int InternalID;
-    BufferType Type;
-    bool Dirty;
-};
-
-typedef struct DrawIndirectData {
-    unsigned int Count;
-    unsigned int InstanceCount;
-    unsigned int FirstIdx;
-    int BaseVtx;
-    unsigned int BaseInstance;
-} DrawIndirectData;
-
+    uint32_t Count;
+    uint32_t InstanceCount;
+    uint32_t FirstIdx;
+    int32_t BaseVtx;
+    uint32_t BaseInstance;
+} NyDrawIndirect;
+
+// Range of a mesh inside the shared buffers of a NyMergedMesh.
 struct NyMeshOffset
 {
-    ptrdiff_t BaseVtx;
-    ptrdiff_t FirstIdx;
-    ptrdiff_t ElementCount;
+    NyasHandle Mesh; // Source of the geometry.
+    int64_t BaseVtx;
+    int64_t FirstIdx;
+    int64_t ElementCount;
 };
 
+// Meshes sub-allocated into shared vertex and index buffers, sized once on creation. A draw
+// command with Merged set draws all its units with one glMultiDrawElementsIndirect: unit meshes
+// are the indices returned by Add and the command shader is used for all of them. The instances
+// of each unit follow the previous unit ones, starting at its BaseInstance.
 struct NyMergedMesh
 {
-    NyMergedMesh() : Vertices(Vertex), Indices(Index), DrawIndirect(BufferType::DrawIndirect) {}
-
-    void InitGPU()
-    {
-        glGenBuffers(1, &Vertices.InternalID);
-        glGenBuffers(1, &Indices.InternalID);
-        glGenBuffers(1, &DrawIndirect.InternalID);
-    }
-
-    void Bind()
-    {
-        glBindBuffer(GL_ARRAY_BUFFER, Vertices.InternalID);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, Indices.InternalID);
-        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, DrawIndirect.InternalID);
-        if (Vertices.Dirty)
-        {
-            glBufferData(GL_ARRAY_BUFFER, Vertices.Data.size() * sizeof(float), Vertices.Data.data(), GL_DYNAMIC_DRAW);
-        }
-
-        if (Indices.Dirty)
-        {
-            glBufferData(GL_ELEMENT_ARRAY_BUFFER, Indices.Data.size() * sizeof(unsigned short), Indices.Data.data(), GL_DYNAMIC_DRAW);
-        }
-
-        if (DrawIndirect.Dirty)
-        {
-            glBufferData(GL_DRAW_INDIRECT_BUFFER, DrawIndirect.Data.size() * sizeof(DrawIndirectData), DrawIndirect.Data.data(), GL_DYNAMIC_DRAW);
-        }
-    }
-
-    void Add(BufferType type, void *data, ptrdiff_t count)
-    {
-        switch (type)
-        {
-            case Vertex:
-            {
-                for (int i = 0; i < count; ++i)
-                {
-                    Vertices.Data.emplace_back(((float*)data)[i]);
-                }
-                Vertices.Dirty = true;
-                break;
-            }
-            case Index:
-            {
-                for (int i = 0; i < count; ++i)
-                {
-                    Indices.Data.emplace_back(((unsigned short*)data)[i]);
-                }
-                Indices.Dirty = true;
-                break;
-            }
-            case BufferType::DrawIndirect:
-            {
-                for (int i = 0; i < count; ++i)
-                {
-                    DrawIndirect.Data.emplace_back(((DrawIndirectData*)data)[i]);
-                }
-                DrawIndirect.Dirty = true;
-                break;
-            }
-        }
-    }
-
-    NyMergedMesh LoadFile(const char* path)
-    {
-        auto Mesh = Nyas::LoadMesh(path);
-        Nyas::
-    }
-
-    void Draw()
-    {
-        Bind();
-        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, 0, DrawIndirect.Data.size(), 0);
-    }
-
-    NyasBuffer<float> Vertices;
-    NyasBuffer<unsigned short> Indices;
-    NyasBuffer<DrawIndirectData> DrawIndirect;
+    NyasResource Resource; // Vertex array.
+    NyasResource ResVtx;
+    NyasResource ResIdx;
+    NyasResource ResCmd; // Indirect commands, only used without the uniform ring.
+    NyasVtxAttribFlags Attribs;
+    int64_t VtxCapacity; // In bytes.
+    int64_t IdxCapacity; // In indices.
+    int64_t VtxUsed;
+    int64_t IdxUsed;
+    int CmdCapacity;
+    NyArray<NyMeshOffset> Meshes;
+    NyArray<int> Pending; // Added meshes not uploaded yet, written on the next draw.
+    NyArray<NyDrawIndirect> Cmds; // Rebuilt on every draw.
+
+    NyMergedMesh(NyasVtxAttribFlags attribs, int64_t vtx_bytes, int64_t idx_count);
+    ~NyMergedMesh();
+
+    // Reserves a range for the mesh geometry, that has to stay in memory until the next draw.
+    // Returns the index to use as unit mesh, or NyasCode_Error if the layout differs or it is full.
+    int Add(NyasHandle mesh);
 };
 
 #endif // NYAS_AZDO_H
@@ -0,0 +1,482 @@
+// Scene benchmark: draws a procedural scene along a fixed camera path and prints the frame timings
+// as JSON. Offscreen unless --windowed is given, see Nyas::InitIO.
+//
+// nyas_bench [--entities N] [--meshes N] [--materials N] [--frames N] [--warmup N] [--seed N]
+//            [--width N] [--height N] [--windowed] [--out path] [--capture path]
+
+#include "nyas.h"
+#include <mathc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Same layouts as the pbr shader blocks, see main.cpp.
+struct PbrDataDesc
+{
+    float Model[16];
+    float Color[3];
+    float UseAlbedo;
+    float TilingX;
+    float TilingY;
+    float UseRougAndMetal;
+    float Reflectance;
+    float Roughness;
+    float Metallic;
+    float UseNormalMap;
+    float _Padding;
+};
+
+struct PbrSharedDesc
+{
+    float ViewProj[16];
+    NyVec3 CameraEye;
+    float _Padding;
+    float Sunlight[4];
+};
+
+struct BenchConfig
+{
+    int Entities;
+    int Meshes;
+    int Materials;
+    int Frames;
+    int Warmup;
+    unsigned int Seed;
+    int Width;
+    int Height;
+    bool Windowed;
+    const char *Out;
+    const char *Capture; // Last frame as PPM, for the golden image checks of nyas_regress.
+};
+
+// Per measured frame, in milliseconds.
+struct BenchSamples
+{
+    NyArray<float> Build; // Camera, hierarchy, culling, batching, instance data and sorting.
+    NyArray<float> Submit; // Draw calls of the frame until WindowSwap returns.
+    NyArray<float> Gpu; // Timer queries, dropped frames are left out.
+    int64_t DrawCalls;
+    int64_t StateCalls;
+    int64_t SkippedStateCalls;
+    int64_t UploadBytes;
+};
+
+struct BenchScene
+{
+    NyasHandle Pbr;
+    NyArray<PbrDataDesc> Materials;
+    NyArray<int> EntityLod;
+};
+
+static BenchScene G_Scene;
+
+static float Rand01(unsigned int *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return (float)(*state >> 8) / (float)(1u << 24);
+}
+
+// Mesh variants of the basic geometries, stretched so every mesh is a different draw.
+static void CreateMeshes(int count, NyasHandle *meshes)
+{
+    static const int attrib_floats[NyasVtxAttrib_COUNT] = { 3, 3, 3, 3, 2, 4 };
+    const NyasHandle bases[2] = { NYAS_SPHERE, NYAS_CUBE };
+    for (int i = 0; i < count; ++i)
+    {
+        const NyasMesh *base = &Nyas::Meshes[bases[i & 1]];
+        int stride = 0; // Position goes first in every vertex.
+        for (int a = 0; a < NyasVtxAttrib_COUNT; ++a)
+        {
+            stride += base->Attribs & (1 << a) ? attrib_floats[a] : 0;
+        }
+
+        float *vtx = (float *)malloc(base->VtxSize);
+        memcpy(vtx, base->Vtx, base->VtxSize);
+        float scale[3] = { 1.0f + 0.15f * (i >> 1), 1.0f, 1.0f - 0.05f * ((i >> 1) % 8) };
+        for (uint32_t v = 0; v < base->VtxSize / sizeof(float); v += stride)
+        {
+            vtx[v + 0] *= scale[0] * 0.5f;
+            vtx[v + 1] *= scale[1] * 0.5f;
+            vtx[v + 2] *= scale[2] * 0.5f;
+        }
+
+        meshes[i] = Nyas::CreateMesh();
+        Nyas::SetMesh(
+            meshes[i], base->Attribs, vtx, base->VtxSize, base->Indices, base->ElementCount);
+        free(vtx);
+    }
+}
+
+// Placeholder textures for every texture the pbr shader samples, the content is not measured.
+static void CreateTextures(NyasShader *pbr)
+{
+    NyasTexDesc maps(NyasTexType_Array2D, NyasTexFmt_RGBA_8, 64, 64, 1);
+    pbr->TexArrays = (NyasHandle *)malloc(pbr->TexArrCount * sizeof(NyasHandle));
+    for (int i = 0; i < pbr->TexArrCount; ++i)
+    {
+        pbr->TexArrays[i] = Nyas::CreateTexture();
+        Nyas::SetTexture(pbr->TexArrays[i], &maps);
+    }
+
+    NyasTexDesc lut(NyasTexType_2D, NyasTexFmt_RG_16F, 64, 64);
+    NyasTexDesc env(NyasTexType_Cubemap, NyasTexFmt_RGB_16F, 32, 32);
+    for (int i = 0; i < pbr->SharedTexCount + pbr->SharedCubemapCount; ++i)
+    {
+        pbr->Shared[i] = Nyas::CreateTexture();
+        Nyas::SetTexture(pbr->Shared[i], i < pbr->SharedTexCount ? &lut : &env);
+    }
+}
+
+// Entities on a square grid, each one with its own hierarchy node under a root.
+static void CreateScene(const BenchConfig &cfg)
+{
+    NyUtil::LoadBasicGeometries();
+    static const NyasShaderDesc pbr_units(
+        "pbr", 1, 2, 4, sizeof(PbrDataDesc) * NYAS_PIPELINE_MAX_UNITS, sizeof(PbrSharedDesc));
+    static const NyasShaderDesc pbr_instanced("pbr", 1, 2, 4, 0, sizeof(PbrSharedDesc),
+        "NYAS_INSTANCE_BUFFER", sizeof(PbrDataDesc));
+    G_Scene.Pbr =
+        Nyas::CreateShader(Nyas::InstanceBuffersSupported() ? &pbr_instanced : &pbr_units);
+    NyasShader *pbr = &Nyas::Shaders[G_Scene.Pbr];
+    CreateTextures(pbr);
+
+    PbrSharedDesc *shared = (PbrSharedDesc *)pbr->SharedBlock;
+    memset((void *)shared, 0, sizeof(*shared));
+    shared->Sunlight[1] = -1.0f;
+    shared->Sunlight[2] = -0.1f;
+
+    unsigned int seed = cfg.Seed;
+    for (int i = 0; i < cfg.Materials; ++i)
+    {
+        PbrDataDesc m;
+        memset(&m, 0, sizeof(m));
+        m.Color[0] = Rand01(&seed);
+        m.Color[1] = Rand01(&seed);
+        m.Color[2] = Rand01(&seed);
+        m.TilingX = 1.0f;
+        m.TilingY = 1.0f;
+        m.Reflectance = 0.5f;
+        m.Roughness = Rand01(&seed);
+        m.Metallic = Rand01(&seed);
+        G_Scene.Materials.Push(m);
+    }
+
+    NyasHandle *meshes = (NyasHandle *)malloc(cfg.Meshes * sizeof(NyasHandle));
+    CreateMeshes(cfg.Meshes, meshes);
+
+    int side = 1;
+    while (side * side < cfg.Entities)
+    {
+        ++side;
+    }
+
+    int root = Nyas::Transforms.Add();
+    for (int i = 0; i < cfg.Entities; ++i)
+    {
+        int e = Nyas::Entities.Add();
+        NyasEntity *entity = &Nyas::Entities[e];
+        mat4_identity(entity->Transform);
+        entity->Mesh = meshes[(int)(Rand01(&seed) * cfg.Meshes) % cfg.Meshes];
+        entity->Shader = G_Scene.Pbr;
+        entity->Material = (int)(Rand01(&seed) * cfg.Materials) % cfg.Materials;
+
+        float position[3] = { 2.0f * (i % side - side * 0.5f), Rand01(&seed) * 2.0f - 1.0f,
+            2.0f * (i / side - side * 0.5f) };
+        int node = Nyas::Transforms.Add(root, e);
+        Nyas::Transforms.SetLocal(node, position, NULL, NULL);
+        G_Scene.EntityLod.Push(-1);
+    }
+    free(meshes);
+}
+
+// Orbits the grid once over the measured frames, looking at its center from above.
+static void PlaceCamera(int frame, int frames, int entities)
+{
+    float radius = 1.5f;
+    while (radius * radius < (float)entities)
+    {
+        radius += 1.0f;
+    }
+    float angle = 2.0f * MPI * (float)frame / (float)(frames > 0 ? frames : 1);
+    float eye[3] = { cosf(angle) * radius, radius * 0.5f, sinf(angle) * radius };
+    float target[3] = { 0.0f, 0.0f, 0.0f };
+    float up[3] = { 0.0f, 1.0f, 0.0f };
+    mat4_look_at(Nyas::Camera.View, eye, target, up);
+}
+
+static void BuildFrame(NyArray<NyasDrawCmd, NyFrameAllocator> &frame, NySched *sched)
+{
+    NyasShader *pbr = &Nyas::Shaders[G_Scene.Pbr];
+    Nyas::Transforms.Update(sched);
+
+    PbrSharedDesc *shared = (PbrSharedDesc *)pbr->SharedBlock;
+    memcpy(shared->ViewProj, Nyas::Camera.ViewProj(), sizeof(float) * 16);
+    shared->CameraEye = Nyas::Camera.Eye();
+
+    int *visible = (int *)NyFrameAllocator::Alloc(Nyas::Entities.Count * sizeof(int));
+    int count = Nyas::CullEntities(shared->ViewProj, visible, sched);
+    if (!pbr->Instances && count > NYAS_PIPELINE_MAX_UNITS)
+    {
+        count = NYAS_PIPELINE_MAX_UNITS; // The unit block holds no more entities.
+    }
+
+    int *lods = (int *)NyFrameAllocator::Alloc(count * sizeof(int));
+    for (int i = 0; i < count; ++i)
+    {
+        NyasEntity *e = &Nyas::Entities[visible[i]];
+        lods[i] = Nyas::SelectLod(
+            e->Mesh, e->Transform, shared->CameraEye, G_Scene.EntityLod[visible[i]]);
+        G_Scene.EntityLod[visible[i]] = lods[i];
+    }
+
+    NyasInstanceBatch *batches =
+        (NyasInstanceBatch *)NyFrameAllocator::Alloc(count * sizeof(NyasInstanceBatch));
+    int batch_count = Nyas::BatchEntities(visible, lods, count, batches);
+
+    // Without instance buffers the instances are slices of the unit block.
+    PbrDataDesc *instances = (PbrDataDesc *)(
+        pbr->Instances ? pbr->Instances->Write(0, count) : pbr->UnitBlock);
+    for (int i = 0; i < count; ++i)
+    {
+        NyasEntity *e = &Nyas::Entities[visible[i]];
+        instances[i] = G_Scene.Materials[e->Material];
+        memcpy(instances[i].Model, e->Transform, sizeof(float) * 16);
+    }
+
+    NyVec2i vp = Nyas::GetCurrentCtx()->Platform.WindowSize;
+    NyasDrawCmd draw;
+    draw.Framebuf = NyasCode_Default;
+    draw.Shader = G_Scene.Pbr;
+    draw.State.BgColorA = 1.0f;
+    draw.State.ViewportMaxX = vp.X;
+    draw.State.ViewportMaxY = vp.Y;
+    draw.State.EnableFlags |= NyasDrawFlags_ColorClear | NyasDrawFlags_DepthClear |
+        NyasDrawFlags_DepthTest | NyasDrawFlags_DepthWrite | NyasDrawFlags_FaceCulling;
+    draw.State.Depth = NyasDepthFunc_Less;
+    draw.State.FaceCulling = NyasFaceCull_Back;
+    draw.UnitCount = batch_count;
+    draw.Units = (NyasDrawUnit *)NyFrameAllocator::Alloc(batch_count * sizeof(NyasDrawUnit));
+    for (int i = 0; i < batch_count; ++i)
+    {
+        NyasDrawUnit *unit = &draw.Units[i];
+        *unit = NyasDrawUnit();
+        unit->Shader = batches[i].Shader;
+        unit->Mesh = batches[i].Mesh;
+        unit->Instances = batches[i].Count;
+        unit->Lod = batches[i].Lod;
+        if (pbr->Instances)
+        {
+            unit->FirstInstance = batches[i].Slot;
+        }
+        else
+        {
+            unit->UnitBlockOffset = batches[i].Slot * sizeof(PbrDataDesc);
+        }
+        unit->SortKey = Nyas::SortKey(
+            0, NyasCode_Default, unit->Shader, batches[i].Material, unit->Mesh, 0.0f);
+    }
+    draw.SortKey = Nyas::SortKey(0, NyasCode_Default, G_Scene.Pbr, 0, NyasCode_None, 0.0f);
+    frame.Push(draw);
+    Nyas::SortDraws(&frame[0], frame.Size);
+}
+
+static int CompareFloat(const void *a, const void *b)
+{
+    float fa = *(const float *)a;
+    float fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+// Mean and nearest rank percentiles, sorts the samples.
+static void PrintStats(FILE *f, const char *name, NyArray<float> &samples, bool last)
+{
+    float mean = 0.0f;
+    float p[3] = { 0.0f, 0.0f, 0.0f };
+    if (samples.Size)
+    {
+        qsort(&samples[0], samples.Size, sizeof(float), CompareFloat);
+        for (int i = 0; i < samples.Size; ++i)
+        {
+            mean += samples[i];
+        }
+        mean /= samples.Size;
+
+        const float ranks[3] = { 0.50f, 0.95f, 0.99f };
+        for (int i = 0; i < 3; ++i)
+        {
+            int idx = (int)(ranks[i] * samples.Size + 0.999f) - 1;
+            p[i] = samples[idx < 0 ? 0 : idx];
+        }
+    }
+
+    fprintf(f,
+        "    \"%s\": { \"samples\": %d, \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, "
+        "\"p99\": %.4f }%s\n",
+        name, samples.Size, mean, p[0], p[1], p[2], last ? "" : ",");
+}
+
+static void PrintReport(FILE *f, const BenchConfig &cfg, BenchSamples &s)
+{
+    int frames = cfg.Frames > 0 ? cfg.Frames : 1;
+    fprintf(f, "{\n");
+    fprintf(f,
+        "  \"config\": { \"entities\": %d, \"meshes\": %d, \"materials\": %d, \"frames\": %d, "
+        "\"warmup\": %d, \"seed\": %u, \"width\": %d, \"height\": %d, \"headless\": %s },\n",
+        cfg.Entities, cfg.Meshes, cfg.Materials, cfg.Frames, cfg.Warmup, cfg.Seed, cfg.Width,
+        cfg.Height, cfg.Windowed ? "false" : "true");
+    fprintf(f, "  \"ms\": {\n");
+    PrintStats(f, "build", s.Build, false);
+    PrintStats(f, "submit", s.Submit, false);
+    PrintStats(f, "gpu", s.Gpu, true);
+    fprintf(f, "  },\n");
+    fprintf(f,
+        "  \"per_frame\": { \"draw_calls\": %.1f, \"state_calls\": %.1f, "
+        "\"skipped_state_calls\": %.1f, \"upload_bytes\": %.1f }\n",
+        (double)s.DrawCalls / frames, (double)s.StateCalls / frames,
+        (double)s.SkippedStateCalls / frames, (double)s.UploadBytes / frames);
+    fprintf(f, "}\n");
+}
+
+static int ParseArgs(int argc, char **argv, BenchConfig *cfg)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strcmp(arg, "--windowed"))
+        {
+            cfg->Windowed = true;
+            continue;
+        }
+
+        if (!value)
+        {
+            fprintf(stderr, "Missing value of %s.\n", arg);
+            return NyasError_BadArg;
+        }
+        ++i;
+
+        int *ints[] = { &cfg->Entities, &cfg->Meshes, &cfg->Materials, &cfg->Frames, &cfg->Warmup,
+            &cfg->Width, &cfg->Height };
+        const char *names[] = { "--entities", "--meshes", "--materials", "--frames", "--warmup",
+            "--width", "--height" };
+        bool known = false;
+        for (int n = 0; n < (int)(sizeof(names) / sizeof(names[0])) && !known; ++n)
+        {
+            known = !strcmp(arg, names[n]);
+            *ints[n] = known ? atoi(value) : *ints[n];
+        }
+
+        if (!strcmp(arg, "--seed"))
+        {
+            cfg->Seed = (unsigned int)strtoul(value, NULL, 10);
+        }
+        else if (!strcmp(arg, "--out"))
+        {
+            cfg->Out = value;
+        }
+        else if (!strcmp(arg, "--capture"))
+        {
+            cfg->Capture = value;
+        }
+        else if (!known)
+        {
+            fprintf(stderr, "Unknown argument %s.\n", arg);
+            return NyasError_BadArg;
+        }
+    }
+
+    if (cfg->Entities < 1 || cfg->Meshes < 1 || cfg->Materials < 1 || cfg->Frames < 1 ||
+        cfg->Warmup < 0 || cfg->Width < 1 || cfg->Height < 1)
+    {
+        fprintf(stderr, "Counts and sizes have to be positive.\n");
+        return NyasError_BadArg;
+    }
+    return NyasCode_Ok;
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig cfg = { 10000, 16, 32, 600, 60, 1, 1280, 720, false, NULL, NULL };
+    if (ParseArgs(argc, argv, &cfg) != NyasCode_Ok)
+    {
+        return 1;
+    }
+
+    if (!Nyas::InitIO("nyas_bench", cfg.Width, cfg.Height, !cfg.Windowed))
+    {
+        return 1;
+    }
+    Nyas::Camera.Init(*Nyas::GetCurrentCtx());
+    CreateScene(cfg);
+
+    NyasCtx *ctx = Nyas::GetCurrentCtx();
+    ctx->Profile.Enabled = true;
+    NySched sched(4);
+    BenchSamples samples = {};
+    for (int f = 0; f < cfg.Warmup + cfg.Frames && !ctx->Platform.WindowClosed; ++f)
+    {
+        bool measured = f >= cfg.Warmup;
+        ctx->Platform.DeltaTime = 1.0f / 60.0f;
+        Nyas::PollIO();
+        PlaceCamera(f - cfg.Warmup, cfg.Frames, cfg.Entities);
+
+        NyChrono chrono;
+        NyArray<NyasDrawCmd, NyFrameAllocator> frame;
+        BuildFrame(frame, &sched);
+        float build_ms = (float)NyChrono::MilliSeconds((double)chrono.Elapsed());
+
+        chrono.Restart();
+        for (int i = 0; i < frame.Size; ++i)
+        {
+            Nyas::Draw(&frame[i]);
+        }
+        int64_t submit_ns = chrono.Elapsed();
+
+        // The read back stalls the pipeline, it stays out of the submit time.
+        if (cfg.Capture && f == cfg.Warmup + cfg.Frames - 1 &&
+            Nyas::SaveFrame(cfg.Capture) != NyasCode_Ok)
+        {
+            fprintf(stderr, "Could not save %s.\n", cfg.Capture);
+            return 1;
+        }
+
+        chrono.Restart();
+        Nyas::WindowSwap();
+        submit_ns += chrono.Elapsed();
+        float submit_ms = (float)NyChrono::MilliSeconds((double)submit_ns);
+
+        // GPU times show up NYAS_PROFILE_FRAMES - 1 swaps late, the warmup covers the gap.
+        const NyasProfile &p = ctx->Profile;
+        float gpu_ms =
+            p.GpuFrameMs[(p.History + NYAS_PROFILE_HISTORY - 1) % NYAS_PROFILE_HISTORY];
+        if (!measured)
+        {
+            continue;
+        }
+
+        samples.Build.Push(build_ms);
+        samples.Submit.Push(submit_ms);
+        if (gpu_ms > 0.0f)
+        {
+            samples.Gpu.Push(gpu_ms);
+        }
+        samples.DrawCalls += ctx->Stats.DrawCalls;
+        samples.StateCalls += ctx->Stats.StateCalls;
+        samples.SkippedStateCalls += ctx->Stats.SkippedStateCalls;
+        samples.UploadBytes += ctx->Stats.UploadBytes;
+    }
+
+    FILE *out = cfg.Out ? fopen(cfg.Out, "w") : stdout;
+    if (!out)
+    {
+        fprintf(stderr, "Could not open %s.\n", cfg.Out);
+        return 1;
+    }
+    PrintReport(out, cfg, samples);
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return 0;
+}
@@ -1,4 +1,8 @@
 #include "nyas.h"
+#include "azdo.h"
+#include <imgui.h>
+#include <imgui_impl_glfw.h>
+#include <imgui_impl_opengl3.h>
 #include <mathc.h>
 #include <stdio.h>
 
@@ -33,9 +37,12 @@ struct PbrMaps
 static const struct
 {
     const NyasShaderDesc Pbr;
+    const NyasShaderDesc PbrInstanced; // Reads the entity data from the instance buffer.
     const NyasShaderDesc FullscreenImg;
     const NyasShaderDesc Sky;
-} G_ShaderDescriptors = { { "pbr", 1, 2, 4, sizeof(PbrDataDesc) * NYAS_PIPELINE_MAX_UNITS, sizeof(PbrSharedDesc)},
+} G_ShaderDescriptors = {
+    { "pbr", 1, 2, 4, sizeof(PbrDataDesc) * NYAS_PIPELINE_MAX_UNITS, sizeof(PbrSharedDesc) },
+    { "pbr", 1, 2, 4, 0, sizeof(PbrSharedDesc), "NYAS_INSTANCE_BUFFER", sizeof(PbrDataDesc) },
     { "fullscreen-img", 1 }, { "skybox", 0, 1, 0, 16 * sizeof(float), 0 } };
 
 struct
@@ -54,6 +61,18 @@ struct
 NyasHandle G_Framebuf;
 NyasHandle G_FbTex;
 NyasHandle G_Mesh;
+NySched *G_FrameSched;
+NyArray<PbrDataDesc> G_EntityPbr; // Material of each entity, by entity index.
+NyArray<int> G_EntityLod; // Level of detail drawn last frame, -1 if none.
+
+void SetEntityPbr(int entity, const PbrDataDesc &pbr)
+{
+    while (G_EntityPbr.Size <= entity)
+    {
+        G_EntityPbr.Push(pbr);
+    }
+    G_EntityPbr[entity] = pbr;
+}
 
 void Init(void)
 {
@@ -65,7 +84,8 @@ void Init(void)
     NyAssetLoader::ShaderArgs fsimgargs = { G_ShaderDescriptors.FullscreenImg,
         &G_Shaders.FullscreenImg };
     NyAssetLoader::ShaderArgs skyargs = { G_ShaderDescriptors.Sky, &G_Shaders.Skybox };
-    NyAssetLoader::ShaderArgs pbrargs = { G_ShaderDescriptors.Pbr, &G_Shaders.Pbr };
+    NyAssetLoader::ShaderArgs pbrargs = { Nyas::InstanceBuffersSupported() ?
+            G_ShaderDescriptors.PbrInstanced : G_ShaderDescriptors.Pbr, &G_Shaders.Pbr };
     NyAssetLoader::MeshArgs mesh = { "assets/obj/matball.msh", &G_Mesh };
     NyAssetLoader::EnvArgs envargs = { "assets/env/canyon.env", &G_Tex.Sky, &irradiance, &prefilter,
         &lut };
@@ -163,7 +183,6 @@ void Init(void)
 
     float position[3] = { -2.0f, 0.0f, 0.0f };
 
-    auto *pbr_uniform_block = (PbrDataDesc*)Nyas::Shaders[G_Shaders.Pbr].UnitBlock;
     // CelticGold
     {
         int eidx = Nyas::Entities.Add();
@@ -172,7 +191,7 @@ void Init(void)
         mat4_translation(e->Transform, e->Transform, position);
         e->Mesh = G_Mesh;
         e->Shader = G_Shaders.Pbr;
-        pbr_uniform_block[eidx] = pbr;
+        SetEntityPbr(eidx, pbr);
     }
 
     // Peeling
@@ -187,7 +206,7 @@ void Init(void)
         mat4_translation(e->Transform, e->Transform, position);
         e->Mesh = G_Mesh;
         e->Shader = G_Shaders.Pbr;
-        pbr_uniform_block[eidx] = pbr;
+        SetEntityPbr(eidx, pbr);
     }
 
     // Rusted
@@ -202,7 +221,7 @@ void Init(void)
         mat4_translation(e->Transform, e->Transform, position);
         e->Mesh = G_Mesh;
         e->Shader = G_Shaders.Pbr;
-        pbr_uniform_block[eidx] = pbr;
+        SetEntityPbr(eidx, pbr);
     }
 
     // Tiles
@@ -218,7 +237,7 @@ void Init(void)
         mat4_translation(e->Transform, e->Transform, position);
         e->Mesh = G_Mesh;
         e->Shader = G_Shaders.Pbr;
-        pbr_uniform_block[eidx] = pbr;
+        SetEntityPbr(eidx, pbr);
     }
 
     // Ship Panels
@@ -233,7 +252,7 @@ void Init(void)
         mat4_translation(e->Transform, e->Transform, position);
         e->Mesh = G_Mesh;
         e->Shader = G_Shaders.Pbr;
-        pbr_uniform_block[eidx] = pbr;
+        SetEntityPbr(eidx, pbr);
     }
 
      // Shore
@@ -248,7 +267,7 @@ void Init(void)
         mat4_translation(e->Transform, e->Transform, position);
         e->Mesh = G_Mesh;
         e->Shader = G_Shaders.Pbr;
-        pbr_uniform_block[eidx] = pbr;
+        SetEntityPbr(eidx, pbr);
     }
 
     // Cliff
@@ -264,7 +283,7 @@ void Init(void)
         mat4_translation(e->Transform, e->Transform, position);
         e->Mesh = G_Mesh;
         e->Shader = G_Shaders.Pbr;
-        pbr_uniform_block[eidx] = pbr;
+        SetEntityPbr(eidx, pbr);
     }
 
     // Granite
@@ -279,7 +298,7 @@ void Init(void)
         mat4_translation(e->Transform, e->Transform, position);
         e->Mesh = G_Mesh;
         e->Shader = G_Shaders.Pbr;
-        pbr_uniform_block[eidx] = pbr;
+        SetEntityPbr(eidx, pbr);
     }
 
     // Foam
@@ -294,8 +313,18 @@ void Init(void)
         mat4_translation(e->Transform, e->Transform, position);
         e->Mesh = G_Mesh;
         e->Shader = G_Shaders.Pbr;
-        pbr_uniform_block[eidx] = pbr;
+        SetEntityPbr(eidx, pbr);
+    }
+
+    // Every entity hangs from the hierarchy root, which places the whole scene.
+    int root = Nyas::Transforms.Add();
+    for (int i = 0; i < Nyas::Entities.Count; ++i)
+    {
+        int node = Nyas::Transforms.Add(root, i);
+        Nyas::Transforms.SetLocal(node, &Nyas::Entities[i].Transform[12], NULL, NULL);
+        G_EntityLod.Push(-1);
     }
+    Nyas::Transforms.Update();
 
     *Nyas::Shaders[G_Shaders.Skybox].Shared = G_Tex.Sky;
     *Nyas::Shaders[G_Shaders.FullscreenImg].Shared = G_FbTex;
@@ -305,53 +334,133 @@ void Init(void)
     Nyas::Shaders[G_Shaders.Pbr].TexArrays[3] = G_Tex.PbrMaps.Nor;
 }
 
+struct SceneVisibility
+{
+    int *Entities; // Grouped by batch.
+    int Count;
+    NyasInstanceBatch *Batches;
+    int BatchCount;
+};
+
+// Picks the level of detail of every visible entity and groups them into instance batches.
+void BatchScene(SceneVisibility *visibility)
+{
+    int *lods = (int *)NyFrameAllocator::Alloc(visibility->Count * sizeof(int));
+    NyVec3 eye = Nyas::Camera.Eye();
+    for (int i = 0; i < visibility->Count; ++i)
+    {
+        int e = visibility->Entities[i];
+        lods[i] = Nyas::SelectLod(Nyas::Entities[e].Mesh, Nyas::Entities[e].Transform, eye,
+            G_EntityLod[e]);
+        G_EntityLod[e] = lods[i];
+    }
+
+    visibility->Batches = (NyasInstanceBatch *)NyFrameAllocator::Alloc(
+        visibility->Count * sizeof(NyasInstanceBatch));
+    visibility->BatchCount =
+        Nyas::BatchEntities(visibility->Entities, lods, visibility->Count, visibility->Batches);
+}
+
+// Fills the instance data of a range of visible entities, every scene entity uses the pbr shader
+// so the instance slot is the visible position. The first range also records the draw command,
+// an instanced unit per batch starting at its own instance. Without instance buffers the
+// instances are slices of the unit block instead.
+void RecordScene(NyasDrawBucket *bucket)
+{
+    auto *visibility = (SceneVisibility *)bucket->User;
+    NyasShader *pbr = &Nyas::Shaders[G_Shaders.Pbr];
+    auto *instances = (PbrDataDesc *)(pbr->Instances ? pbr->Instances->Data : pbr->UnitBlock);
+    for (int i = bucket->Begin; i < bucket->End; ++i)
+    {
+        int e = visibility->Entities[i];
+        instances[i] = G_EntityPbr[e];
+        mat4_assign(instances[i].Model, Nyas::Entities[e].Transform);
+    }
+
+    if (bucket->Index)
+    {
+        return;
+    }
+
+    NyVec2i vp = Nyas::GetCurrentCtx()->Platform.WindowSize;
+    NyasDrawCmd draw;
+    draw.Framebuf = G_Framebuf;
+    draw.Shader = G_Shaders.Pbr;
+    draw.State.BgColorR = 0.2f;
+    draw.State.BgColorG = 0.2f;
+    draw.State.BgColorB = 0.2f;
+    draw.State.BgColorA = 1.0f;
+    draw.State.ViewportMinX = 0;
+    draw.State.ViewportMinY = 0;
+    draw.State.ViewportMaxX = vp.X;
+    draw.State.ViewportMaxY = vp.Y;
+    draw.State.EnableFlags |= NyasDrawFlags_ColorClear;
+    draw.State.EnableFlags |= NyasDrawFlags_DepthClear;
+    draw.State.EnableFlags |= NyasDrawFlags_Blend;
+    draw.State.EnableFlags |= NyasDrawFlags_DepthTest;
+    draw.State.EnableFlags |= NyasDrawFlags_DepthWrite;
+    draw.State.BlendSrc = NyasBlendFunc_One;
+    draw.State.BlendDst = NyasBlendFunc_Zero;
+    draw.State.Depth = NyasDepthFunc_Less;
+    draw.State.FaceCulling = NyasFaceCull_Back;
+
+    draw.UnitCount = visibility->BatchCount;
+    draw.Units = bucket->AllocUnits(visibility->BatchCount);
+    for (int i = 0; i < visibility->BatchCount; ++i)
+    {
+        const NyasInstanceBatch &batch = visibility->Batches[i];
+        NyasDrawUnit *unit = &draw.Units[i];
+        unit->Shader = batch.Shader;
+        unit->Mesh = batch.Mesh;
+        unit->Instances = batch.Count;
+        unit->Lod = batch.Lod;
+        if (pbr->Instances)
+        {
+            unit->FirstInstance = batch.Slot;
+        }
+        else
+        {
+            unit->UnitBlockOffset = batch.Slot * sizeof(PbrDataDesc);
+        }
+        unit->SortKey =
+            Nyas::SortKey(0, G_Framebuf, unit->Shader, batch.Material, unit->Mesh, 0.0f);
+    }
+    draw.SortKey = Nyas::SortKey(0, G_Framebuf, G_Shaders.Pbr, 0, NyasCode_None, 0.0f);
+    bucket->Cmds.Push(draw);
+}
+
 void BuildFrame(NyArray<NyasDrawCmd, NyCircularAllocator<NY_MEGABYTES(16)>> &new_frame)
 {
     Nyas::PollIO();
     NyVec2i vp = Nyas::GetCurrentCtx()->Platform.WindowSize;
     Nyas::Camera.Navigate();
+    Nyas::Transforms.Update(G_FrameSched);
 
     /* PBR common shader data. */
     auto *pbr_shared_block = (PbrSharedDesc*)Nyas::Shaders[G_Shaders.Pbr].SharedBlock;
-    mat4_multiply(pbr_shared_block->ViewProj, Nyas::Camera.Proj, Nyas::Camera.View);
+    memcpy(pbr_shared_block->ViewProj, Nyas::Camera.ViewProj(), sizeof(float) * 16);
     pbr_shared_block->CameraEye = Nyas::Camera.Eye();
 
     // Scene entities
+    SceneVisibility visibility;
+    visibility.Entities = (int *)NyFrameAllocator::Alloc(Nyas::Entities.Count * sizeof(int));
     {
-        NyasDrawCmd draw;
-        draw.Framebuf = G_Framebuf;
-        draw.Shader = G_Shaders.Pbr;
-        draw.State.BgColorR = 0.2f;
-        draw.State.BgColorG = 0.2f;
-        draw.State.BgColorB = 0.2f;
-        draw.State.BgColorA = 1.0f;
-        draw.State.ViewportMinX = 0;
-        draw.State.ViewportMinY = 0;
-        draw.State.ViewportMaxX = vp.X;
-        draw.State.ViewportMaxY = vp.Y;
-        draw.State.EnableFlags |= NyasDrawFlags_ColorClear;
-        draw.State.EnableFlags |= NyasDrawFlags_DepthClear;
-        draw.State.EnableFlags |= NyasDrawFlags_Blend;
-        draw.State.EnableFlags |= NyasDrawFlags_DepthTest;
-        draw.State.EnableFlags |= NyasDrawFlags_DepthWrite;
-        draw.State.BlendSrc = NyasBlendFunc_One;
-        draw.State.BlendDst = NyasBlendFunc_Zero;
-        draw.State.Depth = NyasDepthFunc_Less;
-        draw.State.FaceCulling = NyasFaceCull_Back;
-
-        draw.UnitCount = 1;
-        draw.Units =
-            (NyasDrawUnit *)NyFrameAllocator::Alloc(1 * sizeof(NyasDrawUnit));
-        for (int i = 0; i < Nyas::Entities.Count; ++i)
+        NYAS_PROFILE_SCOPE("cull");
+        visibility.Count =
+            Nyas::CullEntities(pbr_shared_block->ViewProj, visibility.Entities, G_FrameSched);
+        if (!Nyas::Shaders[G_Shaders.Pbr].Instances && visibility.Count > NYAS_PIPELINE_MAX_UNITS)
         {
-            auto *pbr_uniform_block = (PbrDataDesc*)Nyas::Shaders[G_Shaders.Pbr].UnitBlock;
-            mat4_assign(pbr_uniform_block[i].Model, Nyas::Entities[i].Transform);
+            visibility.Count = NYAS_PIPELINE_MAX_UNITS; // The unit block holds no more entities.
         }
-        draw.Units->Shader = Nyas::Entities[0].Shader;
-        draw.Units->Mesh = Nyas::Entities[0].Mesh;
-        draw.Units->Instances = Nyas::Entities.Count;
-
-        new_frame.Push(draw);
+        BatchScene(&visibility);
+    }
+    {
+        NYAS_PROFILE_SCOPE("record");
+        if (Nyas::Shaders[G_Shaders.Pbr].Instances)
+        {
+            Nyas::Shaders[G_Shaders.Pbr].Instances->Write(0, visibility.Count);
+        }
+        Nyas::RecordDraws(new_frame, G_FrameSched, visibility.Count, 4, RecordScene, &visibility);
     }
 
     // Skybox
@@ -363,9 +472,12 @@ void BuildFrame(NyArray<NyasDrawCmd, NyCircularAllocator<NY_MEGABYTES(16)>> &new
         draw.State.Depth = NyasDepthFunc_LessEqual;
         draw.UnitCount = 1;
         draw.Units = (NyasDrawUnit *)NyFrameAllocator::Alloc(sizeof(NyasDrawUnit));
+        *draw.Units = NyasDrawUnit();
         draw.Units->Shader = G_Shaders.Skybox;
         draw.Units->Mesh = NYAS_CUBE;
         draw.Units->Instances = 1;
+        // Same target as the scene, drawn after it so depth rejects the covered texels.
+        draw.SortKey = Nyas::SortKey(1, G_Framebuf, G_Shaders.Skybox, 0, NYAS_CUBE, 1.0f);
         new_frame.Push(draw);
     }
 
@@ -381,38 +493,257 @@ void BuildFrame(NyArray<NyasDrawCmd, NyCircularAllocator<NY_MEGABYTES(16)>> &new
         draw.State.DisableFlags |= NyasDrawFlags_DepthTest;
         draw.UnitCount = 1;
         draw.Units = (NyasDrawUnit *)NyFrameAllocator::Alloc(sizeof(NyasDrawUnit));
+        *draw.Units = NyasDrawUnit();
         draw.Units->Shader = G_Shaders.FullscreenImg;
         draw.Units->Mesh = NYAS_QUAD;
         draw.Units->Instances = 1;
+        draw.SortKey =
+            Nyas::SortKey(2, NyasCode_Default, G_Shaders.FullscreenImg, 0, NYAS_QUAD, 0.0f);
         new_frame.Push(draw);
     }
 }
 
+// Profiler window drawn over the default framebuffer with raw GL calls.
+void DrawProfiler()
+{
+    ImGui_ImplOpenGL3_NewFrame();
+    ImGui_ImplGlfw_NewFrame();
+    ImGui::NewFrame();
+
+    const NyasCtx *ctx = Nyas::GetCurrentCtx();
+    const NyasProfile &p = ctx->Profile;
+    ImGui::SetNextWindowPos(ImVec2(10.0f, 10.0f), ImGuiCond_FirstUseEver);
+    ImGui::Begin("Profiler (F1)");
+    int last = (p.History + NYAS_PROFILE_HISTORY - 1) % NYAS_PROFILE_HISTORY;
+    ImGui::Text("Frame %.2f ms  GPU %.2f ms", p.FrameMs[last], p.GpuMs);
+    if (p.GpuUntimed)
+    {
+        ImGui::Text("GPU time misses %d untimed commands", p.GpuUntimed);
+    }
+    ImGui::PlotLines("Frame ms", p.FrameMs, NYAS_PROFILE_HISTORY, p.History, NULL, 0.0f, 33.3f,
+        ImVec2(0.0f, 60.0f));
+    ImGui::PlotLines("GPU ms", p.GpuFrameMs, NYAS_PROFILE_HISTORY, p.History, NULL, 0.0f, 33.3f,
+        ImVec2(0.0f, 60.0f));
+    ImGui::Text("Draw calls %d", ctx->Stats.DrawCalls);
+    ImGui::Text("State changes %d (%d skipped)", ctx->Stats.StateCalls,
+        ctx->Stats.SkippedStateCalls);
+    ImGui::Text("Uploaded %.1f KB", (double)ctx->Stats.UploadBytes / 1024.0);
+    ImGui::Text("Dropped GPU frames %d", p.DroppedFrames);
+
+    if (ImGui::BeginTable("times", 3, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+    {
+        ImGui::TableSetupColumn("Scope / Shader");
+        ImGui::TableSetupColumn("ms");
+        ImGui::TableSetupColumn("Count");
+        ImGui::TableHeadersRow();
+        for (int i = 0; i < p.CpuCount + p.GpuCount; ++i)
+        {
+            bool cpu = i < p.CpuCount;
+            const NyasProfileTime &t = cpu ? p.Cpu[i] : p.Gpu[i - p.CpuCount];
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text("%s %s", cpu ? "CPU" : "GPU", t.Name);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.3f", t.Ms);
+            ImGui::TableNextColumn();
+            ImGui::Text("%d", t.Count);
+        }
+        ImGui::EndTable();
+    }
+    ImGui::End();
+
+    ImGui::Render();
+    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    Nyas::InvalidateState();
+}
+
+// Draws the same units with per-unit glDrawElementsInstanced calls and with one merged
+// glMultiDrawElementsIndirect, alternating every frame, and prints the average CPU times.
+void BenchMergedDraws(int units, int frames)
+{
+    const int warmup = 8;
+    NyasHandle meshes[3] = { NYAS_SPHERE, NYAS_CUBE, NYAS_QUAD };
+    int merged_meshes[3];
+    NyMergedMesh merged(Nyas::Meshes[NYAS_CUBE].Attribs, NY_MEGABYTES(4), 1 << 20);
+    for (int i = 0; i < 3; ++i)
+    {
+        merged_meshes[i] = merged.Add(meshes[i]);
+        if (merged_meshes[i] < 0)
+        {
+            return;
+        }
+    }
+
+    NyVec2i vp = Nyas::GetCurrentCtx()->Platform.WindowSize;
+    double draw_ms[2] = { 0.0, 0.0 };
+    double frame_ms[2] = { 0.0, 0.0 };
+    for (int f = 0; f < (warmup + frames) * 2; ++f)
+    {
+        int mdi = f & 1;
+        Nyas::Camera.OriginViewProj((float *)Nyas::Shaders[G_Shaders.Skybox].UnitBlock);
+        NyasDrawCmd draw;
+        draw.Framebuf = G_Framebuf;
+        draw.Shader = G_Shaders.Skybox;
+        draw.State.ViewportMaxX = vp.X;
+        draw.State.ViewportMaxY = vp.Y;
+        draw.State.BgColorA = 1.0f;
+        draw.State.EnableFlags |= NyasDrawFlags_ColorClear | NyasDrawFlags_DepthClear;
+        draw.Merged = mdi ? &merged : NULL;
+        draw.UnitCount = units;
+        draw.Units = (NyasDrawUnit *)NyFrameAllocator::Alloc(units * sizeof(NyasDrawUnit));
+        for (int i = 0; i < units; ++i)
+        {
+            draw.Units[i] = NyasDrawUnit();
+            draw.Units[i].Shader = G_Shaders.Skybox;
+            draw.Units[i].Mesh = mdi ? merged_meshes[i % 3] : meshes[i % 3];
+        }
+
+        NyChrono chrono;
+        Nyas::Draw(&draw);
+        double draw_time = NyChrono::MilliSeconds((double)chrono.Elapsed());
+        Nyas::PollIO();
+        Nyas::WindowSwap();
+        if (f >= warmup * 2)
+        {
+            draw_ms[mdi] += draw_time;
+            frame_ms[mdi] += NyChrono::MilliSeconds((double)chrono.Elapsed());
+        }
+    }
+
+    printf("%d units, %d frames each\n", units, frames);
+    printf("  per unit:       draw %.3f ms, frame %.3f ms\n", draw_ms[0] / frames,
+        frame_ms[0] / frames);
+    printf("  merged indirect: draw %.3f ms, frame %.3f ms\n", draw_ms[1] / frames,
+        frame_ms[1] / frames);
+}
+
 int main(int argc, char **argv)
 {
-    NY_UNUSED(argc), NY_UNUSED(argv);
-    Nyas::InitIO("NYAS PBR Material Demo", 1920, 1080);
+    int bench_units = 0;
+    bool render_thread = false;
+    int headless_frames = 0; // Frames drawn offscreen before exiting, the last one is saved.
+    const char *capture_dir = NULL; // Saves every frame there.
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--pack") && i + 1 < argc)
+        {
+            Nyas::MountPack(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--bench-azdo") && i + 1 < argc)
+        {
+            bench_units = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--render-thread"))
+        {
+            render_thread = true;
+        }
+        else if (!strcmp(argv[i], "--headless") && i + 1 < argc)
+        {
+            headless_frames = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--capture") && i + 1 < argc)
+        {
+            capture_dir = argv[++i];
+        }
+    }
+
+    bool headless = headless_frames > 0;
+    if (!Nyas::InitIO("NYAS PBR Material Demo", 1920, 1080, headless))
+    {
+        return 1;
+    }
     Nyas::Camera.Init(*Nyas::GetCurrentCtx());
     Init();
+    if (bench_units > 0)
+    {
+        BenchMergedDraws(bench_units, 200);
+        return 0;
+    }
+
+    NySched frame_sched(4);
+    G_FrameSched = &frame_sched;
+    // The overlay draws on the main thread, it is left out with the render thread.
+    bool overlay = !render_thread && !headless;
+    if (overlay)
+    {
+        ImGui::CreateContext();
+        ImGui::GetIO().IniFilename = NULL;
+        ImGui_ImplGlfw_InitForOpenGL(
+            (GLFWwindow *)Nyas::GetCurrentCtx()->Platform.InternalWindow, true);
+        ImGui_ImplOpenGL3_Init();
+    }
+
+    NyRenderThread *renderer = render_thread ? new NyRenderThread() : NULL;
     NyChrono frame_chrono;
-    while (!Nyas::GetCurrentCtx()->Platform.WindowClosed)
+    for (int frame_index = 0; !Nyas::GetCurrentCtx()->Platform.WindowClosed; ++frame_index)
     {
+        if (headless && frame_index == headless_frames)
+        {
+            break;
+        }
+
         // NewFrame
         float delta_time = NyChrono::Seconds((double)frame_chrono.Elapsed());
         frame_chrono.Restart();
-        Nyas::GetCurrentCtx()->Platform.DeltaTime = delta_time;
+        // Fixed steps offscreen, so captures do not depend on the machine.
+        Nyas::GetCurrentCtx()->Platform.DeltaTime = headless ? 1.0f / 60.0f : delta_time;
         // Build
         NyArray<NyasDrawCmd, NyFrameAllocator> frame;
-        BuildFrame(frame);
+        {
+            NYAS_PROFILE_SCOPE("build");
+            BuildFrame(frame);
+            Nyas::SortDraws(&frame[0], frame.Size);
+        }
 
-        // Render
-        for (int i = 0; i < frame.Size; ++i)
+        // Render, frames drawn by the render thread are not captured.
+        if (renderer)
         {
-            Nyas::Draw(&frame[i]);
+            NYAS_PROFILE_SCOPE("submit");
+            renderer->Submit(&frame[0], frame.Size);
+            continue;
         }
 
+        NyasProfile *profile = &Nyas::GetCurrentCtx()->Profile;
+        if (overlay && Nyas::GetCurrentCtx()->IO.Keys[NyasKey_F1] == NyasKeyState_DOWN)
+        {
+            profile->Enabled = !profile->Enabled;
+        }
+
+        {
+            NYAS_PROFILE_SCOPE("draw");
+            for (int i = 0; i < frame.Size; ++i)
+            {
+                Nyas::Draw(&frame[i]);
+            }
+        }
+
+        if (profile->Enabled)
+        {
+            DrawProfiler();
+        }
+
+        if (capture_dir)
+        {
+            char path[512];
+            snprintf(path, sizeof(path), "%s/frame_%04d.ppm", capture_dir, frame_index);
+            Nyas::SaveFrame(path);
+        }
+        else if (headless && frame_index == headless_frames - 1)
+        {
+            Nyas::SaveFrame("frame.ppm");
+        }
         Nyas::WindowSwap();
     }
 
+    if (renderer)
+    {
+        delete renderer;
+    }
+    else if (overlay)
+    {
+        ImGui_ImplOpenGL3_Shutdown();
+        ImGui_ImplGlfw_Shutdown();
+        ImGui::DestroyContext();
+    }
     return 0;
 }
@@ -0,0 +1,554 @@
+// Microbenchmarks of the containers, allocators and scheduler in nyas.h, next to the std
+// equivalents. Every case is repeated and the nanoseconds per operation of each repetition are
+// printed as JSON.
+//
+// nyas_microbench [--repeats N] [--threads N] [--filter text] [--out path]
+
+#include "nyas.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <future>
+#include <memory_resource>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct MicroConfig
+{
+    int Repeats;
+    int Threads; // Largest scheduler thread count, doubled from 1.
+    const char *Filter;
+    const char *Out;
+};
+
+struct MicroResult
+{
+    const char *Group;
+    char Name[64];
+    int Ops; // Operations of each repetition.
+    NyArray<float> NsPerOp;
+};
+
+// Small trivially copyable element, like most of the pooled resources.
+struct MicroItem
+{
+    float Pos[3];
+    int Id;
+};
+
+static MicroConfig G_Cfg;
+static NyArray<MicroResult *> G_Results;
+static volatile int64_t G_Sink; // Keeps the compiler from removing the measured work.
+static std::atomic<int> G_Done;
+
+static void Sink(int64_t value)
+{
+    G_Sink = G_Sink + value;
+}
+
+static MicroItem MakeItem(int i)
+{
+    return { { (float)i, 1.0f, 2.0f }, i };
+}
+
+// Scrambles 0..count-1 so lookups do not walk memory in order.
+static void Shuffle(int *ids, int count, unsigned int seed)
+{
+    for (int i = count - 1; i > 0; --i)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        int j = (int)((seed >> 8) % (unsigned int)(i + 1));
+        int tmp = ids[i];
+        ids[i] = ids[j];
+        ids[j] = tmp;
+    }
+}
+
+// Calls fn Repeats times, fn measures its own region with NyChrono and returns the nanoseconds,
+// so setup and teardown stay out of the numbers.
+template<typename F> static void Run(const char *group, const char *name, int ops, F fn)
+{
+    char full[128];
+    snprintf(full, sizeof(full), "%s/%s", group, name);
+    if (G_Cfg.Filter && !strstr(full, G_Cfg.Filter))
+    {
+        return;
+    }
+
+    MicroResult *r = new MicroResult();
+    r->Group = group;
+    snprintf(r->Name, sizeof(r->Name), "%s", name);
+    r->Ops = ops;
+    fn(); // Warms caches and the allocator.
+    for (int i = 0; i < G_Cfg.Repeats; ++i)
+    {
+        r->NsPerOp.Push((float)((double)fn() / ops));
+    }
+    G_Results.Push(r);
+    fprintf(stderr, "%-40s %10.2f ns/op\n", full, r->NsPerOp[r->NsPerOp.Size / 2]);
+}
+
+// ---
+// [CONTAINERS]
+// ---
+
+static void BenchArray()
+{
+    const int n = 1 << 20;
+    Run("array", "NyArray.Push", n, [&]() {
+        NyArray<MicroItem> a;
+        NyChrono chrono;
+        for (int i = 0; i < n; ++i)
+        {
+            a.Push(MakeItem(i));
+        }
+        int64_t ns = chrono.Elapsed();
+        Sink(a.Back().Id);
+        return ns;
+    });
+
+    Run("array", "std::vector.push_back", n, [&]() {
+        std::vector<MicroItem> v;
+        NyChrono chrono;
+        for (int i = 0; i < n; ++i)
+        {
+            v.push_back(MakeItem(i));
+        }
+        int64_t ns = chrono.Elapsed();
+        Sink(v.back().Id);
+        return ns;
+    });
+
+    NyArray<MicroItem> a(n);
+    std::vector<MicroItem> v;
+    v.reserve(n);
+    for (int i = 0; i < n; ++i)
+    {
+        a.Push(MakeItem(i));
+        v.push_back(MakeItem(i));
+    }
+
+    Run("array", "NyArray.Iterate", n, [&]() {
+        NyChrono chrono;
+        float sum = 0.0f;
+        for (int i = 0; i < a.Size; ++i)
+        {
+            sum += a[i].Pos[0];
+        }
+        int64_t ns = chrono.Elapsed();
+        Sink((int64_t)sum);
+        return ns;
+    });
+
+    Run("array", "std::vector.Iterate", n, [&]() {
+        NyChrono chrono;
+        float sum = 0.0f;
+        for (const MicroItem &item : v)
+        {
+            sum += item.Pos[0];
+        }
+        int64_t ns = chrono.Elapsed();
+        Sink((int64_t)sum);
+        return ns;
+    });
+
+    // Unordered removal, the way the renderer drops entries from its lists.
+    Run("array", "NyArray.RemoveSwap", n, [&]() {
+        NyArray<MicroItem> r(n);
+        memcpy((void *)&r[0], &a[0], n * sizeof(MicroItem));
+        r.Size = n;
+        NyChrono chrono;
+        while (r.Size)
+        {
+            int i = (r.Size * 7) >> 3;
+            r[i] = r.Back();
+            r.Pop();
+        }
+        int64_t ns = chrono.Elapsed();
+        Sink(r.Size);
+        return ns;
+    });
+
+    Run("array", "std::vector.RemoveSwap", n, [&]() {
+        std::vector<MicroItem> r(v);
+        NyChrono chrono;
+        while (!r.empty())
+        {
+            size_t i = (r.size() * 7) >> 3;
+            r[i] = r.back();
+            r.pop_back();
+        }
+        int64_t ns = chrono.Elapsed();
+        Sink((int64_t)r.size());
+        return ns;
+    });
+}
+
+static void BenchPool()
+{
+    const int n = 1 << 18;
+    int *ids = (int *)malloc(n * sizeof(int));
+    for (int i = 0; i < n; ++i)
+    {
+        ids[i] = i;
+    }
+    Shuffle(ids, n, 7);
+
+    Run("pool", "NyPool.Add", n, [&]() {
+        NyPool<MicroItem> p;
+        NyChrono chrono;
+        for (int i = 0; i < n; ++i)
+        {
+            Sink(p.Add(MakeItem(i)));
+        }
+        return chrono.Elapsed();
+    });
+
+    Run("pool", "std::unordered_map.emplace", n, [&]() {
+        std::unordered_map<int, MicroItem> m;
+        NyChrono chrono;
+        for (int i = 0; i < n; ++i)
+        {
+            m.emplace(i, MakeItem(i));
+        }
+        int64_t ns = chrono.Elapsed();
+        Sink((int64_t)m.size());
+        return ns;
+    });
+
+    NyPool<MicroItem> p(n);
+    std::unordered_map<int, MicroItem> m;
+    for (int i = 0; i < n; ++i)
+    {
+        p.Add(MakeItem(i));
+        m.emplace(i, MakeItem(i));
+    }
+
+    Run("pool", "NyPool.Lookup", n, [&]() {
+        NyChrono chrono;
+        int sum = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            sum += p[ids[i]].Id;
+        }
+        int64_t ns = chrono.Elapsed();
+        Sink(sum);
+        return ns;
+    });
+
+    Run("pool", "std::unordered_map.find", n, [&]() {
+        NyChrono chrono;
+        int sum = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            sum += m.find(ids[i])->second.Id;
+        }
+        int64_t ns = chrono.Elapsed();
+        Sink(sum);
+        return ns;
+    });
+
+    // Releases a scattered half and fills it again, ids come back through the free list.
+    Run("pool", "NyPool.RemoveAdd", n, [&]() {
+        NyChrono chrono;
+        for (int i = 0; i < n / 2; ++i)
+        {
+            p.Remove(ids[i]);
+        }
+        for (int i = 0; i < n / 2; ++i)
+        {
+            Sink(p.Add(MakeItem(i)));
+        }
+        return chrono.Elapsed();
+    });
+
+    Run("pool", "std::unordered_map.EraseEmplace", n, [&]() {
+        NyChrono chrono;
+        for (int i = 0; i < n / 2; ++i)
+        {
+            m.erase(ids[i]);
+        }
+        for (int i = 0; i < n / 2; ++i)
+        {
+            m.emplace(ids[i], MakeItem(i));
+        }
+        int64_t ns = chrono.Elapsed();
+        Sink((int64_t)m.size());
+        return ns;
+    });
+
+    free(ids);
+}
+
+// ---
+// [ALLOCATORS]
+// ---
+
+template<typename A> static int64_t AllocBatch(void **ptrs, int count, size_t size)
+{
+    NyChrono chrono;
+    for (int i = 0; i < count; ++i)
+    {
+        ptrs[i] = A::Alloc(size);
+    }
+    int64_t ns = chrono.Elapsed();
+    for (int i = 0; i < count; ++i)
+    {
+        Sink((int64_t)(uintptr_t)ptrs[i]);
+        A::Free(ptrs[i]);
+    }
+    return ns;
+}
+
+// Latency of a single allocation is below the timer resolution, each repetition times a batch.
+static void BenchAllocators()
+{
+    const int n = 1024;
+    const size_t sizes[] = { 16, 256, 4096 };
+    void **ptrs = (void **)malloc(n * sizeof(void *));
+    alignas(64) static char arena[n * 4096];
+    char name[64];
+    for (size_t size : sizes)
+    {
+        snprintf(name, sizeof(name), "NyAllocator/%zu", size);
+        Run("alloc", name, n, [&]() { return AllocBatch<NyAllocator>(ptrs, n, size); });
+
+        snprintf(name, sizeof(name), "NyFrameAllocator/%zu", size);
+        Run("alloc", name, n, [&]() { return AllocBatch<NyFrameAllocator>(ptrs, n, size); });
+
+        snprintf(name, sizeof(name), "NyThreadFrameAllocator/%zu", size);
+        Run("alloc", name, n, [&]() { return AllocBatch<NyThreadFrameAllocator>(ptrs, n, size); });
+
+        snprintf(name, sizeof(name), "operator.new/%zu", size);
+        Run("alloc", name, n, [&]() {
+            NyChrono chrono;
+            for (int i = 0; i < n; ++i)
+            {
+                ptrs[i] = ::operator new(size);
+            }
+            int64_t ns = chrono.Elapsed();
+            for (int i = 0; i < n; ++i)
+            {
+                ::operator delete(ptrs[i]);
+            }
+            return ns;
+        });
+
+        // Closest std counterpart of the frame allocators, bump allocation in a reused buffer.
+        snprintf(name, sizeof(name), "std::pmr::monotonic/%zu", size);
+        Run("alloc", name, n, [&]() {
+            std::pmr::monotonic_buffer_resource res(arena, sizeof(arena));
+            NyChrono chrono;
+            for (int i = 0; i < n; ++i)
+            {
+                ptrs[i] = res.allocate(size);
+            }
+            int64_t ns = chrono.Elapsed();
+            Sink((int64_t)(uintptr_t)ptrs[n - 1]);
+            return ns;
+        });
+    }
+    free(ptrs);
+}
+
+// ---
+// [SCHEDULER]
+// ---
+
+static void CountJob(void *args)
+{
+    NY_UNUSED(args);
+    G_Done.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void BenchSched()
+{
+    const int jobs = 4096;
+    const int trips = 256;
+    char name[64];
+    for (int threads = 0; threads <= G_Cfg.Threads; threads = threads ? threads * 2 : 1)
+    {
+        NySched sched(threads);
+
+        // Queueing and running a batch of tiny jobs, per job.
+        snprintf(name, sizeof(name), "NySched.Dispatch/%d", threads);
+        Run("sched", name, jobs, [&]() {
+            G_Done = 0;
+            NyChrono chrono;
+            for (int i = 0; i < jobs; ++i)
+            {
+                sched.Do(NySched::Job(CountJob, NULL));
+            }
+            sched.Wait();
+            int64_t ns = chrono.Elapsed();
+            Sink(G_Done);
+            return ns;
+        });
+
+        // One job and the wait for it, the wake up and idle signal cost of a sync point.
+        snprintf(name, sizeof(name), "NySched.DoWait/%d", threads);
+        Run("sched", name, trips, [&]() {
+            NyChrono chrono;
+            for (int i = 0; i < trips; ++i)
+            {
+                sched.Do(NySched::Job(CountJob, NULL));
+                sched.Wait();
+            }
+            return chrono.Elapsed();
+        });
+    }
+
+    Run("sched", "std::async.Dispatch", trips, [&]() {
+        std::vector<std::future<void>> futures;
+        futures.reserve(trips);
+        G_Done = 0;
+        NyChrono chrono;
+        for (int i = 0; i < trips; ++i)
+        {
+            futures.push_back(std::async(std::launch::async, CountJob, (void *)NULL));
+        }
+        for (std::future<void> &f : futures)
+        {
+            f.wait();
+        }
+        int64_t ns = chrono.Elapsed();
+        Sink(G_Done);
+        return ns;
+    });
+
+    Run("sched", "std::thread.DoWait", trips, [&]() {
+        NyChrono chrono;
+        for (int i = 0; i < trips; ++i)
+        {
+            std::thread t(CountJob, (void *)NULL);
+            t.join();
+        }
+        return chrono.Elapsed();
+    });
+}
+
+// ---
+// [REPORT]
+// ---
+
+static int CompareFloat(const void *a, const void *b)
+{
+    float fa = *(const float *)a;
+    float fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+static void PrintResult(FILE *f, MicroResult *r, bool last)
+{
+    NyArray<float> &s = r->NsPerOp;
+    qsort(&s[0], s.Size, sizeof(float), CompareFloat);
+    double mean = 0.0;
+    for (int i = 0; i < s.Size; ++i)
+    {
+        mean += s[i];
+    }
+    mean /= s.Size;
+
+    int p95 = (int)(0.95f * s.Size + 0.999f) - 1;
+    float p50 = s[s.Size / 2];
+    fprintf(f,
+        "    { \"group\": \"%s\", \"name\": \"%s\", \"ops\": %d, \"repeats\": %d, "
+        "\"ns_per_op\": { \"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, \"p95\": %.3f }, "
+        "\"mops_per_s\": %.3f }%s\n",
+        r->Group, r->Name, r->Ops, s.Size, mean, s[0], p50, s[p95 < 0 ? 0 : p95],
+        p50 > 0.0f ? 1000.0 / p50 : 0.0, last ? "" : ",");
+}
+
+static void PrintReport(FILE *f)
+{
+    fprintf(f, "{\n");
+    fprintf(f, "  \"config\": { \"repeats\": %d, \"threads\": %d, \"hardware_threads\": %u },\n",
+        G_Cfg.Repeats, G_Cfg.Threads, std::thread::hardware_concurrency());
+    fprintf(f, "  \"results\": [\n");
+    for (int i = 0; i < G_Results.Size; ++i)
+    {
+        PrintResult(f, G_Results[i], i == G_Results.Size - 1);
+    }
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+}
+
+static int ParseArgs(int argc, char **argv, MicroConfig *cfg)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value)
+        {
+            fprintf(stderr, "Missing value of %s.\n", arg);
+            return NyasError_BadArg;
+        }
+        ++i;
+
+        if (!strcmp(arg, "--repeats"))
+        {
+            cfg->Repeats = atoi(value);
+        }
+        else if (!strcmp(arg, "--threads"))
+        {
+            cfg->Threads = atoi(value);
+        }
+        else if (!strcmp(arg, "--filter"))
+        {
+            cfg->Filter = value;
+        }
+        else if (!strcmp(arg, "--out"))
+        {
+            cfg->Out = value;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown argument %s.\n", arg);
+            return NyasError_BadArg;
+        }
+    }
+
+    if (cfg->Repeats < 1 || cfg->Threads < 0)
+    {
+        fprintf(stderr, "Repeats has to be positive and threads not negative.\n");
+        return NyasError_BadArg;
+    }
+    return NyasCode_Ok;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int hw = std::thread::hardware_concurrency();
+    G_Cfg = { 15, hw > 1 ? (int)hw : 2, NULL, NULL };
+    if (ParseArgs(argc, argv, &G_Cfg) != NyasCode_Ok)
+    {
+        return 1;
+    }
+
+    BenchArray();
+    BenchPool();
+    BenchAllocators();
+    BenchSched();
+
+    FILE *out = G_Cfg.Out ? fopen(G_Cfg.Out, "w") : stdout;
+    if (!out)
+    {
+        fprintf(stderr, "Could not open %s.\n", G_Cfg.Out);
+        return 1;
+    }
+    PrintReport(out);
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    for (int i = 0; i < G_Results.Size; ++i)
+    {
+        delete G_Results[i];
+    }
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include "nyas.h"
+#include "azdo.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -7,8 +8,20 @@
 #include <glad/glad.h>
 
 #include <GLFW/glfw3.h>
+#include <fcntl.h>
 #include <mathc.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define NYAS_IO_URING
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -16,6 +29,13 @@
 #define TINYOBJ_LOADER_C_IMPLEMENTATION
 #include "tinyobj_loader_c.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NYAS_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define MEM_ALIGN 8
 #define MEM_ALIGN_MOD(ADDRESS) ((ADDRESS) & (MEM_ALIGN - 1))
 
@@ -47,26 +67,122 @@ struct _NyScheduler
     NyArray<pthread_t> Threads;
     pthread_mutex_t Mtx;
     pthread_cond_t Cond;
+    pthread_cond_t Idle; // Signaled when the queue is empty and every worker is waiting.
     int Waiting;
     NyasSchedState State;
 
     _NyScheduler() : Waiting(0), State(NyasSchedState_None) {}
 };
 
+typedef int NyasUploadKind;
+enum NyasUploadKind_
+{
+    NyasUploadKind_Tex,
+    NyasUploadKind_Vtx,
+    NyasUploadKind_Idx,
+    NyasUploadKind_COUNT
+};
+
+// Pending GPU upload of one texture image or one mesh buffer.
+struct _NyUpload
+{
+    NyasUploadKind Kind;
+    NyasHandle Res; // NyasCode_None if cancelled.
+    int Img; // Texture image index.
+    int64_t Done; // Rows (textures) or bytes (buffers) already staged.
+};
+
+struct _NyUploadBudget
+{
+    int64_t Bytes;
+    int64_t Used;
+    int64_t MicroSeconds;
+    NyChrono Chrono;
+
+    inline bool Exhausted()
+    {
+        return Used >= Bytes || NyChrono::MicroSeconds(Chrono.Elapsed()) >= MicroSeconds;
+    }
+};
+
+// Asset pack layout (all offsets from the start of the file):
+// [NyasPakHeader][NyasPakEntry * EntryCount][uint32_t * SlotCount][names][aligned entry data]
+// Slots are an open addressing table (linear probing) of entry index + 1, 0 for empty slots.
+#define NYAS_PAK_MAGIC "NYAS_PAK"
+#define NYAS_PAK_VERSION 1
+
+struct NyasPakHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t EntryCount;
+    uint32_t SlotCount; // Power of two.
+    uint32_t Align;
+    uint64_t EntriesOffset;
+    uint64_t SlotsOffset;
+    uint64_t NamesOffset;
+    uint64_t DataOffset;
+};
+
+struct NyasPakEntry
+{
+    uint64_t Hash;
+    uint64_t Offset;
+    uint64_t Size;
+    uint32_t NameOffset; // From NamesOffset, null-terminated.
+    uint32_t NameSize;
+};
+
+struct _NyPack
+{
+    const char *Base;
+    size_t Size;
+    const NyasPakHeader *Header;
+    const NyasPakEntry *Entries;
+    const uint32_t *Slots;
+    const char *Names;
+};
+
+// FNV-1a.
+static inline uint64_t _NyHash(const void *data, size_t size, uint64_t h = 14695981039346656037ULL)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        h = (h ^ ((const uint8_t *)data)[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static inline int64_t _NyAlign(int64_t size)
+{
+    return size + ((MEM_ALIGN - MEM_ALIGN_MOD(size)) & (MEM_ALIGN - 1));
+}
+
 // ---
 // [PRIVATE]
 // ---
 void _NyCreateTex(NyasTexture *t);
 void _NySetTex(NyasTexture *t);
+void _NyAllocTex(NyasTexture *t);
+void _NyFinishTex(NyasTexture *t);
 void _NyReleaseTex(uint32_t *id);
 
 void _NyCreateMesh(uint32_t *id, uint32_t *vid, uint32_t *iid);
 void _NyUseMesh(NyasMesh *m, NyasShader *s);
-void _NySetMesh(NyasMesh *mesh, uint32_t shader_id);
+void _NyAllocMesh(NyasMesh *mesh, uint32_t shader_id);
 void _NyReleaseMesh(uint32_t *id, uint32_t *vid, uint32_t *iid);
+int _NyVtxStride(NyasVtxAttribFlags attribs);
+
+void _NyCreateMergedMesh(NyMergedMesh *mm);
+void _NyAllocMergedMesh(NyMergedMesh *mm, uint32_t shader_id);
+void _NyWriteMergedMesh(NyMergedMesh *mm, const NyMeshOffset *range, const NyasMesh *src);
+void _NyDrawIndirect(NyMergedMesh *mm);
+void _NyReleaseMergedMesh(NyMergedMesh *mm);
 
 void _NyCreateShader(uint32_t *id);
-void _NyCompileShader(uint32_t id, const char *name, NyasShader *shader);
+void _NySubmitShader(NyasShader *s, const char *vert, size_t vert_size, const char *frag,
+    size_t frag_size);
+bool _NyFinishShader(NyasShader *s);
 void _NyUseShader(uint32_t id);
 void _NyReleaseShader(uint32_t id);
 void _NyShaderLocations(uint32_t id, int *o_loc, const char **i_unif, int count);
@@ -74,15 +190,34 @@ void _NySetShaderData(int loc, float *data, int v4count);
 void _NySetShaderTex(int loc, int *tex, int count, int texunit_offset);
 void _NySetShaderCubemap(int loc, int *tex, int count, int texunit_offset);
 void _NySetShaderTexArray(int loc, int *tex, int count, int texunit_offset);
-void _NySetShaderUniformBuffer(NyasShader *shader);
+void _NySetShaderUniformBuffer(NyasShader *shader, const void *unit, const void *shared);
+void _NySetShaderUnitBlock(NyasShader *shader, const void *unit, int offset);
 
 void _NyCreateFramebuf(NyasFramebuffer *fb);
 void _NySetFramebuf(uint32_t fb_id, uint32_t tex_id, NyasTexTarget *tt);
 void _NyUseFramebuf(uint32_t id);
 void _NyReleaseFramebuf(NyasFramebuffer *fb);
 
+bool _NyStagingBegin(int64_t *capacity);
+int64_t _NyStagingPush(const void *src, int64_t size);
+void _NyStagingTex(NyasTexture *t, NyasTexImg *img, int y, int rows, int64_t offset);
+void _NyStagingBuf(uint32_t buf, int64_t dst_offset, int64_t src_offset, int64_t size);
+void _NyStagingEnd();
+void _NyUniformRingEnd();
+void _NySyncInstances(
+    NyasInstanceBuffer *inst, const char *data, int count, int pending_begin, int pending_end);
+void _NyReleaseInstances(NyasInstanceBuffer *inst);
+bool _NyInstanceBuffersSupported();
+void _NySetShaderInstanceBase(int loc, int first);
+
+void _NyInvalidateState();
+void _NyFrameStats(NyasStats *stats);
+void _NyReadFramebuffer(int w, int h, uint8_t *rgb); // Default one, bottom row first.
+bool _NyTimerBegin(int frame, int idx);
+void _NyTimerEnd();
+bool _NyTimerResult(int frame, int idx, float *ms); // False while the query is not done.
 void _NyClear(bool color = true, bool depth = true, bool stencil = false);
-void _NyDraw(int elem_count, int index_type, int instances = 1);
+void _NyDraw(int elem_count, int index_type, int instances = 1, int64_t first = 0);
 void _NyClearColor(float r = 0.0f, float g = 0.0f, float b = 0.0f, float a = 1.0f);
 void _NyEnableScissor();
 void _NyDisableScissor();
@@ -117,6 +252,9 @@ NyPool<NyasFramebuffer> Framebufs;
 NyPool<NyasEntity> Entities;
 NyasCamera Camera;
 
+static NyArray<_NyUpload> G_Uploads;
+static int G_UploadHead = 0;
+
 static inline void _NyReadInput(void)
 {
     NYAS_KEY_UPDATE(NyasKey_Invalid);
@@ -273,27 +411,40 @@ NyasCtx *GetCurrentCtx()
     return G_Ctx;
 }
 
-bool InitIO(const char *title, int win_w, int win_h)
+bool InitIO(const char *title, int win_w, int win_h, bool headless)
 {
     memset(&G_Ctx->IO, 0, sizeof(G_Ctx->IO));
     if (!glfwInit())
     {
+        NYAS_LOG_ERR("GLFW init failed.");
+        if (headless)
+        {
+            NYAS_LOG_ERR("Without a display GLFW has to be built for OSMesa (NYAS_HEADLESS).");
+        }
         return false;
     }
 
+    if (headless)
+    {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    }
+
     G_Ctx->Platform.InternalWindow = glfwCreateWindow(win_w, win_h, title, NULL, NULL);
     if (!G_Ctx->Platform.InternalWindow)
     {
         glfwTerminate();
         return false;
     }
+    G_Ctx->Platform.Headless = headless;
 
     glfwMakeContextCurrent((GLFWwindow *)G_Ctx->Platform.InternalWindow);
 #ifndef __EMSCRIPTEN__
     gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
 #endif
+    _NyInvalidateState();
 
-    glfwSwapInterval(1);
+    glfwSwapInterval(headless ? 0 : 1);
     glfwSetScrollCallback((GLFWwindow *)G_Ctx->Platform.InternalWindow, _NyScrollCallback);
     glfwSetCursorEnterCallback((GLFWwindow *)G_Ctx->Platform.InternalWindow, _NyCursorEnterCallback);
     glfwSetWindowFocusCallback((GLFWwindow *)G_Ctx->Platform.InternalWindow, _NyWindowFocusCallback);
@@ -307,12 +458,165 @@ bool InitIO(const char *title, int win_w, int win_h)
     G_Ctx->Cfg.Navigation.Speed = 10.0f;
     G_Ctx->Cfg.Navigation.DragSensibility = 0.001f;
     G_Ctx->Cfg.Navigation.ScrollSensibility = 1.0f;
+    G_Ctx->Cfg.Upload.FrameBytes = NYAS_UPLOAD_FRAME_BYTES;
+    G_Ctx->Cfg.Upload.FrameMicroSeconds = NYAS_UPLOAD_FRAME_US;
 
     PollIO();
     return true;
 }
 
-int ReadFile(const char *path, char **dst, size_t *size)
+static NyArray<_NyPack> G_Packs;
+
+static const char *_PakPath(const char *path)
+{
+    while (path[0] == '.' && path[1] == '/')
+    {
+        path += 2;
+    }
+    return path;
+}
+
+static uint64_t _PakHash(const char *path)
+{
+    return _NyHash(path, strlen(path));
+}
+
+static const NyasPakEntry *_PakFind(const _NyPack *pak, const char *path, uint64_t hash)
+{
+    uint32_t mask = pak->Header->SlotCount - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        uint32_t slot = pak->Slots[i];
+        if (!slot)
+        {
+            return NULL;
+        }
+
+        const NyasPakEntry *e = &pak->Entries[slot - 1];
+        if (e->Hash == hash && !strcmp(pak->Names + e->NameOffset, path))
+        {
+            return e;
+        }
+    }
+}
+
+// Most recently mounted packs take precedence.
+static bool _PakLookup(const char *path, NyasFileView *view)
+{
+    path = _PakPath(path);
+    uint64_t hash = _PakHash(path);
+    for (int i = G_Packs.Size - 1; i >= 0; --i)
+    {
+        const NyasPakEntry *e = _PakFind(&G_Packs[i], path, hash);
+        if (e)
+        {
+            view->Data = G_Packs[i].Base + e->Offset;
+            view->Size = e->Size;
+            view->Owned = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Entries must point inside the pack with null-terminated names, slots must reference existing
+// entries and leave at least one slot empty so probing in _PakFind ends.
+static bool _PakValid(const _NyPack *pak)
+{
+    const NyasPakHeader *h = pak->Header;
+    uint64_t names_size = h->DataOffset - h->NamesOffset;
+    for (uint32_t i = 0; i < h->EntryCount; ++i)
+    {
+        const NyasPakEntry *e = &pak->Entries[i];
+        if (e->Offset > pak->Size || e->Size > pak->Size - e->Offset ||
+            e->NameOffset >= names_size ||
+            !memchr(pak->Names + e->NameOffset, '\0', names_size - e->NameOffset))
+        {
+            return false;
+        }
+    }
+
+    bool empty_slot = false;
+    for (uint32_t i = 0; i < h->SlotCount; ++i)
+    {
+        if (pak->Slots[i] > h->EntryCount)
+        {
+            return false;
+        }
+        empty_slot |= !pak->Slots[i];
+    }
+    return empty_slot;
+}
+
+bool MountPack(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        NYAS_LOG_ERR("Pack open failed for %s.", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(NyasPakHeader))
+    {
+        NYAS_LOG_ERR("Invalid pack %s.", path);
+        close(fd);
+        return false;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        NYAS_LOG_ERR("Pack mapping failed for %s.", path);
+        return false;
+    }
+
+    _NyPack pak;
+    pak.Base = (const char *)base;
+    pak.Size = st.st_size;
+    pak.Header = (const NyasPakHeader *)base;
+    const NyasPakHeader *h = pak.Header;
+    // Regions are compared by subtraction so crafted offsets can not wrap around.
+    if (memcmp(h->Magic, NYAS_PAK_MAGIC, 8) || h->Version != NYAS_PAK_VERSION ||
+        !h->SlotCount || (h->SlotCount & (h->SlotCount - 1)) || h->SlotCount <= h->EntryCount ||
+        h->EntriesOffset < sizeof(NyasPakHeader) || h->EntriesOffset > h->SlotsOffset ||
+        h->SlotsOffset > h->NamesOffset || h->NamesOffset > h->DataOffset ||
+        h->DataOffset > pak.Size ||
+        h->EntryCount > (h->SlotsOffset - h->EntriesOffset) / sizeof(NyasPakEntry) ||
+        h->SlotCount > (h->NamesOffset - h->SlotsOffset) / sizeof(uint32_t))
+    {
+        NYAS_LOG_ERR("Header of pack %s is invalid.", path);
+        munmap(base, st.st_size);
+        return false;
+    }
+
+    pak.Entries = (const NyasPakEntry *)(pak.Base + h->EntriesOffset);
+    pak.Slots = (const uint32_t *)(pak.Base + h->SlotsOffset);
+    pak.Names = pak.Base + h->NamesOffset;
+    if (!_PakValid(&pak))
+    {
+        NYAS_LOG_ERR("Table of pack %s is invalid.", path);
+        munmap(base, st.st_size);
+        return false;
+    }
+
+    madvise(base, st.st_size, MADV_WILLNEED);
+    G_Packs.Push(pak);
+    return true;
+}
+
+void UnmountPacks()
+{
+    for (int i = 0; i < G_Packs.Size; ++i)
+    {
+        munmap((void *)G_Packs[i].Base, G_Packs[i].Size);
+    }
+    G_Packs.Size = 0;
+}
+
+static int _DiskReadFile(const char *path, char **dst, size_t *size)
 {
     FILE *f = fopen(path, "rb");
     if (!f)
@@ -346,6 +650,156 @@ int ReadFile(const char *path, char **dst, size_t *size)
     return NyasCode_Ok;
 }
 
+int ReadFile(const char *path, char **dst, size_t *size)
+{
+    NyasFileView view;
+    if (_PakLookup(path, &view))
+    {
+        *size = view.Size + 1;
+        *dst = (char *)NYAS_ALLOC(*size);
+        if (!*dst)
+        {
+            NYAS_LOG_ERR("Alloc (%lu bytes) failed.", *size);
+            return NyasError_Alloc;
+        }
+        memcpy(*dst, view.Data, view.Size);
+        (*dst)[view.Size] = '\0';
+        return NyasCode_Ok;
+    }
+
+    if (G_Ctx->Platform.ReadFile)
+    {
+        return G_Ctx->Platform.ReadFile(path, dst, size);
+    }
+    return _DiskReadFile(path, dst, size);
+}
+
+int FileView(const char *path, NyasFileView *view)
+{
+    if (_PakLookup(path, view))
+    {
+        return NyasCode_Ok;
+    }
+
+    char *data;
+    size_t size;
+    int err = ReadFile(path, &data, &size);
+    if (err != NyasCode_Ok)
+    {
+        *view = NyasFileView();
+        return err;
+    }
+
+    view->Data = data;
+    view->Size = size - 1;
+    view->Owned = true;
+    return NyasCode_Ok;
+}
+
+void ReleaseFileView(NyasFileView *view)
+{
+    if (view->Owned)
+    {
+        NYAS_FREE((void *)view->Data);
+    }
+    *view = NyasFileView();
+}
+
+int BuildPack(const char *pack_path, const char *const *files, int count)
+{
+    uint32_t slot_count = 16;
+    while (slot_count < (uint32_t)count * 2)
+    {
+        slot_count <<= 1;
+    }
+
+    NyasPakHeader h;
+    memcpy(h.Magic, NYAS_PAK_MAGIC, 8);
+    h.Version = NYAS_PAK_VERSION;
+    h.EntryCount = count;
+    h.SlotCount = slot_count;
+    h.Align = NYAS_PAK_ALIGN;
+    h.EntriesOffset = sizeof(NyasPakHeader);
+    h.SlotsOffset = h.EntriesOffset + count * sizeof(NyasPakEntry);
+    h.NamesOffset = h.SlotsOffset + slot_count * sizeof(uint32_t);
+
+    NyArray<NyasPakEntry> entries(count);
+    NyBuffer<uint32_t> slots(slot_count);
+    memset(slots.Data, 0, slot_count * sizeof(uint32_t));
+    uint32_t names_size = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        NyasPakEntry e;
+        const char *name = _PakPath(files[i]);
+        e.Hash = _PakHash(name);
+        e.NameOffset = names_size;
+        e.NameSize = (uint32_t)strlen(name);
+        names_size += e.NameSize + 1;
+        entries.Push(e);
+
+        uint32_t mask = slot_count - 1;
+        uint32_t s = e.Hash & mask;
+        while (slots[s])
+        {
+            s = (s + 1) & mask;
+        }
+        slots[s] = i + 1;
+    }
+
+    uint64_t offset = h.NamesOffset + names_size;
+    h.DataOffset = offset = (offset + NYAS_PAK_ALIGN - 1) & ~(uint64_t)(NYAS_PAK_ALIGN - 1);
+
+    FILE *f = fopen(pack_path, "wb");
+    if (!f)
+    {
+        NYAS_LOG_ERR("File open failed for %s.", pack_path);
+        return NyasError_File;
+    }
+
+    // Entry data first, the table of contents is written once every size is known.
+    int err = NyasCode_Ok;
+    for (int i = 0; i < count && err == NyasCode_Ok; ++i)
+    {
+        char *data;
+        size_t size;
+        err = _DiskReadFile(files[i], &data, &size);
+        if (err != NyasCode_Ok)
+        {
+            break;
+        }
+
+        entries[i].Offset = offset;
+        entries[i].Size = size - 1;
+        if (fseek(f, offset, SEEK_SET) || fwrite(data, 1, size - 1, f) != size - 1)
+        {
+            NYAS_LOG_ERR("File write failed for %s.", pack_path);
+            err = NyasError_File;
+        }
+        NYAS_FREE(data);
+        offset = (offset + size - 1 + NYAS_PAK_ALIGN - 1) & ~(uint64_t)(NYAS_PAK_ALIGN - 1);
+    }
+
+    if (err == NyasCode_Ok)
+    {
+        rewind(f);
+        fwrite(&h, sizeof(h), 1, f);
+        fwrite(entries.Buf.Data, sizeof(NyasPakEntry), count, f);
+        fwrite(slots.Data, sizeof(uint32_t), slot_count, f);
+        for (int i = 0; i < count; ++i)
+        {
+            fwrite(_PakPath(files[i]), 1, entries[i].NameSize + 1, f);
+        }
+        if (ferror(f))
+        {
+            NYAS_LOG_ERR("File write failed for %s.", pack_path);
+            err = NyasError_File;
+        }
+    }
+
+    fclose(f);
+    return err;
+}
+
 void PollIO(void)
 {
     NYAS_ASSERT(G_Ctx->Platform.InternalWindow && "The IO system is uninitalized");
@@ -366,9 +820,51 @@ void PollIO(void)
     }
 }
 
+int SaveFrame(const char *path)
+{
+    int w = G_Ctx->Platform.WindowSize.X;
+    int h = G_Ctx->Platform.WindowSize.Y;
+    int64_t row = (int64_t)w * 3;
+    uint8_t *rgb = (uint8_t *)NYAS_ALLOC(row * h);
+    _NyReadFramebuffer(w, h, rgb);
+
+    FILE *f = fopen(path, "wb");
+    if (!f)
+    {
+        NYAS_LOG_ERR("File open failed for %s.", path);
+        NYAS_FREE(rgb);
+        return NyasError_File;
+    }
+
+    // PPM rows go top to bottom.
+    bool ok = fprintf(f, "P6\n%d %d\n255\n", w, h) > 0;
+    for (int y = h - 1; y >= 0 && ok; --y)
+    {
+        ok = fwrite(rgb + y * row, 1, row, f) == (size_t)row;
+    }
+    fclose(f);
+    NYAS_FREE(rgb);
+
+    if (!ok)
+    {
+        NYAS_LOG_ERR("File write failed for %s.", path);
+        return NyasError_File;
+    }
+    return NyasCode_Ok;
+}
+
+static void _ProcessUploads(void);
+static void _PollShaderVariants(void);
+static void _ProfileFrameEnd(void);
+
 void WindowSwap(void)
 {
     NYAS_ASSERT(G_Ctx->Platform.InternalWindow && "The IO system is uninitalized");
+    _PollShaderVariants();
+    _ProcessUploads();
+    _NyUniformRingEnd();
+    _NyFrameStats(&G_Ctx->Stats);
+    _ProfileFrameEnd();
     glfwSwapBuffers((GLFWwindow *)G_Ctx->Platform.InternalWindow);
 }
 
@@ -413,7 +909,7 @@ const char *_GetImgFacePath(const char *path, int face, int face_count)
             const char *suffixes = "RLUDFB";
             static char buffer[1024];
             int count = snprintf(buffer, 1024, path, suffixes[face]);
-            if (count < 1024)
+            if (count >= 1024)
             {
                 NYAS_LOG_ERR("Cubemap face path format: %s is too long!", path);
                 return NULL;
@@ -429,13 +925,17 @@ static int _TexChannels(NyasTexFmt fmt)
 {
     switch (fmt)
     {
+        case NyasTexFmt_RGBA_32F:
         case NyasTexFmt_RGBA_16F:
         case NyasTexFmt_RGBA_8: return 4;
+        case NyasTexFmt_RGB_32F:
         case NyasTexFmt_RGB_16F:
         case NyasTexFmt_RGB_8:
         case NyasTexFmt_SRGB_8: return 3;
+        case NyasTexFmt_RG_32F:
         case NyasTexFmt_RG_16F:
         case NyasTexFmt_RG_8: return 2;
+        case NyasTexFmt_R_32F:
         case NyasTexFmt_R_16F:
         case NyasTexFmt_R_8: return 1;
         default: return 0;
@@ -454,19 +954,67 @@ static int _TexFaces(NyasTexType type)
     }
 }
 
+// Bytes per pixel as read by the GPU upload.
+static int _TexPixelSize(NyasTexFmt fmt)
+{
+    switch (fmt)
+    {
+        case NyasTexFmt_R_8: return 1;
+        case NyasTexFmt_RG_8:
+        case NyasTexFmt_R_16F: return 2;
+        case NyasTexFmt_RGB_8:
+        case NyasTexFmt_SRGB_8: return 3;
+        case NyasTexFmt_RGBA_8:
+        case NyasTexFmt_RG_16F:
+        case NyasTexFmt_R_32F:
+        case NyasTexFmt_Depth: return 4;
+        case NyasTexFmt_RGB_16F: return 6;
+        case NyasTexFmt_RGBA_16F:
+        case NyasTexFmt_RG_32F: return 8;
+        case NyasTexFmt_RGB_32F: return 12;
+        case NyasTexFmt_RGBA_32F: return 16;
+        default: return 0;
+    }
+}
+
 static bool _TexFmtFloat(NyasTexFmt fmt)
 {
     switch (fmt)
     {
         case NyasTexFmt_RGBA_16F:
         case NyasTexFmt_RGB_16F:
+        case NyasTexFmt_RG_16F:
+        case NyasTexFmt_R_16F:
+        case NyasTexFmt_RGBA_32F:
         case NyasTexFmt_RGB_32F:
+        case NyasTexFmt_RG_32F:
+        case NyasTexFmt_R_32F: return true;
+        default: return false;
+    }
+}
+
+static bool _TexFmtHalf(NyasTexFmt fmt)
+{
+    switch (fmt)
+    {
+        case NyasTexFmt_RGBA_16F:
+        case NyasTexFmt_RGB_16F:
         case NyasTexFmt_RG_16F:
         case NyasTexFmt_R_16F: return true;
         default: return false;
     }
 }
 
+// Replaces the 32-bit float pixels from stbi_loadf with the 16-bit payload declared to GL.
+static void *_TexPixToHalf(float *pix, size_t count)
+{
+    uint16_t *half = (uint16_t *)NYAS_ALLOC(count * sizeof(uint16_t));
+    NYAS_ASSERT(half && "Alloc failed.");
+    NyUtil::FloatToHalf(half, pix, count);
+    stbi_image_free(pix);
+    return half;
+}
+
 NyasHandle CreateTexture()
 {
     int tex = Textures.Add({});
@@ -479,9 +1027,8 @@ NyasHandle CreateTexture(NyasTexFmt f, NyasTexType t, int w, int h, int count)
     return tex;
 }
 
-void LoadTexture(NyasHandle texture, NyasTexDesc *desc, const char *path, int index)
+static NyasTexture *_BeginTexLoad(NyasHandle texture, NyasTexDesc *desc)
 {
-    NYAS_ASSERT(*path != '\0' && "For empty textures use nyas_tex_set");
     NyasTexture *t = &Textures[texture];
     t->Resource.Id = 0;
     t->Resource.Flags = NyasResourceFlags_Dirty;
@@ -489,11 +1036,39 @@ void LoadTexture(NyasHandle texture, NyasTexDesc *desc, const char *path, int in
     {
         t->Data = *desc;
     }
-
-    int fmt_ch = _TexChannels(t->Data.Format);
     stbi_set_flip_vertically_on_load(t->Data.Flags & NyasTexFlags_FlipVerticallyOnLoad);
+    return t;
+}
 
+static void _DecodeTexImg(NyasTexture *t, NyasTexImg *img, const void *file, size_t size)
+{
+    const stbi_uc *src = (const stbi_uc *)file;
+    int src_size = (int)size;
+    int fmt_ch = _TexChannels(t->Data.Format);
     int channels = 0;
+    if (_TexFmtFloat(t->Data.Format))
+    {
+        float *pix = stbi_loadf_from_memory(
+            src, src_size, &t->Data.Width, &t->Data.Height, &channels, fmt_ch);
+        img->Pix = pix;
+        if (pix && _TexFmtHalf(t->Data.Format))
+        {
+            size_t count = (size_t)t->Data.Width * t->Data.Height * fmt_ch;
+            img->Pix = _TexPixToHalf(pix, count);
+        }
+    }
+    else
+    {
+        img->Pix = stbi_load_from_memory(
+            src, src_size, &t->Data.Width, &t->Data.Height, &channels, fmt_ch);
+    }
+}
+
+void LoadTexture(NyasHandle texture, NyasTexDesc *desc, const char *path, int index)
+{
+    NYAS_ASSERT(*path != '\0' && "For empty textures use nyas_tex_set");
+    NyasTexture *t = _BeginTexLoad(texture, desc);
+
     int face_count = _TexFaces(t->Data.Type);
     for (int i = 0; i < face_count; ++i)
     {
@@ -501,15 +1076,18 @@ void LoadTexture(NyasHandle texture, NyasTexDesc *desc, const char *path, int in
         const char *p = _GetImgFacePath(path, i, face_count);
         img.Face = i;
         img.Index = index;
-        if (_TexFmtFloat(t->Data.Format))
-        {
-            img.Pix = stbi_loadf(p, &t->Data.Width, &t->Data.Height, &channels, fmt_ch);
-        }
-        else
+
+        NyasFileView file;
+        if (!p || FileView(p, &file) != NyasCode_Ok)
         {
-            img.Pix = stbi_load(p, &t->Data.Width, &t->Data.Height, &channels, fmt_ch);
+            NYAS_LOG_ERR("The image '%s' couldn't be read", p ? p : path);
+            t->Img.Push(img);
+            continue;
         }
 
+        _DecodeTexImg(t, &img, file.Data, file.Size);
+        ReleaseFileView(&file);
+
         if (!img.Pix)
         {
             NYAS_LOG_ERR("The image '%s' couldn't be loaded", p);
@@ -518,6 +1096,21 @@ void LoadTexture(NyasHandle texture, NyasTexDesc *desc, const char *path, int in
     }
 }
 
+void LoadTexture(NyasHandle texture, NyasTexDesc *desc, const void *file, size_t size, int index)
+{
+    NyasTexture *t = _BeginTexLoad(texture, desc);
+    NYAS_ASSERT(_TexFaces(t->Data.Type) == 1 && "Use the path overload for cubemaps.");
+
+    NyasTexImg img;
+    img.Index = index;
+    _DecodeTexImg(t, &img, file, size);
+    if (!img.Pix)
+    {
+        NYAS_LOG_ERR("An image of texture %d couldn't be loaded", texture);
+    }
+    t->Img.Push(img);
+}
+
 void SetTexture(NyasHandle texture, struct NyasTexDesc *desc)
 {
     NYAS_ASSERT(desc->Width > 0 && desc->Height > 0 && "Incorrect dimensions");
@@ -540,6 +1133,8 @@ NyasHandle CreateShader(const struct NyasShaderDesc *desc)
 {
     NyasHandle ret = _CreateShaderHandle();
     Shaders[ret].Name = desc->Name;
+    Shaders[ret].Defines = desc->Defines;
+    Shaders[ret].Base = NyasCode_None;
     Shaders[ret].Resource.Id = 0;
     Shaders[ret].Resource.Flags = NyasResourceFlags_Dirty;
     Shaders[ret].TexArrCount = desc->TexArrCount;
@@ -552,15 +1147,286 @@ NyasHandle CreateShader(const struct NyasShaderDesc *desc)
     Shaders[ret].UnitSize = desc->UnitSize;
     Shaders[ret].SharedSize = desc->SharedSize;
     Shaders[ret].TexArrays = (NyasHandle*)NYAS_ALLOC(desc->TexArrCount * sizeof(NyasHandle));
+    Shaders[ret].Instances = NULL;
+    if (desc->InstanceSize)
+    {
+        Shaders[ret].Instances = (NyasInstanceBuffer *)NYAS_ALLOC(sizeof(NyasInstanceBuffer));
+        new (Shaders[ret].Instances) NyasInstanceBuffer(desc->InstanceSize);
+    }
     return ret;
 }
 
-void ReloadShader(NyasHandle shader)
+bool InstanceBuffersSupported()
 {
-    Shaders[shader].Resource.Flags |= NyasResourceFlags_Dirty;
+    return _NyInstanceBuffersSupported();
 }
 
-static NyDrawIdx _CheckVertex(const float *v, const float *end, const float *newvtx)
+// Shader sources and includes, read once and kept until the next ReloadShader.
+struct _NyShaderFile
+{
+    uint64_t PathHash;
+    char *Src;
+    size_t Size;
+};
+
+struct _NyShaderVariant
+{
+    NyasHandle Base;
+    uint64_t Key;
+    NyasHandle Variant;
+};
+
+static NyArray<_NyShaderFile> G_ShaderFiles;
+static NyArray<_NyShaderVariant> G_ShaderVariants;
+static NyArray<NyasHandle> G_CompilingVariants;
+
+static void _ReleaseShaderFiles(void)
+{
+    for (int i = 0; i < G_ShaderFiles.Size; ++i)
+    {
+        NYAS_FREE(G_ShaderFiles[i].Src);
+    }
+    G_ShaderFiles.Size = 0;
+}
+
+static bool _ShaderFile(const char *path, const char **src, size_t *size)
+{
+    uint64_t hash = _NyHash(path, strlen(path));
+    for (int i = 0; i < G_ShaderFiles.Size; ++i)
+    {
+        if (G_ShaderFiles[i].PathHash == hash)
+        {
+            *src = G_ShaderFiles[i].Src;
+            *size = G_ShaderFiles[i].Size;
+            return true;
+        }
+    }
+
+    _NyShaderFile f;
+    f.PathHash = hash;
+    if (ReadFile(path, &f.Src, &f.Size) != NyasCode_Ok)
+    {
+        NYAS_LOG_ERR("Error loading shader file %s.", path);
+        return false;
+    }
+    f.Size -= 1; // Null terminator.
+    G_ShaderFiles.Push(f);
+    *src = f.Src;
+    *size = f.Size;
+    return true;
+}
+
+static void _ShaderAppend(NyArray<char> *out, const char *str, size_t size)
+{
+    if (out->Size + (int)size >= out->Buf.Capacity)
+    {
+        out->Buf.Reserve((out->Size + (int)size) * 2);
+    }
+    memcpy(&out->Buf[out->Size], str, size);
+    out->Size += (int)size;
+}
+
+// Copies src into out replacing the #include "file" lines with the file contents.
+// Files already included in this source are skipped, so headers need no guards.
+static bool _ShaderExpand(NyArray<char> *out, const char *src, size_t size, int line,
+    NyArray<uint64_t> *included, int depth)
+{
+    char directive[32];
+    const char *end = src + size;
+    for (; src < end; ++line)
+    {
+        const char *eol = (const char *)memchr(src, '\n', end - src);
+        eol = eol ? eol + 1 : end;
+
+        const char *c = src;
+        while (c < eol && (*c == ' ' || *c == '\t'))
+        {
+            ++c;
+        }
+
+        if (eol - c < 8 || memcmp(c, "#include", 8))
+        {
+            _ShaderAppend(out, src, eol - src);
+            src = eol;
+            continue;
+        }
+
+        const char *open = (const char *)memchr(c, '"', eol - c);
+        const char *close = open ? (const char *)memchr(open + 1, '"', eol - open - 1) : NULL;
+        if (!close || depth >= NYAS_SHADER_INCLUDE_DEPTH)
+        {
+            NYAS_LOG_ERR("Invalid shader include: %.*s", (int)(eol - src), src);
+            return false;
+        }
+
+        char path[256];
+        snprintf(path, sizeof(path), "%s%.*s", NYAS_SHADER_DIR, (int)(close - open - 1), open + 1);
+        uint64_t hash = _NyHash(path, strlen(path));
+        bool skip = false;
+        for (int i = 0; i < included->Size && !skip; ++i)
+        {
+            skip = (*included)[i] == hash;
+        }
+
+        if (!skip)
+        {
+            const char *inc;
+            size_t inc_size;
+            included->Push(hash);
+            if (!_ShaderFile(path, &inc, &inc_size))
+            {
+                return false;
+            }
+            _ShaderAppend(out, "#line 1\n", 8);
+            if (!_ShaderExpand(out, inc, inc_size, 1, included, depth + 1))
+            {
+                return false;
+            }
+            if (out->Size && out->Buf[out->Size - 1] != '\n')
+            {
+                _ShaderAppend(out, "\n", 1);
+            }
+        }
+
+        int len = snprintf(directive, sizeof(directive), "#line %d\n", line + 1);
+        _ShaderAppend(out, directive, len);
+        src = eol;
+    }
+    return true;
+}
+
+// Loads a shader stage resolving its includes. The defines ("NAME" or "NAME=VALUE", whitespace
+// separated) are placed right after the #version line. Returns NULL on error, free the result.
+static char *_ShaderSource(const char *name, const char *suffix, const char *defines, size_t *size)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s%s", NYAS_SHADER_DIR, name, suffix);
+
+    const char *src;
+    size_t src_size;
+    if (!_ShaderFile(path, &src, &src_size))
+    {
+        return NULL;
+    }
+
+    NyArray<char> out(src_size + 256);
+    NyArray<uint64_t> included;
+    included.Push(_NyHash(path, strlen(path)));
+
+    // #version must be the first statement of the source.
+    int line = 1;
+    const char *c = src;
+    while (c < src + src_size && (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n'))
+    {
+        ++c;
+    }
+
+    if (src + src_size - c >= 8 && !memcmp(c, "#version", 8))
+    {
+        const char *eol = (const char *)memchr(c, '\n', src + src_size - c);
+        eol = eol ? eol + 1 : src + src_size;
+        for (const char *l = src; l < eol; ++l)
+        {
+            line += *l == '\n';
+        }
+        _ShaderAppend(&out, src, eol - src);
+        src_size -= eol - src;
+        src = eol;
+    }
+
+    for (const char *d = defines; d && *d;)
+    {
+        while (*d == ' ' || *d == '\t' || *d == '\n')
+        {
+            ++d;
+        }
+
+        const char *d_end = d;
+        while (*d_end && *d_end != ' ' && *d_end != '\t' && *d_end != '\n')
+        {
+            ++d_end;
+        }
+
+        if (d_end != d)
+        {
+            const char *eq = (const char *)memchr(d, '=', d_end - d);
+            _ShaderAppend(&out, "#define ", 8);
+            _ShaderAppend(&out, d, (eq ? eq : d_end) - d);
+            if (eq)
+            {
+                _ShaderAppend(&out, " ", 1);
+                _ShaderAppend(&out, eq + 1, d_end - eq - 1);
+            }
+            _ShaderAppend(&out, "\n", 1);
+        }
+        d = d_end;
+    }
+
+    if (defines && *defines)
+    {
+        char directive[32];
+        int len = snprintf(directive, sizeof(directive), "#line %d\n", line);
+        _ShaderAppend(&out, directive, len);
+    }
+
+    if (!_ShaderExpand(&out, src, src_size, line, &included, 0))
+    {
+        return NULL;
+    }
+
+    char *ret = (char *)NYAS_ALLOC(out.Size + 1);
+    memcpy(ret, &out.Buf[0], out.Size);
+    ret[out.Size] = '\0';
+    *size = out.Size;
+    return ret;
+}
+
+void InvalidateState()
+{
+    _NyInvalidateState();
+}
+
+void ReloadShader(NyasHandle shader)
+{
+    Shaders[shader].Resource.Flags |= NyasResourceFlags_Dirty;
+    _ReleaseShaderFiles(); // Reread sources and includes on the next compile.
+}
+
+NyasHandle ShaderVariant(NyasHandle base, const char *defines)
+{
+    _NyCheckHandle(base, Shaders);
+    uint64_t key = _NyHash(defines, strlen(defines));
+    for (int i = 0; i < G_ShaderVariants.Size; ++i)
+    {
+        if (G_ShaderVariants[i].Base == base && G_ShaderVariants[i].Key == key)
+        {
+            return G_ShaderVariants[i].Variant;
+        }
+    }
+
+    NyasHandle ret = _CreateShaderHandle();
+    Shaders[ret] = Shaders[base]; // Shares the data blocks with the base shader.
+    Shaders[ret].Resource.Id = 0;
+    Shaders[ret].Resource.Flags = NyasResourceFlags_Dirty;
+    Shaders[ret].Defines = defines;
+    Shaders[ret].Base = base;
+    G_ShaderVariants.Push({ base, key, ret });
+    return ret;
+}
+
+static void _CompileShaders(NyasShader **shaders, int count);
+
+void CompileShaders(const NyasHandle *shaders, int count)
+{
+    NyasShader **s = (NyasShader **)NyFrameAllocator::Alloc(count * sizeof(NyasShader *));
+    for (int i = 0; i < count; ++i)
+    {
+        s[i] = &Shaders[shaders[i]];
+    }
+    _CompileShaders(s, count);
+}
+
+static NyDrawIdx _CheckVertex(const float *v, const float *end, const float *newvtx)
 {
     NyDrawIdx i = 0;
     for (; v < end; ++i, v += 14)
@@ -746,512 +1612,3636 @@ static void _SetMeshMsh(NyasMesh *mesh, const char *path)
     data += sizeof(size_t);
     mesh->Indices = (NyDrawIdx *)NYAS_ALLOC(mesh->ElementCount * sizeof(NyDrawIdx));
     memcpy(mesh->Indices, data, mesh->ElementCount * sizeof(NyDrawIdx));
+    data += mesh->ElementCount * sizeof(NyDrawIdx);
 
-    NYAS_FREE(data - mesh->VtxSize - (2 * sizeof(size_t)));
-}
+    // Optional level of detail table: count, then index ranges (first, count) and errors.
+    char *begin = data - mesh->ElementCount * sizeof(NyDrawIdx) - mesh->VtxSize -
+        (2 * sizeof(size_t));
+    uint32_t lod_count = 0;
+    if ((size_t)(data - begin) + sizeof(uint32_t) <= sz)
+    {
+        memcpy(&lod_count, data, sizeof(uint32_t));
+        data += sizeof(uint32_t);
+    }
 
-void ReloadMesh(NyasHandle msh, const char *path)
-{
-    NyasMesh *m = &Meshes[msh];
-    size_t len = strlen(path);
-    const char *extension = path + len;
-    while (*--extension != '.')
+    const size_t lod_size = 2 * sizeof(uint32_t) + sizeof(float);
+    if (lod_count > NYAS_MESH_LODS || (size_t)(data - begin) + lod_count * lod_size > sz)
     {
+        NYAS_LOG_WARN("Ignoring the level of detail table of %s.", path);
+        lod_count = 0;
     }
-    extension++;
-    if (!strcmp(extension, "obj"))
+
+    for (uint32_t i = 0; i < lod_count; ++i, data += lod_size)
     {
-        _SetMeshObj(m, path);
+        uint32_t range[2];
+        memcpy(range, data, sizeof(range));
+        memcpy(&mesh->Lods[i].Error, data + sizeof(range), sizeof(float));
+        mesh->Lods[i].FirstIdx = range[0];
+        mesh->Lods[i].ElementCount = range[1];
+        if ((uint64_t)range[0] + range[1] > (uint64_t)mesh->ElementCount)
+        {
+            NYAS_LOG_WARN("Level of detail %u of %s is out of range, ignoring the table.", i, path);
+            lod_count = 0;
+        }
     }
-    else if (!strcmp(extension, "msh"))
+    mesh->LodCount = lod_count;
+
+    NYAS_FREE(begin);
+}
+
+int SaveMesh(NyasHandle msh, const char *path)
+{
+    _NyCheckHandle(msh, Meshes);
+    const NyasMesh *m = &Meshes[msh];
+    FILE *f = fopen(path, "wb");
+    if (!f)
     {
-        _SetMeshMsh(m, path);
+        NYAS_LOG_ERR("File open failed for %s.", path);
+        return NyasError_File;
     }
-    else
+
+    size_t vtx_size = m->VtxSize;
+    size_t idx_size = m->ElementCount * sizeof(NyDrawIdx);
+    uint32_t lod_count = m->LodCount;
+    bool ok = fwrite(&vtx_size, sizeof(size_t), 1, f) == 1 &&
+        fwrite(m->Vtx, 1, vtx_size, f) == vtx_size &&
+        fwrite(&idx_size, sizeof(size_t), 1, f) == 1 &&
+        fwrite(m->Indices, 1, idx_size, f) == idx_size &&
+        fwrite(&lod_count, sizeof(uint32_t), 1, f) == 1;
+    for (int i = 0; i < m->LodCount && ok; ++i)
     {
-        NYAS_LOG_ERR("Extension (%s) of file %s not recognised.", extension, path);
+        uint32_t range[2] = { (uint32_t)m->Lods[i].FirstIdx, (uint32_t)m->Lods[i].ElementCount };
+        ok = fwrite(range, sizeof(range), 1, f) == 1 &&
+            fwrite(&m->Lods[i].Error, sizeof(float), 1, f) == 1;
     }
+    fclose(f);
 
-    m->Resource.Flags |= NyasResourceFlags_Dirty;
+    if (!ok)
+    {
+        NYAS_LOG_ERR("File write failed for %s.", path);
+        return NyasError_File;
+    }
+    return NyasCode_Ok;
 }
 
-static NyasHandle _NewMesh(void)
+// Box around the vertex positions and a sphere centered on it.
+static void _MeshBounds(NyasMesh *mesh)
 {
-    NyasHandle mesh_handle = _CreateMeshHandle();
-    Meshes[mesh_handle].Resource.Id = 0;
-    Meshes[mesh_handle].Resource.Flags = NyasResourceFlags_Dirty;
-    Meshes[mesh_handle].Attribs = 0;
-    Meshes[mesh_handle].Vtx = NULL;
-    Meshes[mesh_handle].Indices = NULL;
-    Meshes[mesh_handle].VtxSize = 0;
-    Meshes[mesh_handle].ElementCount = 0;
-    Meshes[mesh_handle].ResVtx.Id = 0;
-    Meshes[mesh_handle].ResVtx.Flags = NyasResourceFlags_Dirty;
-    Meshes[mesh_handle].ResIdx.Id = 0;
-    Meshes[mesh_handle].ResIdx.Flags = NyasResourceFlags_Dirty;
+    memset(mesh->BoundsMin, 0, sizeof(mesh->BoundsMin));
+    memset(mesh->BoundsMax, 0, sizeof(mesh->BoundsMax));
+    memset(mesh->Sphere, 0, sizeof(mesh->Sphere));
+    int stride = _NyVtxStride(mesh->Attribs) / sizeof(float);
+    if (!mesh->Vtx || !stride || !(mesh->Attribs & NyasVtxAttribFlags_Position))
+    {
+        return;
+    }
 
-    return mesh_handle;
-}
+    int64_t count = mesh->VtxSize / (stride * sizeof(float));
+    if (!count)
+    {
+        return;
+    }
 
-NyasHandle CreateMesh(void)
-{
-    return _NewMesh();
+    memcpy(mesh->BoundsMin, mesh->Vtx, sizeof(mesh->BoundsMin));
+    memcpy(mesh->BoundsMax, mesh->Vtx, sizeof(mesh->BoundsMax));
+    for (int64_t i = 1; i < count; ++i)
+    {
+        const float *pos = mesh->Vtx + i * stride;
+        for (int j = 0; j < 3; ++j)
+        {
+            mesh->BoundsMin[j] = pos[j] < mesh->BoundsMin[j] ? pos[j] : mesh->BoundsMin[j];
+            mesh->BoundsMax[j] = pos[j] > mesh->BoundsMax[j] ? pos[j] : mesh->BoundsMax[j];
+        }
+    }
+
+    float radius2 = 0.0f;
+    for (int j = 0; j < 3; ++j)
+    {
+        mesh->Sphere[j] = (mesh->BoundsMin[j] + mesh->BoundsMax[j]) * 0.5f;
+    }
+    for (int64_t i = 0; i < count; ++i)
+    {
+        const float *pos = mesh->Vtx + i * stride;
+        float dx = pos[0] - mesh->Sphere[0];
+        float dy = pos[1] - mesh->Sphere[1];
+        float dz = pos[2] - mesh->Sphere[2];
+        float d2 = dx * dx + dy * dy + dz * dz;
+        radius2 = d2 > radius2 ? d2 : radius2;
+    }
+    mesh->Sphere[3] = sqrtf(radius2);
 }
 
-NyasHandle LoadMesh(const char *path)
+// Plane quadric, upper triangle of the symmetric 4x4 matrix: xx xy xz xw yy yz yw zz zw ww.
+struct _NyQuadric
 {
-    NyasHandle mesh_handle = _NewMesh();
-    ReloadMesh(mesh_handle, path);
-    return mesh_handle;
-}
+    double Q[10];
+};
 
-NyasHandle CreateFramebuffer(void)
+static inline void _QuadricAdd(_NyQuadric *dst, const _NyQuadric &src)
 {
-    NyasHandle framebuffer = _CreateFramebufHandle();
-    Framebufs[framebuffer].Resource.Id = 0;
-    Framebufs[framebuffer].Resource.Flags = NyasResourceFlags_Dirty;
-    for (int i = 0; i < 8; ++i)
+    for (int i = 0; i < 10; ++i)
     {
-        Framebufs[framebuffer].Target[i].Tex = NyasCode_None;
+        dst->Q[i] += src.Q[i];
     }
-    return framebuffer;
 }
 
-void SetFramebufferTarget(NyasHandle framebuffer, int index, struct NyasTexTarget target)
+static inline double _QuadricError(const _NyQuadric &a, const _NyQuadric &b, const float *p)
 {
-    Framebufs[framebuffer].Resource.Flags |= NyasResourceFlags_Dirty;
-    Framebufs[framebuffer].Target[index] = target;
+    double q[10];
+    for (int i = 0; i < 10; ++i)
+    {
+        q[i] = a.Q[i] + b.Q[i];
+    }
+    double x = p[0], y = p[1], z = p[2];
+    double e = q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x +
+        q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y + q[7] * z * z + 2.0 * q[8] * z + q[9];
+    return e > 0.0 ? e : 0.0;
 }
 
-static void _SyncMesh(NyasHandle msh, NyasHandle shader)
+// Unit normal of a triangle, false if it has no area.
+static bool _TriNormal(const float *a, const float *b, const float *c, float *n)
 {
-    _NyCheckHandle(msh, Meshes);
-    _NyCheckHandle(shader, Shaders);
-    NyasMesh *m = &Meshes[msh];
-
-    if (!(m->Resource.Flags & NyasResourceFlags_Created))
+    float u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+    float v[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+    n[0] = u[1] * v[2] - u[2] * v[1];
+    n[1] = u[2] * v[0] - u[0] * v[2];
+    n[2] = u[0] * v[1] - u[1] * v[0];
+    float len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    if (len <= 0.0f)
     {
-        _NyCreateMesh(&m->Resource.Id, &m->ResVtx.Id, &m->ResIdx.Id);
-        m->Resource.Flags |= NyasResourceFlags_Created;
+        return false;
     }
+    n[0] /= len;
+    n[1] /= len;
+    n[2] /= len;
+    return true;
+}
 
-    if (m->Resource.Flags & NyasResourceFlags_Dirty)
-    {
-        _NySetMesh(m, Shaders[shader].Resource.Id);
-        m->Resource.Flags &= ~NyasResourceFlags_Dirty;
-    }
+struct _NyCollapse
+{
+    float Cost;
+    int From;
+    int To;
+};
+
+static int _CompareCollapse(const void *a, const void *b)
+{
+    float ca = ((const _NyCollapse *)a)->Cost;
+    float cb = ((const _NyCollapse *)b)->Cost;
+    return (ca > cb) - (ca < cb);
 }
 
-static NyasTexture *_SyncTex(NyasHandle texture)
+// Counts the uses of every position edge, open addressing on (min, max) position pairs.
+static void _CountEdges(const NyDrawIdx *idx, int64_t count, const int *pos, uint64_t *keys,
+    int *uses, int64_t cap)
 {
-    _NyCheckHandle(texture, Textures);
-    NyasTexture *t = &Textures[texture];
-    if (!(t->Resource.Flags & NyasResourceFlags_Created))
+    memset(keys, 0xFF, cap * sizeof(uint64_t));
+    memset(uses, 0, cap * sizeof(int));
+    for (int64_t i = 0; i < count; ++i)
     {
-        _NyCreateTex(t);
-        t->Resource.Flags |= (NyasResourceFlags_Created | NyasResourceFlags_Dirty);
+        int a = pos[idx[i]];
+        int b = pos[idx[i - i % 3 + (i + 1) % 3]];
+        uint64_t key = a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a;
+        int64_t slot = _NyHash(&key, sizeof(key)) & (cap - 1);
+        while (keys[slot] != key && keys[slot] != ~0ULL)
+        {
+            slot = (slot + 1) & (cap - 1);
+        }
+        keys[slot] = key;
+        ++uses[slot];
     }
+}
 
-    if (t->Resource.Flags & NyasResourceFlags_Dirty)
+static int _EdgeUses(uint64_t key, const uint64_t *keys, const int *uses, int64_t cap)
+{
+    int64_t slot = _NyHash(&key, sizeof(key)) & (cap - 1);
+    while (keys[slot] != key)
     {
-        _NySetTex(t);
-        t->Resource.Flags &= ~NyasResourceFlags_Dirty;
+        slot = (slot + 1) & (cap - 1);
     }
-    return t;
+    return uses[slot];
 }
 
-static void _SyncShaderData(NyasShader *s, NyasHandle *data_tex, int common)
+// Edge collapse simplification driven by quadric error, cheapest collapses first, until target
+// indices are left or nothing else can collapse. Vertices only move onto a neighbour, so every
+// attribute stays valid. Positions with several vertices (attribute seams) or on open and
+// non-manifold edges can be collapsed onto but never moved. Returns the index count written to
+// out and the largest collapse error, as a distance, in error.
+static int64_t _SimplifyMesh(const float *vtx, int stride, int vtx_count, const NyDrawIdx *idx,
+    int64_t idx_count, int64_t target, NyDrawIdx *out, float *error)
 {
-    NYAS_ASSERT((common == 0 || common == 1) && "Invalid common value.");
+    memcpy(out, idx, idx_count * sizeof(NyDrawIdx));
+    int64_t count = idx_count;
 
-    int tc = s->SharedTexCount;
-    int cc = s->SharedCubemapCount;
-    int tac = s->TexArrCount;
-    int tl = s->SharedTexLocation;
-    int cl = s->SharedCubemapLocation;
-    int tal = s->TexArrLocation;
-    int tex_unit = NYAS_TEXUNIT_OFFSET_FOR_COMMON_SHADER_DATA * common;
-
-    NYAS_ASSERT((tc >= 0) && (cc >= 0) && (tac >= 0));
-    NYAS_ASSERT(tex_unit >= 0 && tex_unit < 128);
-
-    if (!(tc | cc | tac))
+    // Weld positions so seam vertices share a quadric.
+    int64_t cap = 1;
+    while (cap < idx_count * 2 || cap < vtx_count * 2)
     {
-        return;
+        cap <<= 1;
     }
-
-    // change texture handle for texture internal id
-    for (int i = 0; i < tc + cc; ++i)
+    int *pos = (int *)NYAS_ALLOC(vtx_count * sizeof(int));
+    uint64_t *keys = (uint64_t *)NYAS_ALLOC(cap * sizeof(uint64_t));
+    int *uses = (int *)NYAS_ALLOC(cap * sizeof(int));
+    memset(uses, 0xFF, cap * sizeof(int));
+    for (int v = 0; v < vtx_count; ++v)
+    {
+        const float *p = vtx + (int64_t)v * stride;
+        int64_t slot = _NyHash(p, 3 * sizeof(float)) & (cap - 1);
+        while (uses[slot] >= 0 && memcmp(vtx + (int64_t)uses[slot] * stride, p, 3 * sizeof(float)))
+        {
+            slot = (slot + 1) & (cap - 1);
+        }
+        uses[slot] = uses[slot] >= 0 ? uses[slot] : v;
+        pos[v] = uses[slot];
+    }
+
+    _NyQuadric *quadrics = (_NyQuadric *)NYAS_ALLOC(vtx_count * sizeof(_NyQuadric));
+    memset(quadrics, 0, vtx_count * sizeof(_NyQuadric));
+    for (int64_t i = 0; i + 2 < count; i += 3)
+    {
+        const float *p0 = vtx + (int64_t)out[i] * stride;
+        const float *p1 = vtx + (int64_t)out[i + 1] * stride;
+        const float *p2 = vtx + (int64_t)out[i + 2] * stride;
+        float n[3];
+        if (!_TriNormal(p0, p1, p2, n))
+        {
+            continue;
+        }
+
+        double d = -(n[0] * p0[0] + n[1] * p0[1] + n[2] * p0[2]);
+        double plane[4] = { n[0], n[1], n[2], d };
+        _NyQuadric q;
+        for (int r = 0, k = 0; r < 4; ++r)
+        {
+            for (int c = r; c < 4; ++c)
+            {
+                q.Q[k++] = plane[r] * plane[c];
+            }
+        }
+        for (int j = 0; j < 3; ++j)
+        {
+            _QuadricAdd(&quadrics[pos[out[i + j]]], q);
+        }
+    }
+
+    int *copies = (int *)NYAS_ALLOC(vtx_count * sizeof(int));
+    int *seen = (int *)NYAS_ALLOC(vtx_count * sizeof(int));
+    int *remap = (int *)NYAS_ALLOC(vtx_count * sizeof(int));
+    uint8_t *locked = (uint8_t *)NYAS_ALLOC(vtx_count);
+    uint8_t *touched = (uint8_t *)NYAS_ALLOC(vtx_count);
+    int *tri_start = (int *)NYAS_ALLOC((vtx_count + 1) * sizeof(int));
+    int *tri_list = (int *)NYAS_ALLOC(idx_count * sizeof(int));
+    _NyCollapse *collapses = (_NyCollapse *)NYAS_ALLOC(idx_count * 2 * sizeof(_NyCollapse));
+    double max_cost = 0.0;
+
+    while (count > target)
+    {
+        memset(copies, 0, vtx_count * sizeof(int));
+        memset(seen, 0, vtx_count * sizeof(int));
+        memset(locked, 0, vtx_count);
+        memset(touched, 0, vtx_count);
+        memset(tri_start, 0, (vtx_count + 1) * sizeof(int));
+        for (int64_t i = 0; i < count; ++i)
+        {
+            copies[pos[out[i]]] += !seen[out[i]];
+            seen[out[i]] = 1;
+            ++tri_start[out[i] + 1];
+        }
+        for (int v = 0; v < vtx_count; ++v)
+        {
+            locked[pos[v]] |= copies[pos[v]] > 1;
+            tri_start[v + 1] += tri_start[v];
+            remap[v] = v;
+        }
+        memset(seen, 0, vtx_count * sizeof(int));
+        for (int64_t i = 0; i < count; ++i)
+        {
+            tri_list[tri_start[out[i]] + seen[out[i]]++] = (int)(i / 3);
+        }
+
+        _CountEdges(out, count, pos, keys, uses, cap);
+        int64_t candidates = 0;
+        for (int64_t i = 0; i < count; ++i)
+        {
+            int a = out[i];
+            int b = out[i - i % 3 + (i + 1) % 3];
+            uint64_t key = pos[a] < pos[b] ? ((uint64_t)pos[a] << 32) | pos[b] :
+                                             ((uint64_t)pos[b] << 32) | pos[a];
+            if (pos[a] != pos[b] && _EdgeUses(key, keys, uses, cap) != 2)
+            {
+                locked[pos[a]] = 1;
+                locked[pos[b]] = 1;
+            }
+        }
+
+        for (int64_t i = 0; i < count; ++i)
+        {
+            int a = out[i];
+            int b = out[i - i % 3 + (i + 1) % 3];
+            for (int dir = 0; dir < 2; ++dir, a ^= b, b ^= a, a ^= b)
+            {
+                if (!locked[pos[a]] && pos[a] != pos[b])
+                {
+                    float cost = (float)_QuadricError(
+                        quadrics[pos[a]], quadrics[pos[b]], vtx + (int64_t)b * stride);
+                    collapses[candidates++] = { cost, a, b };
+                }
+            }
+        }
+        qsort(collapses, candidates, sizeof(_NyCollapse), _CompareCollapse);
+
+        // Every collapse removes about two triangles. Touched positions wait for the next pass.
+        int64_t wanted = (count - target) / 6 + 1;
+        int64_t done = 0;
+        for (int64_t c = 0; c < candidates && done < wanted; ++c)
+        {
+            int a = collapses[c].From;
+            int b = collapses[c].To;
+            if (touched[pos[a]] || touched[pos[b]])
+            {
+                continue;
+            }
+
+            bool flips = false;
+            for (int t = tri_start[a]; t < tri_start[a + 1] && !flips; ++t)
+            {
+                const NyDrawIdx *tri = out + (int64_t)tri_list[t] * 3;
+                if (pos[tri[0]] == pos[b] || pos[tri[1]] == pos[b] || pos[tri[2]] == pos[b])
+                {
+                    continue; // Degenerates and goes away.
+                }
+
+                const float *p[3];
+                const float *q[3];
+                for (int j = 0; j < 3; ++j)
+                {
+                    p[j] = vtx + (int64_t)tri[j] * stride;
+                    q[j] = tri[j] == a ? vtx + (int64_t)b * stride : p[j];
+                }
+                float n0[3], n1[3];
+                flips = _TriNormal(p[0], p[1], p[2], n0) &&
+                    (!_TriNormal(q[0], q[1], q[2], n1) ||
+                        n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2] < 0.2f);
+            }
+
+            if (flips)
+            {
+                continue;
+            }
+
+            remap[a] = b;
+            _QuadricAdd(&quadrics[pos[b]], quadrics[pos[a]]);
+            touched[pos[a]] = 1;
+            touched[pos[b]] = 1;
+            max_cost = collapses[c].Cost > max_cost ? collapses[c].Cost : max_cost;
+            ++done;
+        }
+
+        if (!done)
+        {
+            break;
+        }
+
+        int64_t kept = 0;
+        for (int64_t i = 0; i + 2 < count; i += 3)
+        {
+            int v0 = remap[out[i]], v1 = remap[out[i + 1]], v2 = remap[out[i + 2]];
+            if (pos[v0] != pos[v1] && pos[v1] != pos[v2] && pos[v0] != pos[v2])
+            {
+                out[kept++] = v0;
+                out[kept++] = v1;
+                out[kept++] = v2;
+            }
+        }
+        count = kept;
+    }
+
+    NYAS_FREE(collapses);
+    NYAS_FREE(tri_list);
+    NYAS_FREE(tri_start);
+    NYAS_FREE(touched);
+    NYAS_FREE(locked);
+    NYAS_FREE(remap);
+    NYAS_FREE(seen);
+    NYAS_FREE(copies);
+    NYAS_FREE(quadrics);
+    NYAS_FREE(uses);
+    NYAS_FREE(keys);
+    NYAS_FREE(pos);
+    *error = sqrtf((float)max_cost);
+    return count;
+}
+
+// Builds the level of detail chain, halving the triangles of the previous level each time and
+// stopping when that no longer pays off. The levels are appended to the mesh indices.
+static void _MeshGenerateLods(NyasMesh *mesh)
+{
+    mesh->LodCount = 1;
+    mesh->Lods[0].FirstIdx = 0;
+    mesh->Lods[0].ElementCount = mesh->ElementCount;
+    mesh->Lods[0].Error = 0.0f;
+    int stride = _NyVtxStride(mesh->Attribs) / sizeof(float);
+    if (!mesh->Vtx || !mesh->Indices || !stride ||
+        !(mesh->Attribs & NyasVtxAttribFlags_Position))
+    {
+        return;
+    }
+
+    // The simplifier reads vertices through the indices, bad input keeps the single level.
+    int vtx_count = mesh->VtxSize / (stride * sizeof(float));
+    bool valid = mesh->ElementCount % 3 == 0;
+    for (int64_t i = 0; i < mesh->ElementCount && valid; ++i)
+    {
+        valid = mesh->Indices[i] < (NyDrawIdx)vtx_count;
+    }
+
+    if (!valid)
+    {
+        NYAS_LOG_WARN("Mesh indices out of range, LOD generation skipped.");
+        return;
+    }
+
+    // Levels keep up to 3/4 of the previous one and each one is first copied after the chain, so
+    // the geometric sum bounds the scratch at 4 times the full level.
+    NyDrawIdx *chain = (NyDrawIdx *)NYAS_ALLOC(mesh->ElementCount * 4 * sizeof(NyDrawIdx));
+    memcpy(chain, mesh->Indices, mesh->ElementCount * sizeof(NyDrawIdx));
+    int64_t total = mesh->ElementCount;
+    for (int l = 1; l < NYAS_MESH_LODS; ++l)
+    {
+        const NyasMeshLod &prev = mesh->Lods[l - 1];
+        int64_t target = prev.ElementCount / 6 * 3;
+        if (target < 3 * 32)
+        {
+            break;
+        }
+
+        float error;
+        int64_t count = _SimplifyMesh(mesh->Vtx, stride, vtx_count, chain + prev.FirstIdx,
+            prev.ElementCount, target, chain + total, &error);
+        if (count > prev.ElementCount * 3 / 4)
+        {
+            break;
+        }
+
+        mesh->Lods[l].FirstIdx = total;
+        mesh->Lods[l].ElementCount = count;
+        mesh->Lods[l].Error = error > prev.Error ? error : prev.Error;
+        total += count;
+        ++mesh->LodCount;
+    }
+
+    NYAS_FREE(mesh->Indices);
+    mesh->Indices = (NyDrawIdx *)NYAS_ALLOC(total * sizeof(NyDrawIdx));
+    memcpy(mesh->Indices, chain, total * sizeof(NyDrawIdx));
+    mesh->ElementCount = total;
+    NYAS_FREE(chain);
+}
+
+// Index range of a level, clamped to the available ones.
+static inline NyasMeshLod _MeshLod(const NyasMesh *mesh, int lod)
+{
+    if (!mesh->LodCount)
+    {
+        return { 0, mesh->ElementCount, 0.0f };
+    }
+    lod = lod < 0 ? 0 : (lod < mesh->LodCount ? lod : mesh->LodCount - 1);
+    return mesh->Lods[lod];
+}
+
+int SelectLod(NyasHandle msh, const float *m, const NyVec3 &eye, int previous)
+{
+    const NyasMesh *mesh = &Meshes[msh];
+    if (mesh->LodCount < 2)
+    {
+        return 0;
+    }
+
+    const float *sphere = mesh->Sphere;
+    float c[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        c[i] = m[i] * sphere[0] + m[4 + i] * sphere[1] + m[8 + i] * sphere[2] + m[12 + i] -
+            (&eye.X)[i];
+    }
+    float sx = m[0] * m[0] + m[1] * m[1] + m[2] * m[2];
+    float sy = m[4] * m[4] + m[5] * m[5] + m[6] * m[6];
+    float sz = m[8] * m[8] + m[9] * m[9] + m[10] * m[10];
+    float scale = sqrtf(sx > sy ? (sx > sz ? sx : sz) : (sy > sz ? sy : sz));
+    float dist = sqrtf(c[0] * c[0] + c[1] * c[1] + c[2] * c[2]) - sphere[3] * scale;
+    dist = dist > 1e-3f ? dist : 1e-3f;
+
+    // Pixels covered by one object space unit at that distance.
+    float px = scale * Camera.Proj[5] * G_Ctx->Platform.WindowSize.Y * 0.5f / dist;
+    int lod = 0;
+    while (lod + 1 < mesh->LodCount && mesh->Lods[lod + 1].Error * px <= NYAS_LOD_PIXEL_ERROR)
+    {
+        ++lod;
+    }
+
+    if (previous < 0 || previous >= mesh->LodCount || lod == previous)
+    {
+        return lod;
+    }
+
+    // Coarser only well under the threshold, finer only well over it.
+    const float band = NYAS_LOD_PIXEL_ERROR * NYAS_LOD_HYSTERESIS;
+    if (lod > previous)
+    {
+        return mesh->Lods[lod].Error * px <= NYAS_LOD_PIXEL_ERROR - band ? lod : previous;
+    }
+    return mesh->Lods[previous].Error * px > NYAS_LOD_PIXEL_ERROR + band ? lod : previous;
+}
+
+void ReloadMesh(NyasHandle msh, const char *path)
+{
+    NyasMesh *m = &Meshes[msh];
+    m->LodCount = 0;
+    size_t len = strlen(path);
+    const char *extension = path + len;
+    while (*--extension != '.')
+    {
+    }
+    extension++;
+    if (!strcmp(extension, "obj"))
+    {
+        _SetMeshObj(m, path);
+    }
+    else if (!strcmp(extension, "msh"))
+    {
+        _SetMeshMsh(m, path);
+    }
+    else
+    {
+        NYAS_LOG_ERR("Extension (%s) of file %s not recognised.", extension, path);
+    }
+
+    _MeshBounds(m);
+    if (!m->LodCount)
+    {
+        _MeshGenerateLods(m);
+    }
+    m->Resource.Flags |= NyasResourceFlags_Dirty;
+}
+
+void SetMesh(NyasHandle msh, NyasVtxAttribFlags attribs, const float *vtx, uint32_t vtx_size,
+    const NyDrawIdx *indices, int64_t index_count)
+{
+    _NyCheckHandle(msh, Meshes);
+    NyasMesh *m = &Meshes[msh];
+    NYAS_FREE(m->Vtx);
+    NYAS_FREE(m->Indices);
+    m->Attribs = attribs;
+    m->VtxSize = vtx_size;
+    m->Vtx = (float *)NYAS_ALLOC(vtx_size);
+    memcpy(m->Vtx, vtx, vtx_size);
+    m->ElementCount = index_count;
+    m->Indices = (NyDrawIdx *)NYAS_ALLOC(index_count * sizeof(NyDrawIdx));
+    memcpy(m->Indices, indices, index_count * sizeof(NyDrawIdx));
+    m->LodCount = 0;
+    _MeshBounds(m);
+    _MeshGenerateLods(m);
+    m->Resource.Flags |= NyasResourceFlags_Dirty;
+}
+
+static NyasHandle _NewMesh(void)
+{
+    NyasHandle mesh_handle = _CreateMeshHandle();
+    Meshes[mesh_handle].Resource.Id = 0;
+    Meshes[mesh_handle].Resource.Flags = NyasResourceFlags_Dirty;
+    Meshes[mesh_handle].Attribs = 0;
+    Meshes[mesh_handle].Vtx = NULL;
+    Meshes[mesh_handle].Indices = NULL;
+    Meshes[mesh_handle].VtxSize = 0;
+    Meshes[mesh_handle].ElementCount = 0;
+    Meshes[mesh_handle].ResVtx.Id = 0;
+    Meshes[mesh_handle].ResVtx.Flags = NyasResourceFlags_Dirty;
+    Meshes[mesh_handle].ResIdx.Id = 0;
+    Meshes[mesh_handle].ResIdx.Flags = NyasResourceFlags_Dirty;
+    Meshes[mesh_handle].LodCount = 0;
+    _MeshBounds(&Meshes[mesh_handle]);
+
+    return mesh_handle;
+}
+
+NyasHandle CreateMesh(void)
+{
+    return _NewMesh();
+}
+
+NyasHandle LoadMesh(const char *path)
+{
+    NyasHandle mesh_handle = _NewMesh();
+    ReloadMesh(mesh_handle, path);
+    return mesh_handle;
+}
+
+NyasHandle CreateFramebuffer(void)
+{
+    NyasHandle framebuffer = _CreateFramebufHandle();
+    Framebufs[framebuffer].Resource.Id = 0;
+    Framebufs[framebuffer].Resource.Flags = NyasResourceFlags_Dirty;
+    for (int i = 0; i < 8; ++i)
+    {
+        Framebufs[framebuffer].Target[i].Tex = NyasCode_None;
+    }
+    return framebuffer;
+}
+
+void SetFramebufferTarget(NyasHandle framebuffer, int index, struct NyasTexTarget target)
+{
+    Framebufs[framebuffer].Resource.Flags |= NyasResourceFlags_Dirty;
+    Framebufs[framebuffer].Target[index] = target;
+}
+
+static void _CancelUploads(NyasHandle res, bool tex)
+{
+    for (int i = G_UploadHead; i < G_Uploads.Size; ++i)
+    {
+        if (G_Uploads[i].Res == res && (G_Uploads[i].Kind == NyasUploadKind_Tex) == tex)
+        {
+            G_Uploads[i].Res = NyasCode_None;
+        }
+    }
+}
+
+static void _QueueMeshUpload(NyasHandle msh)
+{
+    _CancelUploads(msh, false);
+    G_Uploads.Push({ NyasUploadKind_Vtx, msh, 0, 0 });
+    G_Uploads.Push({ NyasUploadKind_Idx, msh, 0, 0 });
+}
+
+// Returns false if the texture has no pixel data to upload.
+static bool _QueueTexUpload(NyasHandle tex)
+{
+    NyasTexture *t = &Textures[tex];
+    _CancelUploads(tex, true);
+    int queued = 0;
+    for (int i = 0; i < t->Img.Size; ++i)
+    {
+        if (t->Img[i].Pix)
+        {
+            G_Uploads.Push({ NyasUploadKind_Tex, tex, i, 0 });
+            ++queued;
+        }
+    }
+    return queued;
+}
+
+static void _SyncMesh(NyasHandle msh, NyasHandle shader)
+{
+    _NyCheckHandle(msh, Meshes);
+    _NyCheckHandle(shader, Shaders);
+    NyasMesh *m = &Meshes[msh];
+
+    if (!(m->Resource.Flags & NyasResourceFlags_Created))
+    {
+        _NyCreateMesh(&m->Resource.Id, &m->ResVtx.Id, &m->ResIdx.Id);
+        m->Resource.Flags |= NyasResourceFlags_Created;
+    }
+
+    if (m->Resource.Flags & NyasResourceFlags_Dirty)
+    {
+        _NyAllocMesh(m, Shaders[shader].Resource.Id);
+        _QueueMeshUpload(msh);
+        m->Resource.Flags &= ~NyasResourceFlags_Dirty;
+        m->Resource.Flags |= NyasResourceFlags_Streaming;
+    }
+}
+
+static NyasTexture *_SyncTex(NyasHandle texture)
+{
+    _NyCheckHandle(texture, Textures);
+    NyasTexture *t = &Textures[texture];
+    if (!(t->Resource.Flags & NyasResourceFlags_Created))
+    {
+        _NyCreateTex(t);
+        t->Resource.Flags |= (NyasResourceFlags_Created | NyasResourceFlags_Dirty);
+    }
+
+    if (t->Resource.Flags & NyasResourceFlags_Dirty)
+    {
+        if (_QueueTexUpload(texture))
+        {
+            _NyAllocTex(t);
+            t->Resource.Flags |= NyasResourceFlags_Streaming;
+        }
+        else
+        {
+            _NySetTex(t);
+            t->Resource.Flags &= ~NyasResourceFlags_Streaming;
+        }
+        t->Resource.Flags &= ~NyasResourceFlags_Dirty;
+    }
+    return t;
+}
+
+// Stages rows of a texture image until done or out of budget. Returns true when done.
+static bool _UploadTex(_NyUpload *u, _NyUploadBudget *budget)
+{
+    NyasTexture *t = &Textures[u->Res];
+    NyasTexImg *img = &t->Img[u->Img];
+    int64_t h = t->Data.Height >> img->MipLevel;
+    int64_t row_size = (int64_t)(t->Data.Width >> img->MipLevel) * _TexPixelSize(t->Data.Format);
+    NYAS_ASSERT(row_size > 0 && "Unsupported texture upload format.");
+
+    while (u->Done < h)
+    {
+        int64_t rows = (budget->Bytes - budget->Used) / row_size;
+        if (!rows && !budget->Used)
+        {
+            rows = 1; // Rows bigger than the budget still have to progress.
+        }
+
+        rows = rows < h - u->Done ? rows : h - u->Done;
+        if (!rows || (budget->Used && budget->Exhausted()))
+        {
+            return false;
+        }
+
+        int64_t size = rows * row_size;
+        int64_t offset = _NyStagingPush((char *)img->Pix + u->Done * row_size, size);
+        _NyStagingTex(t, img, u->Done, rows, offset);
+        u->Done += rows;
+        budget->Used += _NyAlign(size);
+    }
+    return true;
+}
+
+// Stages a chunk of a mesh buffer until done or out of budget. Returns true when done.
+static bool _UploadMesh(_NyUpload *u, _NyUploadBudget *budget)
+{
+    NyasMesh *m = &Meshes[u->Res];
+    bool vtx = u->Kind == NyasUploadKind_Vtx;
+    const char *src = vtx ? (const char *)m->Vtx : (const char *)m->Indices;
+    int64_t total = vtx ? (int64_t)m->VtxSize : m->ElementCount * (int64_t)sizeof(NyDrawIdx);
+    uint32_t dst = vtx ? m->ResVtx.Id : m->ResIdx.Id;
+
+    while (u->Done < total)
+    {
+        int64_t size = budget->Bytes - budget->Used;
+        if (size <= 0 && !budget->Used)
+        {
+            size = NY_KILOBYTES(4); // Like texture rows, chunks still have to progress.
+        }
+
+        size = size < total - u->Done ? size : total - u->Done;
+        if (size <= 0 || (budget->Used && budget->Exhausted()))
+        {
+            return false;
+        }
+
+        int64_t offset = _NyStagingPush(src + u->Done, size);
+        _NyStagingBuf(dst, u->Done, offset, size);
+        u->Done += size;
+        budget->Used += _NyAlign(size);
+    }
+    return true;
+}
+
+static NyasResource *_UploadResource(const _NyUpload *u)
+{
+    if (u->Kind == NyasUploadKind_Tex)
+    {
+        return &Textures[u->Res].Resource;
+    }
+    return &Meshes[u->Res].Resource;
+}
+
+// Streams queued uploads through the staging buffer within the per-frame budget.
+// Resources become drawable (not Streaming) once every part of them is resident.
+static void _ProcessUploads(void)
+{
+    int64_t capacity;
+    if (G_UploadHead == G_Uploads.Size || !_NyStagingBegin(&capacity))
+    {
+        return; // Nothing queued or the staging region is still in use by the GPU.
+    }
+
+    _NyUploadBudget budget;
+    budget.Bytes = G_Ctx->Cfg.Upload.FrameBytes;
+    budget.Bytes = budget.Bytes < capacity - MEM_ALIGN ? budget.Bytes : capacity - MEM_ALIGN;
+    budget.Used = 0;
+    budget.MicroSeconds = G_Ctx->Cfg.Upload.FrameMicroSeconds;
+
+    while (G_UploadHead < G_Uploads.Size)
+    {
+        _NyUpload *u = &G_Uploads[G_UploadHead];
+        if (u->Res != NyasCode_None)
+        {
+            NyasResource *res = _UploadResource(u);
+            if (res->Flags & NyasResourceFlags_Dirty)
+            {
+                u->Res = NyasCode_None; // Changed since queued, the next sync queues it again.
+            }
+            else
+            {
+                bool done = u->Kind == NyasUploadKind_Tex ? _UploadTex(u, &budget) :
+                                                            _UploadMesh(u, &budget);
+                if (!done)
+                {
+                    break;
+                }
+
+                // Parts of a resource are queued together: the last one makes it resident.
+                _NyUpload *next = G_UploadHead + 1 < G_Uploads.Size ? u + 1 : NULL;
+                if (!next || next->Res != u->Res ||
+                    (next->Kind == NyasUploadKind_Tex) != (u->Kind == NyasUploadKind_Tex))
+                {
+                    if (u->Kind == NyasUploadKind_Tex)
+                    {
+                        _NyFinishTex(&Textures[u->Res]);
+                    }
+                    res->Flags &= ~NyasResourceFlags_Streaming;
+                }
+            }
+        }
+        ++G_UploadHead;
+    }
+
+    _NyStagingEnd();
+
+    if (G_UploadHead == G_Uploads.Size)
+    {
+        G_Uploads.Size = 0;
+        G_UploadHead = 0;
+    }
+}
+
+// Shader data read by a draw: the live one, or the copy taken by the frame packet being drawn.
+struct _NyShaderData
+{
+    const void *UnitBlock;
+    const void *SharedBlock;
+    const NyasHandle *Shared;
+    const NyasHandle *TexArrays;
+    const char *Instances;
+    int InstanceCount;
+    int PendingBegin;
+    int PendingEnd;
+};
+
+struct _NyShaderCopy
+{
+    NyasHandle Base; // Variants share the data of their base shader.
+    _NyShaderData Data;
+    char *Mem;
+    int64_t MemCapacity;
+};
+
+// Commands of one frame with everything they read from the shaders, see NyRenderThread.
+struct _NyFramePacket
+{
+    NyArray<NyasDrawCmd> Cmds;
+    NyArray<NyasDrawUnit> Units;
+    NyArray<_NyShaderCopy> Shaders;
+};
+
+static thread_local _NyFramePacket *G_DrawPacket = NULL;
+
+static inline NyasHandle _BaseShader(NyasHandle shader)
+{
+    return Shaders[shader].Base == NyasCode_None ? shader : Shaders[shader].Base;
+}
+
+static _NyShaderData *_PacketShaderData(NyasHandle shader)
+{
+    NyasHandle base = _BaseShader(shader);
+    for (int i = 0; i < G_DrawPacket->Shaders.Size; ++i)
+    {
+        if (G_DrawPacket->Shaders[i].Base == base)
+        {
+            return &G_DrawPacket->Shaders[i].Data;
+        }
+    }
+    NYAS_ASSERT(!"Shader missing from the frame packet.");
+    return NULL;
+}
+
+static _NyShaderData _ShaderData(NyasHandle shader)
+{
+    if (G_DrawPacket)
+    {
+        return *_PacketShaderData(shader);
+    }
+
+    const NyasShader *s = &Shaders[shader];
+    const NyasInstanceBuffer *inst = s->Instances;
+    return { s->UnitBlock, s->SharedBlock, s->Shared, s->TexArrays, inst ? inst->Data : NULL,
+        inst ? inst->Count : 0, inst ? inst->PendingBegin : 0, inst ? inst->PendingEnd : 0 };
+}
+
+// Copies the data of the shader into the packet, once per base shader. The memory is kept
+// between frames so the copies usually keep their address.
+static void _SnapshotShader(_NyFramePacket *p, NyasHandle shader)
+{
+    NyasHandle base = _BaseShader(shader);
+    for (int i = 0; i < p->Shaders.Size; ++i)
+    {
+        if (p->Shaders[i].Base == base)
+        {
+            return;
+        }
+    }
+
+    // Reuse the memory of a stale copy if there is one.
+    int idx = p->Shaders.Size;
+    for (int i = 0; i < p->Shaders.Size; ++i)
+    {
+        idx = p->Shaders[i].Base == NyasCode_None && idx == p->Shaders.Size ? i : idx;
+    }
+    if (idx == p->Shaders.Size)
+    {
+        p->Shaders.Push({ NyasCode_None, {}, NULL, 0 });
+    }
+
+    _NyShaderCopy *c = &p->Shaders[idx];
+    NyasShader *s = &Shaders[base];
+    NyasInstanceBuffer *inst = s->Instances;
+    int64_t sizes[5] = { s->UnitSize, s->SharedSize,
+        (int64_t)(s->SharedTexCount + s->SharedCubemapCount) * (int64_t)sizeof(NyasHandle),
+        (int64_t)s->TexArrCount * (int64_t)sizeof(NyasHandle),
+        inst ? (int64_t)inst->Count * inst->Stride : 0 };
+    int64_t total = 0;
+    for (int64_t size : sizes)
+    {
+        total += (size + 15) & ~(int64_t)15;
+    }
+
+    if (c->MemCapacity < total)
+    {
+        NYAS_FREE(c->Mem);
+        c->MemCapacity = total + total / 2;
+        c->Mem = (char *)NYAS_ALLOC(c->MemCapacity);
+    }
+
+    char *mem = c->Mem;
+    const void *src[5] = { s->UnitBlock, s->SharedBlock, s->Shared, s->TexArrays,
+        inst ? inst->Data : NULL };
+    char *dst[5];
+    for (int i = 0; i < 5; ++i)
+    {
+        dst[i] = mem;
+        if (sizes[i])
+        {
+            memcpy(mem, src[i], sizes[i]);
+        }
+        mem += (sizes[i] + 15) & ~(int64_t)15;
+    }
+
+    c->Base = base;
+    c->Data = { dst[0], dst[1], (NyasHandle *)dst[2], (NyasHandle *)dst[3], dst[4],
+        inst ? inst->Count : 0, inst ? inst->PendingBegin : 0, inst ? inst->PendingEnd : 0 };
+    if (inst)
+    {
+        inst->PendingBegin = 0;
+        inst->PendingEnd = 0;
+    }
+}
+
+// Returns false while any of the textures is still streaming.
+static bool _SyncShaderData(NyasShader *s, const _NyShaderData &d, NyasHandle *data_tex, int common)
+{
+    NYAS_ASSERT((common == 0 || common == 1) && "Invalid common value.");
+
+    int tc = s->SharedTexCount;
+    int cc = s->SharedCubemapCount;
+    int tac = s->TexArrCount;
+    int tl = s->SharedTexLocation;
+    int cl = s->SharedCubemapLocation;
+    int tal = s->TexArrLocation;
+    int tex_unit = NYAS_TEXUNIT_OFFSET_FOR_COMMON_SHADER_DATA * common;
+
+    NYAS_ASSERT((tc >= 0) && (cc >= 0) && (tac >= 0));
+    NYAS_ASSERT(tex_unit >= 0 && tex_unit < 128);
+
+    if (!(tc | cc | tac))
+    {
+        return true;
+    }
+
+    // change texture handle for texture internal id
+    NyasResourceFlags streaming = 0;
+    for (int i = 0; i < tc + cc; ++i)
     {
         NyasTexture *itx = _SyncTex(data_tex[i]);
         data_tex[i] = (int)itx->Resource.Id;
+        streaming |= itx->Resource.Flags & NyasResourceFlags_Streaming;
+    }
+
+    NyasHandle data_texarr[4];
+    for (int i = 0; i < tac; ++i)
+    {
+        NyasTexture *itx = _SyncTex(d.TexArrays[i]);
+        data_texarr[i] = (int)itx->Resource.Id;
+        streaming |= itx->Resource.Flags & NyasResourceFlags_Streaming;
+    }
+
+    // set opengl uniforms
+    if (tc)
+    {
+        _NySetShaderTex(tl, data_tex, tc, tex_unit);
+    }
+
+    if (cc)
+    {
+        _NySetShaderCubemap(cl, data_tex + tc, cc, tex_unit + tc);
+    }
+
+    if (tac)
+    {
+        _NySetShaderTexArray(tal, data_texarr, tac, tex_unit + tc + cc);
+    }
+
+    return !streaming;
+}
+
+// Preprocesses both stages and hands them to the backend. False if a source failed to load.
+static bool _SubmitShader(NyasShader *s)
+{
+    size_t vert_size, frag_size;
+    char *vert = _ShaderSource(s->Name, "-vert.glsl", s->Defines, &vert_size);
+    char *frag = vert ? _ShaderSource(s->Name, "-frag.glsl", s->Defines, &frag_size) : NULL;
+    if (frag)
+    {
+        _NySubmitShader(s, vert, vert_size, frag, frag_size);
+    }
+    NYAS_FREE(vert);
+    NYAS_FREE(frag);
+    return frag;
+}
+
+static void _ShaderReady(NyasShader *s)
+{
+    static const char *uniforms[] = { "u_common_tex",
+        "u_common_cube", "u_textures", "u_instance_base" };
+
+    _NyShaderLocations(s->Resource.Id, &s->SharedTexLocation, &uniforms[0], 4);
+    s->Resource.Flags &= ~(NyasResourceFlags_Dirty | NyasResourceFlags_Streaming);
+}
+
+// Compiles every dirty shader in one batch so the driver can overlap the work.
+static void _CompileShaders(NyasShader **shaders, int count)
+{
+    int dirty = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        NyasShader *s = shaders[i];
+        if (!(s->Resource.Flags & NyasResourceFlags_Created))
+        {
+            _NyCreateShader(&s->Resource.Id);
+            s->Resource.Flags |= NyasResourceFlags_Created;
+        }
+
+        if ((s->Resource.Flags & NyasResourceFlags_Dirty) &&
+            !(s->Resource.Flags & NyasResourceFlags_Streaming))
+        {
+            NYAS_ASSERT(s->Name && *s->Name && "Shader name needed.");
+            if (_SubmitShader(s))
+            {
+                shaders[dirty++] = s;
+            }
+            else
+            {
+                s->Resource.Flags &= ~NyasResourceFlags_Dirty;
+            }
+        }
+    }
+
+    // Without parallel compile support the first status query blocks anyway.
+    for (int remaining = dirty; remaining;)
+    {
+        for (int i = 0; i < remaining;)
+        {
+            if (_NyFinishShader(shaders[i]))
+            {
+                _ShaderReady(shaders[i]);
+                shaders[i] = shaders[--remaining];
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        if (remaining)
+        {
+            sched_yield();
+        }
+    }
+}
+
+// Variants compile in the background on first use; until then, draws use the base shader.
+static NyasHandle _DrawShader(NyasHandle shader)
+{
+    NyasShader *s = &Shaders[shader];
+    if (s->Base == NyasCode_None)
+    {
+        return shader;
+    }
+
+    if ((s->Resource.Flags & NyasResourceFlags_Dirty) &&
+        !(s->Resource.Flags & NyasResourceFlags_Streaming))
+    {
+        if (!(s->Resource.Flags & NyasResourceFlags_Created))
+        {
+            _NyCreateShader(&s->Resource.Id);
+            s->Resource.Flags |= NyasResourceFlags_Created;
+        }
+
+        s->Resource.Flags |= NyasResourceFlags_Streaming;
+        if (_SubmitShader(s))
+        {
+            G_CompilingVariants.Push(shader);
+        }
+    }
+
+    if (s->Resource.Flags & NyasResourceFlags_Streaming)
+    {
+        return _DrawShader(s->Base);
+    }
+    return shader;
+}
+
+static void _PollShaderVariants(void)
+{
+    for (int i = 0; i < G_CompilingVariants.Size;)
+    {
+        NyasShader *s = &Shaders[G_CompilingVariants[i]];
+        if (_NyFinishShader(s))
+        {
+            _ShaderReady(s);
+            G_CompilingVariants[i] = G_CompilingVariants.Back();
+            G_CompilingVariants.Pop();
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+void _SyncShader(NyasShader *s, const _NyShaderData &d)
+{
+    _CompileShaders(&s, 1);
+    _NySetShaderUniformBuffer(s, d.UnitBlock, d.SharedBlock);
+}
+
+static void _SyncFramebuf(NyasHandle framebuffer)
+{
+    struct NyasFramebuffer *fb = &Framebufs[framebuffer];
+    if (!(fb->Resource.Flags & NyasResourceFlags_Created))
+    {
+        _NyCreateFramebuf(fb);
+        fb->Resource.Flags |= NyasResourceFlags_Created;
+    }
+
+    _NyUseFramebuf(fb->Resource.Id);
+    if (fb->Resource.Flags & NyasResourceFlags_Dirty)
+    {
+        for (int i = 0; fb->Target[i].Tex != NyasCode_None; ++i)
+        {
+            struct NyasTexture *t = _SyncTex(fb->Target[i].Tex);
+            _NySetFramebuf(fb->Resource.Id, t->Resource.Id, &fb->Target[i]);
+        }
+        fb->Resource.Flags &= ~NyasResourceFlags_Dirty;
+    }
+}
+
+static inline uint64_t _KeyField(int value, int bits)
+{
+    return value < 0 ? 0 : (uint64_t)(value + 1) & ((1ULL << bits) - 1);
+}
+
+uint64_t SortKey(int pass, NyasHandle framebuf, NyasHandle shader, int material, NyasHandle mesh,
+    float depth, bool blended)
+{
+    depth = depth < 0.0f ? 0.0f : (depth > 1.0f ? 1.0f : depth);
+    uint64_t key = ((uint64_t)(pass & 0xFF) << 56) | (_KeyField(framebuf, 8) << 48);
+    if (blended)
+    {
+        uint64_t far = (uint64_t)((1.0f - depth) * 0xFFFFFF);
+        return key | (1ULL << 47) | (far << 23) | (_KeyField(shader, 11) << 12) |
+            _KeyField(material, 12);
+    }
+
+    uint64_t near = (uint64_t)(depth * 0xFFF);
+    return key | (_KeyField(shader, 11) << 36) | (_KeyField(material, 12) << 24) |
+        (_KeyField(mesh, 12) << 12) | near;
+}
+
+template<typename T> static void _SortByKey(T *items, int count)
+{
+    if (count < 2)
+    {
+        return;
+    }
+
+    uint64_t *keys = (uint64_t *)NyFrameAllocator::Alloc(count * sizeof(uint64_t));
+    uint32_t *order = (uint32_t *)NyFrameAllocator::Alloc(count * sizeof(uint32_t));
+    for (int i = 0; i < count; ++i)
+    {
+        keys[i] = items[i].SortKey;
+    }
+    NyUtil::RadixSort(keys, order, count);
+
+    T *tmp = (T *)NyFrameAllocator::Alloc(count * sizeof(T));
+    memcpy((void *)tmp, items, count * sizeof(T));
+    for (int i = 0; i < count; ++i)
+    {
+        items[i] = tmp[order[i]];
+    }
+}
+
+void SortDraws(NyasDrawCmd *cmds, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        _SortByKey(cmds[i].Units, cmds[i].UnitCount);
+    }
+    _SortByKey(cmds, count);
+}
+
+static void _DrawMerged(NyasDrawCmd *cmd)
+{
+    NYAS_ASSERT(cmd->Shader >= 0 && "Merged draws use the command shader.");
+    NyMergedMesh *mm = cmd->Merged;
+    if (!(mm->Resource.Flags & NyasResourceFlags_Created))
+    {
+        _NyCreateMergedMesh(mm);
+        mm->Resource.Flags |= NyasResourceFlags_Created;
+    }
+
+    if (mm->Resource.Flags & NyasResourceFlags_Dirty)
+    {
+        _NyAllocMergedMesh(mm, Shaders[_DrawShader(cmd->Shader)].Resource.Id);
+        mm->Resource.Flags &= ~NyasResourceFlags_Dirty;
+    }
+
+    for (int i = 0; i < mm->Pending.Size; ++i)
+    {
+        NyMeshOffset *range = &mm->Meshes[mm->Pending[i]];
+        _NyWriteMergedMesh(mm, range, &Meshes[range->Mesh]);
+    }
+    mm->Pending.Size = 0;
+
+    mm->Cmds.Size = 0;
+    uint32_t base_instance = 0;
+    for (int i = 0; i < cmd->UnitCount; ++i)
+    {
+        NYAS_ASSERT(cmd->Units[i].Mesh >= 0 && cmd->Units[i].Mesh < mm->Meshes.Size);
+        const NyMeshOffset &range = mm->Meshes[cmd->Units[i].Mesh];
+        NyasMeshLod lod = _MeshLod(&Meshes[range.Mesh], cmd->Units[i].Lod);
+        NyDrawIndirect di;
+        di.Count = (uint32_t)lod.ElementCount;
+        di.InstanceCount = cmd->Units[i].Instances;
+        di.FirstIdx = (uint32_t)(range.FirstIdx + lod.FirstIdx);
+        di.BaseVtx = (int32_t)range.BaseVtx;
+        di.BaseInstance = base_instance;
+        base_instance += cmd->Units[i].Instances;
+        mm->Cmds.Push(di);
+    }
+
+    if (mm->Cmds.Size)
+    {
+        _NyDrawIndirect(mm);
+    }
+}
+
+static void _DrawCmd(NyasDrawCmd *cmd)
+{
+    if (cmd->Framebuf != NyasCode_NoOp)
+    {
+        if (cmd->Framebuf == NyasCode_Default)
+        {
+            _NyUseFramebuf(0);
+        }
+        else
+        {
+            _SyncFramebuf(cmd->Framebuf);
+        }
+    }
+
+    bool resident = true;
+    if (cmd->Shader != NyasCode_NoOp)
+    {
+        _NyCheckHandle(cmd->Shader, Shaders);
+        NyasHandle draw_shader = _DrawShader(cmd->Shader);
+        NyasShader *s = &Shaders[draw_shader];
+        _NyShaderData d = _ShaderData(draw_shader);
+        int shared_count = s->SharedTexCount + s->SharedCubemapCount;
+        NyasHandle *SharedTex =
+            (NyasHandle *)NyThreadFrameAllocator::Alloc(shared_count * sizeof(NyasHandle));
+        memcpy(SharedTex, d.Shared, shared_count * sizeof(NyasHandle));
+        _SyncShader(s, d);
+        _NyUseShader(s->Resource.Id);
+        resident = _SyncShaderData(s, d, SharedTex, true);
+        if (s->Instances)
+        {
+            _NySyncInstances(
+                s->Instances, d.Instances, d.InstanceCount, d.PendingBegin, d.PendingEnd);
+            if (G_DrawPacket)
+            {
+                _NyShaderData *pd = _PacketShaderData(draw_shader);
+                pd->PendingBegin = 0;
+                pd->PendingEnd = 0;
+            }
+            else
+            {
+                s->Instances->PendingBegin = 0;
+                s->Instances->PendingEnd = 0;
+            }
+        }
+    }
+
+    NyasDrawState &s = cmd->State;
+    _NyClearColor(s.BgColorR, s.BgColorG, s.BgColorB, s.BgColorA);
+    _NyClear(s.EnableFlags & NyasDrawFlags_ColorClear, s.EnableFlags & NyasDrawFlags_DepthClear,
+        s.EnableFlags & NyasDrawFlags_StencilClear);
+
+    _NyViewport({ s.ViewportMinX, s.ViewportMinY, s.ViewportMaxX, s.ViewportMaxY });
+    _NyScissor({ s.ScissorMinX, s.ScissorMinY, s.ScissorMaxX, s.ScissorMaxY });
+
+    if (s.DisableFlags & NyasDrawFlags_DepthTest)
+    {
+        _NyDisableDepthTest();
+    }
+    else if (s.EnableFlags & NyasDrawFlags_DepthTest)
+    {
+        _NyEnableDepthTest();
+    }
+
+    if (s.DisableFlags & NyasDrawFlags_DepthWrite)
+    {
+        _NyDisableDepthMask();
+    }
+    else if (s.EnableFlags & NyasDrawFlags_DepthWrite)
+    {
+        _NyEnableDepthMask();
+    }
+
+    if (s.DisableFlags & NyasDrawFlags_StencilTest)
+    {
+        _NyDisableStencilTest();
+    }
+    else if (s.EnableFlags & NyasDrawFlags_StencilTest)
+    {
+        _NyEnableStencilTest();
+    }
+
+    if (s.DisableFlags & NyasDrawFlags_StencilWrite)
+    {
+        _NyDisableStencilMask();
+    }
+    else if (s.EnableFlags & NyasDrawFlags_StencilWrite)
+    {
+        _NyEnableStencilMask();
+    }
+
+    if (s.DisableFlags & NyasDrawFlags_Blend)
+    {
+        _NyDisableBlend();
+    }
+    else if (s.EnableFlags & NyasDrawFlags_Blend)
+    {
+        _NyEnableBlend();
+    }
+
+    if (s.DisableFlags & NyasDrawFlags_FaceCulling)
+    {
+        _NyDisableCull();
+    }
+    else if (s.EnableFlags & NyasDrawFlags_FaceCulling)
+    {
+        _NyEnableCull();
+    }
+
+    if (s.DisableFlags & NyasDrawFlags_Scissor)
+    {
+        _NyDisableScissor();
+    }
+    else if (s.EnableFlags & NyasDrawFlags_Scissor)
+    {
+        _NyEnableScissor();
+    }
+
+    _NySetDepthFunc(s.Depth);
+    _NySetBlend(s.BlendSrc, s.BlendDst);
+    _NySetCull(s.FaceCulling);
+
+    if (!resident)
+    {
+        return; // Shader textures are still streaming.
+    }
+
+    if (cmd->Merged)
+    {
+        _DrawMerged(cmd);
+        return;
+    }
+
+    int block_offset = 0; // The command shader bound the whole unit block.
+    int instance_base = -1;
+    for (int i = 0; i < cmd->UnitCount; ++i)
+    {
+        NyasMesh *imsh = &Meshes[cmd->Units[i].Mesh];
+        _NyCheckHandle(cmd->Units[i].Mesh, Meshes);
+        NYAS_ASSERT(imsh->ElementCount && "Attempt to draw an uninitialized mesh");
+
+        NyasHandle unit_shader = _DrawShader(cmd->Units[i].Shader);
+        if (imsh->Resource.Flags & NyasResourceFlags_Dirty)
+        {
+            _SyncMesh(cmd->Units[i].Mesh, unit_shader);
+        }
+
+        if (imsh->Resource.Flags & NyasResourceFlags_Streaming)
+        {
+            continue;
+        }
+
+        NyasShader *s = &Shaders[unit_shader];
+        if (cmd->Units[i].UnitBlockOffset != block_offset)
+        {
+            block_offset = cmd->Units[i].UnitBlockOffset;
+            _NySetShaderUnitBlock(s, _ShaderData(unit_shader).UnitBlock, block_offset);
+        }
+
+        if (s->Instances && cmd->Units[i].FirstInstance != instance_base)
+        {
+            instance_base = cmd->Units[i].FirstInstance;
+            _NySetShaderInstanceBase(s->InstanceBaseLocation, instance_base);
+        }
+
+        NyasMeshLod lod = _MeshLod(imsh, cmd->Units[i].Lod);
+        _NyUseMesh(imsh, s);
+        _NyDraw(lod.ElementCount, sizeof(NyDrawIdx) == 4, cmd->Units[i].Instances, lod.FirstIdx);
+    }
+}
+
+// Timer queries of the last NYAS_PROFILE_FRAMES frames, named by the shader of the command.
+static struct
+{
+    const char *GpuNames[NYAS_PROFILE_FRAMES][NYAS_PROFILE_SCOPES];
+    int GpuCount[NYAS_PROFILE_FRAMES];
+    int GpuUntimed[NYAS_PROFILE_FRAMES]; // Commands past NYAS_PROFILE_SCOPES or without queries.
+    int Frame; // Query frame being recorded.
+    NyasProfileTime Cpu[NYAS_PROFILE_SCOPES]; // Scopes ended since the last swap.
+    int CpuCount;
+    int64_t Swap; // Time of the last swap.
+} G_Profiler;
+
+static pthread_mutex_t G_ProfilerMtx = PTHREAD_MUTEX_INITIALIZER; // CPU scopes of any thread.
+
+static void _ProfileAdd(NyasProfileTime *times, int *count, const char *name, float ms)
+{
+    for (int i = 0; i < *count; ++i)
+    {
+        if (times[i].Name == name || !strcmp(times[i].Name, name))
+        {
+            times[i].Ms += ms;
+            times[i].Count++;
+            return;
+        }
+    }
+
+    if (*count < NYAS_PROFILE_SCOPES)
+    {
+        times[(*count)++] = { name, ms, 1 };
+    }
+}
+
+void Draw(NyasDrawCmd *cmd)
+{
+    int frame = G_Profiler.Frame;
+    int idx = G_Profiler.GpuCount[frame];
+    bool timed = G_Ctx->Profile.Enabled && idx < NYAS_PROFILE_SCOPES && _NyTimerBegin(frame, idx);
+    if (timed)
+    {
+        G_Profiler.GpuNames[frame][idx] =
+            cmd->Shader == NyasCode_NoOp ? "no shader" : Shaders[cmd->Shader].Name;
+        G_Profiler.GpuCount[frame]++;
+    }
+    else if (G_Ctx->Profile.Enabled)
+    {
+        G_Profiler.GpuUntimed[frame]++;
+    }
+
+    _DrawCmd(cmd);
+
+    if (timed)
+    {
+        _NyTimerEnd();
+    }
+}
+
+// Publishes the CPU scopes of the frame and the GPU times of the oldest query frame, whose
+// queries are reused by the next one.
+static void _ProfileFrameEnd(void)
+{
+    NyasProfile *p = &G_Ctx->Profile;
+    int64_t now = NyChrono::GetTime();
+    float frame_ms =
+        G_Profiler.Swap ? (float)NyChrono::MilliSeconds((double)(now - G_Profiler.Swap)) : 0.0f;
+    G_Profiler.Swap = now;
+
+    pthread_mutex_lock(&G_ProfilerMtx);
+    memcpy(p->Cpu, G_Profiler.Cpu, G_Profiler.CpuCount * sizeof(NyasProfileTime));
+    p->CpuCount = G_Profiler.CpuCount;
+    G_Profiler.CpuCount = 0;
+    pthread_mutex_unlock(&G_ProfilerMtx);
+
+    G_Profiler.Frame = (G_Profiler.Frame + 1) % NYAS_PROFILE_FRAMES;
+    int frame = G_Profiler.Frame;
+    int count = G_Profiler.GpuCount[frame];
+    int untimed = G_Profiler.GpuUntimed[frame];
+    float gpu_ms = 0.0f;
+    float ms;
+    // Queries finish in order, the last one being done means the frame is.
+    if (count && _NyTimerResult(frame, count - 1, &ms))
+    {
+        p->GpuCount = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            _NyTimerResult(frame, i, &ms);
+            _ProfileAdd(p->Gpu, &p->GpuCount, G_Profiler.GpuNames[frame][i], ms);
+            gpu_ms += ms;
+        }
+        p->GpuMs = gpu_ms;
+        p->GpuUntimed = untimed;
+    }
+    else if (count)
+    {
+        p->DroppedFrames++;
+    }
+    else
+    {
+        p->GpuUntimed = untimed;
+    }
+    G_Profiler.GpuCount[frame] = 0;
+    G_Profiler.GpuUntimed[frame] = 0;
+
+    p->FrameMs[p->History] = frame_ms;
+    p->GpuFrameMs[p->History] = gpu_ms;
+    p->History = (p->History + 1) % NYAS_PROFILE_HISTORY;
+}
+} // namespace Nyas
+
+NyProfileScope::NyProfileScope(const char *name) : Name(name), Start(NyChrono::GetTime()) {}
+
+NyProfileScope::~NyProfileScope()
+{
+    if (!G_Ctx->Profile.Enabled)
+    {
+        return;
+    }
+
+    float ms = (float)NyChrono::MilliSeconds((double)(NyChrono::GetTime() - Start));
+    pthread_mutex_lock(&Nyas::G_ProfilerMtx);
+    Nyas::_ProfileAdd(Nyas::G_Profiler.Cpu, &Nyas::G_Profiler.CpuCount, Name, ms);
+    pthread_mutex_unlock(&Nyas::G_ProfilerMtx);
+}
+
+NyasInstanceBuffer::NyasInstanceBuffer(int stride) :
+    Data(NULL), Stride(stride), Count(0), Capacity(0), PendingBegin(0), PendingEnd(0), Current(0),
+    Frame(0)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        GpuCapacity[i] = 0;
+        DirtyBegin[i] = 0;
+        DirtyEnd[i] = 0;
+    }
+}
+
+NyasInstanceBuffer::~NyasInstanceBuffer()
+{
+    _NyReleaseInstances(this);
+    NYAS_FREE(Data);
+}
+
+void *NyasInstanceBuffer::Write(int first, int count)
+{
+    int end = first + count;
+    if (end > Capacity)
+    {
+        int capacity = Capacity ? Capacity : 64;
+        while (capacity < end)
+        {
+            capacity *= 2;
+        }
+
+        char *data = (char *)NYAS_ALLOC((int64_t)capacity * Stride);
+        if (Data)
+        {
+            memcpy(data, Data, (int64_t)Count * Stride);
+            NYAS_FREE(Data);
+        }
+        Data = data;
+        Capacity = capacity;
+    }
+
+    Count = end > Count ? end : Count;
+    bool clean = PendingBegin == PendingEnd;
+    PendingBegin = clean || first < PendingBegin ? first : PendingBegin;
+    PendingEnd = clean || end > PendingEnd ? end : PendingEnd;
+    return At(first);
+}
+
+NyMergedMesh::NyMergedMesh(NyasVtxAttribFlags attribs, int64_t vtx_bytes, int64_t idx_count) :
+    Attribs(attribs), VtxCapacity(vtx_bytes), IdxCapacity(idx_count), VtxUsed(0), IdxUsed(0),
+    CmdCapacity(0)
+{
+    Resource.Id = 0;
+    Resource.Flags = NyasResourceFlags_Dirty;
+    ResVtx.Id = 0;
+    ResVtx.Flags = NyasResourceFlags_Dirty;
+    ResIdx.Id = 0;
+    ResIdx.Flags = NyasResourceFlags_Dirty;
+    ResCmd.Id = 0;
+    ResCmd.Flags = NyasResourceFlags_Dirty;
+}
+
+NyMergedMesh::~NyMergedMesh()
+{
+    if (Resource.Flags & NyasResourceFlags_Created)
+    {
+        _NyReleaseMergedMesh(this);
+    }
+}
+
+int NyMergedMesh::Add(NyasHandle mesh)
+{
+    Nyas::_NyCheckHandle(mesh, Nyas::Meshes);
+    const NyasMesh *m = &Nyas::Meshes[mesh];
+    if (m->Attribs != Attribs)
+    {
+        NYAS_LOG_ERR("Mesh %d vertex layout differs from the merged mesh one.", mesh);
+        return NyasCode_Error;
+    }
+
+    if (VtxUsed + m->VtxSize > VtxCapacity || IdxUsed + m->ElementCount > IdxCapacity)
+    {
+        NYAS_LOG_ERR("Merged mesh full, mesh %d not added.", mesh);
+        return NyasCode_Error;
+    }
+
+    NyMeshOffset range;
+    range.Mesh = mesh;
+    range.BaseVtx = VtxUsed / _NyVtxStride(Attribs);
+    range.FirstIdx = IdxUsed;
+    range.ElementCount = m->ElementCount;
+    VtxUsed += m->VtxSize;
+    IdxUsed += m->ElementCount;
+    Meshes.Push(range);
+    Pending.Push(Meshes.Size - 1);
+    return Meshes.Size - 1;
+}
+
+NyasHandle NYAS_SPHERE;
+NyasHandle NYAS_CUBE;
+NyasHandle NYAS_QUAD;
+
+const NyasCamera *NyasCamera::_Refresh() const
+{
+    if (_Valid && !memcmp(_Source, View, 16 * sizeof(float)) &&
+        !memcmp(_Source + 16, Proj, 16 * sizeof(float)))
+    {
+        return this;
+    }
+
+    memcpy(_Source, View, 16 * sizeof(float));
+    memcpy(_Source + 16, Proj, 16 * sizeof(float));
+    if (!NyUtil::Mat4Inverse(_InvView, View))
+    {
+        mat4_identity(_InvView);
+    }
+    NyUtil::Mat4Mul(_ViewProj, Proj, View);
+    Nyas::FrustumPlanes(_Planes, _ViewProj);
+    _Valid = true;
+    return this;
+}
+
+float *NyasCamera::OriginViewProj(float out[16]) const
+{
+    mat4_assign(out, (float *)View);
+    out[3] = 0.0f;
+    out[7] = 0.0f;
+    out[11] = 0.0f;
+    out[12] = 0.0f;
+    out[13] = 0.0f;
+    out[14] = 0.0f;
+    out[15] = 0.0f;
+    NyUtil::Mat4Mul(out, Proj, out);
+    return out;
+}
+
+void NyasCamera::Navigate()
+{
+    NyVec3 eye = Eye();
+    NyVec3 fwd = Fwd();
+    vec3_negative(fwd, vec3_normalize(fwd, fwd));
+    static NyVec2 mouse_down_pos;
+    float speed = G_Ctx->Cfg.Navigation.Speed * G_Ctx->Platform.DeltaTime;
+
+    // Rotation
+    if (G_Ctx->IO.MouseButton[NyasMouseButton_Right] == NyasKeyState_DOWN)
+    {
+        mouse_down_pos = G_Ctx->IO.MousePosition;
+    }
+
+    float tmp_vec[3];
+    if (G_Ctx->IO.MouseButton[NyasMouseButton_Right] == NyasKeyState_PRESSED)
+    {
+        NyVec2 curr_pos = G_Ctx->IO.MousePosition;
+        NyVec2 offset = { (curr_pos.X - mouse_down_pos.X) * G_Ctx->Cfg.Navigation.DragSensibility,
+            (mouse_down_pos.Y - curr_pos.Y) * G_Ctx->Cfg.Navigation.DragSensibility };
+
+        vec3_add(
+            fwd, fwd, vec3_multiply_f(tmp_vec, vec3_cross(tmp_vec, NyVec3::Up(), fwd), -offset.X));
+        vec3_add(fwd, fwd, vec3_multiply_f(tmp_vec, NyVec3::Up(), offset.Y));
+
+        mouse_down_pos = curr_pos;
+    }
+
+    // Position
+    if (G_Ctx->IO.Keys[NyasKey_W] == NyasKeyState_PRESSED)
+    {
+        vec3_add(eye, eye, vec3_multiply_f(tmp_vec, fwd, speed));
+    }
+
+    if (G_Ctx->IO.Keys[NyasKey_S] == NyasKeyState_PRESSED)
+    {
+        vec3_add(eye, eye, vec3_multiply_f(tmp_vec, fwd, -speed));
+    }
+
+    if (G_Ctx->IO.Keys[NyasKey_A] == NyasKeyState_PRESSED)
+    {
+        vec3_add(eye, eye, vec3_multiply_f(tmp_vec, vec3_cross(tmp_vec, NyVec3::Up(), fwd), speed));
+    }
+
+    if (G_Ctx->IO.Keys[NyasKey_D] == NyasKeyState_PRESSED)
+    {
+        vec3_add(
+            eye, eye, vec3_multiply_f(tmp_vec, vec3_cross(tmp_vec, NyVec3::Up(), fwd), -speed));
+    }
+
+    if (G_Ctx->IO.Keys[NyasKey_Space] == NyasKeyState_PRESSED)
+    {
+        vec3_add(eye, eye, vec3_multiply_f(tmp_vec, NyVec3::Up(), speed));
+    }
+
+    if (G_Ctx->IO.Keys[NyasKey_LeftShift] == NyasKeyState_PRESSED)
+    {
+        vec3_add(eye, eye, vec3_multiply_f(tmp_vec, NyVec3::Up(), -speed));
+    }
+
+    mat4_look_at(View, eye, vec3_add(tmp_vec, eye, fwd), NyVec3::Up());
+
+    // Zoom
+    if (G_Ctx->IO.MouseScroll.Y != 0.0f)
+    {
+        Fov -= G_Ctx->IO.MouseScroll.Y * G_Ctx->Cfg.Navigation.ScrollSensibility;
+        Fov = clampf(Fov, 1.0f, 120.0f);
+        mat4_perspective(Proj, to_radians(Fov),
+            (float)G_Ctx->Platform.WindowSize.X / (float)G_Ctx->Platform.WindowSize.Y, 0.1f, Far);
+    }
+}
+
+static void *_Worker(void *data)
+{
+    _NyScheduler *s = (_NyScheduler *)data;
+    pthread_mutex_lock(&s->Mtx);
+    while (1)
+    {
+        ++s->Waiting;
+        while (!(s->Queue.Size))
+        {
+            if (s->State == NyasSchedState_Closing)
+            {
+                --s->Waiting;
+                pthread_mutex_unlock(&s->Mtx);
+                return NULL;
+            }
+
+            if (s->Waiting == s->Threads.Size)
+            {
+                pthread_cond_broadcast(&s->Idle);
+            }
+            pthread_cond_wait(&s->Cond, &s->Mtx);
+        }
+
+        --s->Waiting;
+        NySched::Job job = s->Queue.Back();
+        s->Queue.Pop();
+        pthread_mutex_unlock(&s->Mtx);
+        (*(job.Func))(job.Args);
+        pthread_mutex_lock(&s->Mtx);
+    }
+}
+
+NySched::NySched(int thread_count)
+{
+    _Sched = (_NyScheduler *)NYAS_ALLOC(sizeof(_NyScheduler));
+    *_Sched = _NyScheduler();
+
+    pthread_mutex_init(&_Sched->Mtx, NULL);
+    pthread_cond_init(&_Sched->Cond, NULL);
+    pthread_cond_init(&_Sched->Idle, NULL);
+
+    // Workers block on the mutex until every thread is registered.
+    pthread_mutex_lock(&_Sched->Mtx);
+    for (int i = 0; i < thread_count; ++i)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, _Worker, _Sched))
+        {
+            NYAS_LOG_ERR("Thread creation error.");
+            break;
+        }
+        _Sched->Threads.Push(thread);
+    }
+
+    _Sched->State = NyasSchedState_Running;
+    pthread_mutex_unlock(&_Sched->Mtx);
+}
+
+NySched::~NySched()
+{
+    pthread_mutex_lock(&_Sched->Mtx);
+    _Sched->State = NyasSchedState_Closing;
+    pthread_cond_broadcast(&_Sched->Cond);
+    pthread_mutex_unlock(&_Sched->Mtx);
+    for (int i = 0; i < _Sched->Threads.Size; ++i)
+    {
+        pthread_join(_Sched->Threads[i], NULL);
+    }
+
+    pthread_mutex_lock(&_Sched->Mtx);
+    pthread_mutex_unlock(&_Sched->Mtx);
+    pthread_mutex_destroy(&_Sched->Mtx);
+    pthread_cond_destroy(&_Sched->Cond);
+    pthread_cond_destroy(&_Sched->Idle);
+
+    _Sched->~_NyScheduler();
+    NYAS_FREE(_Sched);
+}
+
+void NySched::Do(Job job)
+{
+    if (!_Sched->Threads.Size)
+    {
+        (*(job.Func))(job.Args);
+        return;
+    }
+    pthread_mutex_lock(&_Sched->Mtx);
+    _Sched->Queue.Push(job);
+    pthread_cond_signal(&_Sched->Cond);
+    pthread_mutex_unlock(&_Sched->Mtx);
+}
+
+void NySched::Wait()
+{
+    if (!_Sched->Threads.Size)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&_Sched->Mtx);
+    while (_Sched->Queue.Size || _Sched->Waiting != _Sched->Threads.Size)
+    {
+        pthread_cond_wait(&_Sched->Idle, &_Sched->Mtx);
+    }
+    pthread_mutex_unlock(&_Sched->Mtx);
+}
+
+struct _NyRenderer
+{
+    Nyas::_NyFramePacket Packets[2];
+    Nyas::_NyFramePacket *Pending; // Submitted and not taken by the render thread yet.
+    Nyas::_NyFramePacket *Drawing;
+    int Next; // Packet filled by the next submit.
+    pthread_t Thread;
+    pthread_mutex_t Mtx;
+    pthread_cond_t Cond; // Signaled on submit and on close.
+    pthread_cond_t Done; // Signaled when the render thread finishes a packet.
+    bool Closing;
+
+    _NyRenderer() : Pending(NULL), Drawing(NULL), Next(0), Closing(false) {}
+};
+
+static void *_RenderThread(void *args)
+{
+    _NyRenderer *r = (_NyRenderer *)args;
+    glfwMakeContextCurrent((GLFWwindow *)G_Ctx->Platform.InternalWindow);
+
+    pthread_mutex_lock(&r->Mtx);
+    for (;;)
+    {
+        while (!r->Pending && !r->Closing)
+        {
+            pthread_cond_wait(&r->Cond, &r->Mtx);
+        }
+
+        if (!r->Pending)
+        {
+            break;
+        }
+
+        r->Drawing = r->Pending;
+        r->Pending = NULL;
+        pthread_cond_broadcast(&r->Done);
+        pthread_mutex_unlock(&r->Mtx);
+
+        Nyas::G_DrawPacket = r->Drawing;
+        for (int i = 0; i < r->Drawing->Cmds.Size; ++i)
+        {
+            Nyas::Draw(&r->Drawing->Cmds[i]);
+        }
+        Nyas::G_DrawPacket = NULL;
+        Nyas::WindowSwap();
+
+        pthread_mutex_lock(&r->Mtx);
+        r->Drawing = NULL;
+        pthread_cond_broadcast(&r->Done);
+    }
+    pthread_mutex_unlock(&r->Mtx);
+
+    glfwMakeContextCurrent(NULL);
+    return NULL;
+}
+
+NyRenderThread::NyRenderThread()
+{
+    _Renderer = (_NyRenderer *)NYAS_ALLOC(sizeof(_NyRenderer));
+    new (_Renderer) _NyRenderer();
+    pthread_mutex_init(&_Renderer->Mtx, NULL);
+    pthread_cond_init(&_Renderer->Cond, NULL);
+    pthread_cond_init(&_Renderer->Done, NULL);
+
+    // The context can only be current on one thread.
+    glfwMakeContextCurrent(NULL);
+    if (pthread_create(&_Renderer->Thread, NULL, _RenderThread, _Renderer))
+    {
+        NYAS_LOG_ERR("Thread creation error.");
+        glfwMakeContextCurrent((GLFWwindow *)G_Ctx->Platform.InternalWindow);
+        _Renderer->Closing = true;
+    }
+}
+
+NyRenderThread::~NyRenderThread()
+{
+    if (!_Renderer->Closing)
+    {
+        pthread_mutex_lock(&_Renderer->Mtx);
+        _Renderer->Closing = true;
+        pthread_cond_signal(&_Renderer->Cond);
+        pthread_mutex_unlock(&_Renderer->Mtx);
+        pthread_join(_Renderer->Thread, NULL);
+        glfwMakeContextCurrent((GLFWwindow *)G_Ctx->Platform.InternalWindow);
+    }
+
+    pthread_mutex_destroy(&_Renderer->Mtx);
+    pthread_cond_destroy(&_Renderer->Cond);
+    pthread_cond_destroy(&_Renderer->Done);
+    for (Nyas::_NyFramePacket &p : _Renderer->Packets)
+    {
+        for (int i = 0; i < p.Shaders.Size; ++i)
+        {
+            NYAS_FREE(p.Shaders[i].Mem);
+        }
+    }
+
+    _Renderer->~_NyRenderer();
+    NYAS_FREE(_Renderer);
+}
+
+void NyRenderThread::Submit(NyasDrawCmd *cmds, int count)
+{
+    _NyRenderer *r = _Renderer;
+    if (r->Closing)
+    {
+        // Without render thread the frame is drawn here.
+        for (int i = 0; i < count; ++i)
+        {
+            Nyas::Draw(&cmds[i]);
+        }
+        Nyas::WindowSwap();
+        return;
+    }
+
+    Nyas::_NyFramePacket *p = &r->Packets[r->Next];
+    pthread_mutex_lock(&r->Mtx);
+    while (r->Pending || r->Drawing == p)
+    {
+        pthread_cond_wait(&r->Done, &r->Mtx);
+    }
+    pthread_mutex_unlock(&r->Mtx);
+
+    p->Cmds.Size = 0;
+    p->Units.Size = 0;
+    for (int i = 0; i < p->Shaders.Size; ++i)
+    {
+        p->Shaders[i].Base = NyasCode_None;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        p->Cmds.Push(cmds[i]);
+        if (cmds[i].Shader != NyasCode_NoOp)
+        {
+            Nyas::_SnapshotShader(p, cmds[i].Shader);
+        }
+
+        NyasHandle last = NyasCode_None;
+        for (int j = 0; j < cmds[i].UnitCount; ++j)
+        {
+            p->Units.Push(cmds[i].Units[j]);
+            if (cmds[i].Units[j].Shader != last)
+            {
+                last = cmds[i].Units[j].Shader;
+                Nyas::_SnapshotShader(p, last);
+            }
+        }
+    }
+
+    // Units are pointed once the array stopped growing.
+    NyasDrawUnit *units = p->Units.Buf.Data;
+    for (int i = 0; i < p->Cmds.Size; ++i)
+    {
+        p->Cmds[i].Units = units;
+        units += p->Cmds[i].UnitCount;
+    }
+
+    pthread_mutex_lock(&r->Mtx);
+    r->Pending = p;
+    r->Next ^= 1;
+    pthread_cond_signal(&r->Cond);
+    pthread_mutex_unlock(&r->Mtx);
+}
+
+void NyRenderThread::Wait()
+{
+    pthread_mutex_lock(&_Renderer->Mtx);
+    while (_Renderer->Pending || _Renderer->Drawing)
+    {
+        pthread_cond_wait(&_Renderer->Done, &_Renderer->Mtx);
+    }
+    pthread_mutex_unlock(&_Renderer->Mtx);
+}
+
+static void _RecordJob(void *args)
+{
+    NyasDrawBucket *bucket = (NyasDrawBucket *)args;
+    bucket->_Record(bucket);
+}
+
+void Nyas::RecordDraws(NyArray<NyasDrawCmd, NyFrameAllocator> &frame, NySched *sched, int count,
+    int jobs, void (*record)(NyasDrawBucket *), void *user)
+{
+    jobs = jobs > count ? count : jobs;
+    jobs = jobs < 1 ? 1 : jobs;
+    NyasDrawBucket *buckets =
+        (NyasDrawBucket *)NyFrameAllocator::Alloc(jobs * sizeof(NyasDrawBucket));
+    for (int i = 0; i < jobs; ++i)
+    {
+        NyasDrawBucket *b = new (&buckets[i]) NyasDrawBucket();
+        b->Begin = (int)((int64_t)count * i / jobs);
+        b->End = (int)((int64_t)count * (i + 1) / jobs);
+        b->Index = i;
+        b->User = user;
+        b->_Record = record;
+        sched->Do(NySched::Job(_RecordJob, b));
+    }
+    sched->Wait();
+
+    for (int i = 0; i < jobs; ++i)
+    {
+        for (int j = 0; j < buckets[i].Cmds.Size; ++j)
+        {
+            frame.Push(buckets[i].Cmds[j]);
+        }
+        buckets[i].~NyasDrawBucket();
+    }
+}
+
+void Nyas::FrustumPlanes(float planes[6][4], const float *m)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            planes[i * 2][j] = m[j * 4 + 3] + m[j * 4 + i];
+            planes[i * 2 + 1][j] = m[j * 4 + 3] - m[j * 4 + i];
+        }
+    }
+
+    for (int p = 0; p < 6; ++p)
+    {
+        float *pl = planes[p];
+        float len = sqrtf(pl[0] * pl[0] + pl[1] * pl[1] + pl[2] * pl[2]);
+        len = len > 0.0f ? 1.0f / len : 0.0f;
+        pl[0] *= len;
+        pl[1] *= len;
+        pl[2] *= len;
+        pl[3] *= len;
+    }
+}
+
+static inline float _BoxArea(const float *min, const float *max)
+{
+    float dx = max[0] - min[0];
+    float dy = max[1] - min[1];
+    float dz = max[2] - min[2];
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+static inline void _BoxUnion(float *min, float *max, const NyBVH::Node &a, const NyBVH::Node &b)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        min[i] = a.Min[i] < b.Min[i] ? a.Min[i] : b.Min[i];
+        max[i] = a.Max[i] > b.Max[i] ? a.Max[i] : b.Max[i];
+    }
+}
+
+static inline float _UnionArea(const NyBVH::Node &a, const NyBVH::Node &b)
+{
+    float min[3], max[3];
+    _BoxUnion(min, max, a, b);
+    return _BoxArea(min, max);
+}
+
+int NyBVH::_Alloc()
+{
+    if (Free < 0)
+    {
+        Nodes.Push(Node());
+        return Nodes.Size - 1;
+    }
+
+    int node = Free;
+    Free = Nodes[node].Parent;
+    return node;
+}
+
+void NyBVH::_Free(int node)
+{
+    Nodes[node].Height = -1;
+    Nodes[node].Parent = Free;
+    Free = node;
+}
+
+// Descends towards the sibling with the lowest surface area cost, including the growth that the
+// new parent adds to every ancestor.
+void NyBVH::_InsertLeaf(int leaf)
+{
+    if (Root < 0)
+    {
+        Root = leaf;
+        Nodes[leaf].Parent = -1;
+        return;
+    }
+
+    int index = Root;
+    while (Nodes[index].Height > 0)
+    {
+        const Node &n = Nodes[index];
+        float area = _BoxArea(n.Min, n.Max);
+        float combined = _UnionArea(n, Nodes[leaf]);
+        float cost = 2.0f * combined;
+        float inherited = 2.0f * (combined - area);
+        float child_cost[2];
+        for (int i = 0; i < 2; ++i)
+        {
+            const Node &child = Nodes[n.Child[i]];
+            child_cost[i] = _UnionArea(child, Nodes[leaf]) + inherited;
+            if (child.Height > 0)
+            {
+                child_cost[i] -= _BoxArea(child.Min, child.Max);
+            }
+        }
+
+        if (cost < child_cost[0] && cost < child_cost[1])
+        {
+            break;
+        }
+        index = child_cost[0] < child_cost[1] ? n.Child[0] : n.Child[1];
+    }
+
+    int sibling = index;
+    int old_parent = Nodes[sibling].Parent;
+    int parent = _Alloc();
+    Node &p = Nodes[parent];
+    p.Parent = old_parent;
+    p.Child[0] = sibling;
+    p.Child[1] = leaf;
+    p.Height = Nodes[sibling].Height + 1;
+    p.User = -1;
+    _BoxUnion(p.Min, p.Max, Nodes[sibling], Nodes[leaf]);
+    Nodes[sibling].Parent = parent;
+    Nodes[leaf].Parent = parent;
+
+    if (old_parent < 0)
+    {
+        Root = parent;
+    }
+    else
+    {
+        Node &op = Nodes[old_parent];
+        op.Child[op.Child[0] == sibling ? 0 : 1] = parent;
+    }
+    _Refit(parent);
+}
+
+void NyBVH::_RemoveLeaf(int leaf)
+{
+    if (leaf == Root)
+    {
+        Root = -1;
+        return;
+    }
+
+    int parent = Nodes[leaf].Parent;
+    int grand = Nodes[parent].Parent;
+    int sibling = Nodes[parent].Child[Nodes[parent].Child[0] == leaf ? 1 : 0];
+    _Free(parent);
+    Nodes[sibling].Parent = grand;
+    if (grand < 0)
+    {
+        Root = sibling;
+        return;
+    }
+
+    Node &g = Nodes[grand];
+    g.Child[g.Child[0] == parent ? 0 : 1] = sibling;
+    _Refit(grand);
+}
+
+// Recomputes boxes and heights up to the root, rotating every node on the way.
+void NyBVH::_Refit(int node)
+{
+    while (node >= 0)
+    {
+        Node &n = Nodes[node];
+        _BoxUnion(n.Min, n.Max, Nodes[n.Child[0]], Nodes[n.Child[1]]);
+        _Rotate(node);
+        int h0 = Nodes[n.Child[0]].Height;
+        int h1 = Nodes[n.Child[1]].Height;
+        n.Height = 1 + (h0 > h1 ? h0 : h1);
+        node = n.Parent;
+    }
+}
+
+// Swaps a child with a grandchild on the other side when it shrinks the surface area of the
+// internal child. The box of the node itself does not change.
+void NyBVH::_Rotate(int node)
+{
+    Node &a = Nodes[node];
+    if (a.Height < 2)
+    {
+        return;
+    }
+
+    float best_gain = 0.0f;
+    int best_side = -1;
+    int best_grandchild = -1;
+    for (int side = 0; side < 2; ++side)
+    {
+        const Node &keep = Nodes[a.Child[side]];
+        const Node &other = Nodes[a.Child[1 - side]];
+        if (other.Height == 0)
+        {
+            continue;
+        }
+
+        float area = _BoxArea(other.Min, other.Max);
+        for (int k = 0; k < 2; ++k)
+        {
+            // a.Child[side] goes down into other, replacing its child k.
+            float gain = area - _UnionArea(keep, Nodes[other.Child[1 - k]]);
+            if (gain > best_gain)
+            {
+                best_gain = gain;
+                best_side = side;
+                best_grandchild = k;
+            }
+        }
+    }
+
+    if (best_side < 0)
+    {
+        return;
+    }
+
+    int up = a.Child[best_side];
+    int inner = a.Child[1 - best_side];
+    Node &other = Nodes[inner];
+    int down = other.Child[best_grandchild];
+    a.Child[best_side] = down;
+    Nodes[down].Parent = node;
+    other.Child[best_grandchild] = up;
+    Nodes[up].Parent = inner;
+    _BoxUnion(other.Min, other.Max, Nodes[other.Child[0]], Nodes[other.Child[1]]);
+    int h0 = Nodes[other.Child[0]].Height;
+    int h1 = Nodes[other.Child[1]].Height;
+    other.Height = 1 + (h0 > h1 ? h0 : h1);
+}
+
+int NyBVH::Insert(const float *min, const float *max, int user)
+{
+    int leaf = _Alloc();
+    Node &n = Nodes[leaf];
+    for (int i = 0; i < 3; ++i)
+    {
+        n.Min[i] = min[i] - Margin;
+        n.Max[i] = max[i] + Margin;
+    }
+    n.Parent = -1;
+    n.Child[0] = -1;
+    n.Child[1] = -1;
+    n.Height = 0;
+    n.User = user;
+    _InsertLeaf(leaf);
+    ++Leaves;
+    return leaf;
+}
+
+void NyBVH::Remove(int leaf)
+{
+    NYAS_ASSERT(Nodes[leaf].Height == 0 && "Not a leaf.");
+    _RemoveLeaf(leaf);
+    _Free(leaf);
+    --Leaves;
+}
+
+bool NyBVH::Move(int leaf, const float *min, const float *max)
+{
+    Node &n = Nodes[leaf];
+    bool contained = true;
+    for (int i = 0; i < 3; ++i)
+    {
+        contained = contained && n.Min[i] <= min[i] && max[i] <= n.Max[i];
+    }
+
+    if (contained)
+    {
+        return false;
+    }
+
+    _RemoveLeaf(leaf);
+    for (int i = 0; i < 3; ++i)
+    {
+        Nodes[leaf].Min[i] = min[i] - Margin;
+        Nodes[leaf].Max[i] = max[i] + Margin;
+    }
+    _InsertLeaf(leaf);
+    return true;
+}
+
+void NyBVH::_Collect(int node, NyArray<int> &out) const
+{
+    NyArray<int> stack;
+    stack.Push(node);
+    while (stack.Size)
+    {
+        const Node &n = Nodes[stack.Back()];
+        stack.Pop();
+        if (n.Height == 0)
+        {
+            out.Push(n.User);
+            continue;
+        }
+        stack.Push(n.Child[0]);
+        stack.Push(n.Child[1]);
+    }
+}
+
+// Subtrees fully inside the frustum are collected without further plane tests.
+void NyBVH::QueryFrustum(const float planes[6][4], NyArray<int> &out) const
+{
+    NyArray<int> stack;
+    if (Root >= 0)
+    {
+        stack.Push(Root);
+    }
+
+    while (stack.Size)
+    {
+        int node = stack.Back();
+        stack.Pop();
+        const Node &n = Nodes[node];
+        bool outside = false;
+        bool inside = true;
+        for (int p = 0; p < 6 && !outside; ++p)
+        {
+            const float *pl = planes[p];
+            float far = pl[3];
+            float near = pl[3];
+            for (int i = 0; i < 3; ++i)
+            {
+                far += pl[i] * (pl[i] >= 0.0f ? n.Max[i] : n.Min[i]);
+                near += pl[i] * (pl[i] >= 0.0f ? n.Min[i] : n.Max[i]);
+            }
+            outside = far < 0.0f;
+            inside = inside && near >= 0.0f;
+        }
+
+        if (outside)
+        {
+            continue;
+        }
+
+        if (inside || n.Height == 0)
+        {
+            _Collect(node, out);
+            continue;
+        }
+        stack.Push(n.Child[0]);
+        stack.Push(n.Child[1]);
+    }
+}
+
+void NyBVH::QuerySphere(const float *center, float radius, NyArray<int> &out) const
+{
+    NyArray<int> stack;
+    if (Root >= 0)
+    {
+        stack.Push(Root);
+    }
+
+    while (stack.Size)
+    {
+        const Node &n = Nodes[stack.Back()];
+        stack.Pop();
+        float d2 = 0.0f;
+        for (int i = 0; i < 3; ++i)
+        {
+            float d = center[i] < n.Min[i] ? n.Min[i] - center[i] :
+                (center[i] > n.Max[i] ? center[i] - n.Max[i] : 0.0f);
+            d2 += d * d;
+        }
+
+        if (d2 > radius * radius)
+        {
+            continue;
+        }
+
+        if (n.Height == 0)
+        {
+            out.Push(n.User);
+            continue;
+        }
+        stack.Push(n.Child[0]);
+        stack.Push(n.Child[1]);
+    }
+}
+
+void NyBVH::QueryRay(const float *origin, const float *dir, float max_t, NyArray<int> &out) const
+{
+    float inv[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        inv[i] = 1.0f / dir[i];
+    }
+
+    NyArray<int> stack;
+    if (Root >= 0)
+    {
+        stack.Push(Root);
+    }
+
+    while (stack.Size)
+    {
+        const Node &n = Nodes[stack.Back()];
+        stack.Pop();
+        float t0 = 0.0f;
+        float t1 = max_t;
+        for (int i = 0; i < 3 && t0 <= t1; ++i)
+        {
+            float ta = (n.Min[i] - origin[i]) * inv[i];
+            float tb = (n.Max[i] - origin[i]) * inv[i];
+            t0 = fmaxf(t0, fminf(ta, tb));
+            t1 = fminf(t1, fmaxf(ta, tb));
+        }
+
+        if (t0 > t1)
+        {
+            continue;
+        }
+
+        if (n.Height == 0)
+        {
+            out.Push(n.User);
+            continue;
+        }
+        stack.Push(n.Child[0]);
+        stack.Push(n.Child[1]);
+    }
+}
+
+namespace Nyas
+{
+NyBVH EntityTree;
+NyTransforms Transforms;
+static NyArray<int> G_EntityLeaves; // Tree leaf of each entity, -1 if it is not indexed.
+static int G_EntitiesIndexed; // Entities with a leaf, the tree is only used when all have one.
+
+static bool _EntitiesIndexed()
+{
+    return G_EntitiesIndexed == Entities.Count;
+}
+
+// World space box of the entity mesh bounds.
+static void _EntityBox(int entity, float *min, float *max)
+{
+    const float *m = Entities[entity].Transform;
+    const NyasMesh *mesh = &Meshes[Entities[entity].Mesh];
+    float c[3], e[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        c[i] = (mesh->BoundsMin[i] + mesh->BoundsMax[i]) * 0.5f;
+        e[i] = (mesh->BoundsMax[i] - mesh->BoundsMin[i]) * 0.5f;
+    }
+
+    for (int i = 0; i < 3; ++i)
+    {
+        float wc = m[i] * c[0] + m[4 + i] * c[1] + m[8 + i] * c[2] + m[12 + i];
+        float we = fabsf(m[i]) * e[0] + fabsf(m[4 + i]) * e[1] + fabsf(m[8 + i]) * e[2];
+        min[i] = wc - we;
+        max[i] = wc + we;
+    }
+}
+
+// World space bounding sphere of the entity mesh, radius scaled by the largest axis scale.
+static void _EntitySphere(int entity, float *out)
+{
+    const float *m = Entities[entity].Transform;
+    const float *sphere = Meshes[Entities[entity].Mesh].Sphere;
+    out[0] = m[0] * sphere[0] + m[4] * sphere[1] + m[8] * sphere[2] + m[12];
+    out[1] = m[1] * sphere[0] + m[5] * sphere[1] + m[9] * sphere[2] + m[13];
+    out[2] = m[2] * sphere[0] + m[6] * sphere[1] + m[10] * sphere[2] + m[14];
+    float sx = m[0] * m[0] + m[1] * m[1] + m[2] * m[2];
+    float sy = m[4] * m[4] + m[5] * m[5] + m[6] * m[6];
+    float sz = m[8] * m[8] + m[9] * m[9] + m[10] * m[10];
+    float scale2 = sx > sy ? (sx > sz ? sx : sz) : (sy > sz ? sy : sz);
+    out[3] = sphere[3] * sqrtf(scale2);
+}
+
+void UpdateEntity(int entity)
+{
+    while (G_EntityLeaves.Size <= entity)
+    {
+        G_EntityLeaves.Push(-1);
+    }
+
+    float min[3], max[3];
+    _EntityBox(entity, min, max);
+    if (G_EntityLeaves[entity] < 0)
+    {
+        G_EntityLeaves[entity] = EntityTree.Insert(min, max, entity);
+        ++G_EntitiesIndexed;
+    }
+    else
+    {
+        EntityTree.Move(G_EntityLeaves[entity], min, max);
+    }
+}
+
+void RemoveEntity(int entity)
+{
+    if (entity < G_EntityLeaves.Size && G_EntityLeaves[entity] >= 0)
+    {
+        EntityTree.Remove(G_EntityLeaves[entity]);
+        G_EntityLeaves[entity] = -1;
+        --G_EntitiesIndexed;
+    }
+    Entities.Remove(entity);
+}
+
+int PickEntity(const float *origin, const float *dir, float max_t)
+{
+    NyArray<int> candidates;
+    const int *ids;
+    int count;
+    if (_EntitiesIndexed())
+    {
+        EntityTree.QueryRay(origin, dir, max_t, candidates);
+        ids = candidates.Buf.Data;
+        count = candidates.Size;
+    }
+    else
+    {
+        int *live = (int *)NyFrameAllocator::Alloc(Entities.Count * sizeof(int));
+        count = Entities.LiveIds(live);
+        ids = live;
+    }
+
+    int nearest = NyasCode_None;
+    float a = dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2];
+    for (int i = 0; i < count; ++i)
+    {
+        int entity = ids[i];
+        float sphere[4];
+        _EntitySphere(entity, sphere);
+        float oc[3] = { origin[0] - sphere[0], origin[1] - sphere[1], origin[2] - sphere[2] };
+        float b = oc[0] * dir[0] + oc[1] * dir[1] + oc[2] * dir[2];
+        float c = oc[0] * oc[0] + oc[1] * oc[1] + oc[2] * oc[2] - sphere[3] * sphere[3];
+        float disc = b * b - a * c;
+        if (disc < 0.0f)
+        {
+            continue;
+        }
+
+        float t = (-b - sqrtf(disc)) / a;
+        t = t < 0.0f ? (-b + sqrtf(disc)) / a : t;
+        if (t >= 0.0f && t < max_t)
+        {
+            max_t = t;
+            nearest = entity;
+        }
+    }
+    return nearest;
+}
+} // namespace Nyas
+
+int NyTransforms::Add(int parent, int entity)
+{
+    static const float identity[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+    int slot = Tx.Size;
+    int node = Slot.Size;
+    Tx.Push(0.0f);
+    Ty.Push(0.0f);
+    Tz.Push(0.0f);
+    Qx.Push(0.0f);
+    Qy.Push(0.0f);
+    Qz.Push(0.0f);
+    Qw.Push(1.0f);
+    Sx.Push(1.0f);
+    Sy.Push(1.0f);
+    Sz.Push(1.0f);
+    for (int i = 0; i < 16; ++i)
+    {
+        World.Push(identity[i]);
+    }
+    Parent.Push(parent < 0 ? -1 : Slot[parent]);
+    Entity.Push(entity);
+    Dirty.Push(1);
+    Node.Push(node);
+    Slot.Push(slot);
+    Unsorted = true; // Appended after its parent, but the level boundaries moved.
+    return node;
+}
+
+void NyTransforms::Remove(int node)
+{
+    int slot = Slot[node];
+    for (int i = 0; i < Parent.Size; ++i)
+    {
+        if (Parent[i] == slot)
+        {
+            Parent[i] = Parent[slot];
+            Dirty[i] = 1;
+        }
+    }
+    Parent[slot] = -2; // Dropped by the next sort.
+    Slot[node] = -1;
+    Unsorted = true;
+}
+
+int NyTransforms::SetParent(int node, int parent)
+{
+    int slot = Slot[node];
+    int p = parent < 0 ? -1 : Slot[parent];
+    for (int i = p; i >= 0; i = Parent[i])
+    {
+        if (i == slot)
+        {
+            NYAS_LOG_ERR("Node %d can not be parented to its own subtree.", node);
+            return NyasCode_Error;
+        }
+    }
+
+    Parent[slot] = p;
+    Dirty[slot] = 1;
+    Unsorted = true;
+    return NyasCode_Ok;
+}
+
+void NyTransforms::SetLocal(int node, const float *t, const float *q, const float *s)
+{
+    int i = Slot[node];
+    if (t)
+    {
+        Tx[i] = t[0];
+        Ty[i] = t[1];
+        Tz[i] = t[2];
+    }
+
+    if (q)
+    {
+        Qx[i] = q[0];
+        Qy[i] = q[1];
+        Qz[i] = q[2];
+        Qw[i] = q[3];
+    }
+
+    if (s)
+    {
+        Sx[i] = s[0];
+        Sy[i] = s[1];
+        Sz[i] = s[2];
+    }
+    Dirty[i] = 1;
+}
+
+int NyTransforms::_Depth(int slot) const
+{
+    int depth = 0;
+    for (int i = Parent[slot]; i >= 0; i = Parent[i])
+    {
+        ++depth;
+    }
+    return depth;
+}
+
+// Stable counting sort of the live slots by depth. Removed slots are dropped here.
+void NyTransforms::_Sort()
+{
+    int count = Tx.Size;
+    int *depth = (int *)NyFrameAllocator::Alloc(count * sizeof(int));
+    int *order = (int *)NyFrameAllocator::Alloc(count * sizeof(int));
+    int *new_slot = (int *)NyFrameAllocator::Alloc(count * sizeof(int));
+    int max_depth = -1;
+    for (int i = 0; i < count; ++i)
+    {
+        depth[i] = Parent[i] == -2 ? -1 : _Depth(i);
+        max_depth = depth[i] > max_depth ? depth[i] : max_depth;
+    }
+
+    Levels.Size = 0;
+    for (int d = 0; d <= max_depth + 1; ++d)
+    {
+        Levels.Push(0);
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        if (depth[i] >= 0)
+        {
+            ++Levels[depth[i] + 1];
+        }
+    }
+    for (int d = 1; d < Levels.Size; ++d)
+    {
+        Levels[d] += Levels[d - 1];
+    }
+
+    int *cursor = (int *)NyFrameAllocator::Alloc((max_depth + 2) * sizeof(int));
+    memcpy(cursor, Levels.Buf.Data, Levels.Size * sizeof(int));
+    for (int i = 0; i < count; ++i)
+    {
+        new_slot[i] = depth[i] >= 0 ? cursor[depth[i]]++ : -1;
+        if (new_slot[i] >= 0)
+        {
+            order[new_slot[i]] = i;
+        }
+    }
+
+    int live = Levels.Size ? Levels.Back() : 0;
+    NyArray<float> *soa[] = { &Tx, &Ty, &Tz, &Qx, &Qy, &Qz, &Qw, &Sx, &Sy, &Sz };
+    float *tmp = (float *)NyFrameAllocator::Alloc(count * 16 * sizeof(float));
+    for (NyArray<float> *a : soa)
+    {
+        for (int i = 0; i < live; ++i)
+        {
+            tmp[i] = (*a)[order[i]];
+        }
+        memcpy(a->Buf.Data, tmp, live * sizeof(float));
+        a->Size = live;
+    }
+
+    for (int i = 0; i < live; ++i)
+    {
+        memcpy(tmp + i * 16, World.Buf.Data + order[i] * 16, 16 * sizeof(float));
+    }
+    memcpy(World.Buf.Data, tmp, live * 16 * sizeof(float));
+    World.Size = live * 16;
+
+    int *itmp = (int *)tmp;
+    NyArray<int> *ints[] = { &Parent, &Entity, &Node };
+    for (NyArray<int> *a : ints)
+    {
+        for (int i = 0; i < live; ++i)
+        {
+            int v = (*a)[order[i]];
+            itmp[i] = a == &Parent && v >= 0 ? new_slot[v] : v;
+        }
+        memcpy(a->Buf.Data, itmp, live * sizeof(int));
+        a->Size = live;
+    }
+
+    uint8_t *btmp = (uint8_t *)tmp;
+    for (int i = 0; i < live; ++i)
+    {
+        btmp[i] = Dirty[order[i]];
+    }
+    memcpy(Dirty.Buf.Data, btmp, live);
+    Dirty.Size = live;
+
+    for (int i = 0; i < live; ++i)
+    {
+        Slot[Node[i]] = i;
+    }
+    Unsorted = false;
+}
+
+struct _NyTransformJob
+{
+    NyTransforms *T;
+    const int *Slots; // Dirty slots of one level.
+    int Begin;
+    int End;
+};
+
+// Local matrices of four slots from their TRS, lane l of out[k] is element k of the upper 3x4
+// part (column major) of the matrix of slots[l].
+static void _LocalMatrices4(const NyTransforms *t, const int *s, float out[12][4])
+{
+#if defined(NYAS_X86)
+#define NY_GATHER(A) _mm_set_ps(t->A[s[3]], t->A[s[2]], t->A[s[1]], t->A[s[0]])
+    __m128 qx = NY_GATHER(Qx), qy = NY_GATHER(Qy), qz = NY_GATHER(Qz), qw = NY_GATHER(Qw);
+    __m128 sx = NY_GATHER(Sx), sy = NY_GATHER(Sy), sz = NY_GATHER(Sz);
+    __m128 two = _mm_set1_ps(2.0f);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 xx = _mm_mul_ps(qx, qx), yy = _mm_mul_ps(qy, qy), zz = _mm_mul_ps(qz, qz);
+    __m128 xy = _mm_mul_ps(qx, qy), xz = _mm_mul_ps(qx, qz), yz = _mm_mul_ps(qy, qz);
+    __m128 wx = _mm_mul_ps(qw, qx), wy = _mm_mul_ps(qw, qy), wz = _mm_mul_ps(qw, qz);
+    __m128 m[12] = {
+        _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), sx),
+        _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), sx),
+        _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), sx),
+        _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), sy),
+        _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), sy),
+        _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), sy),
+        _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), sz),
+        _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), sz),
+        _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), sz),
+        NY_GATHER(Tx),
+        NY_GATHER(Ty),
+        NY_GATHER(Tz),
+    };
+#undef NY_GATHER
+    for (int k = 0; k < 12; ++k)
+    {
+        _mm_storeu_ps(out[k], m[k]);
+    }
+#else
+    for (int l = 0; l < 4; ++l)
+    {
+        int i = s[l];
+        float x = t->Qx[i], y = t->Qy[i], z = t->Qz[i], w = t->Qw[i];
+        float m[12] = {
+            (1.0f - 2.0f * (y * y + z * z)) * t->Sx[i],
+            2.0f * (x * y + w * z) * t->Sx[i],
+            2.0f * (x * z - w * y) * t->Sx[i],
+            2.0f * (x * y - w * z) * t->Sy[i],
+            (1.0f - 2.0f * (x * x + z * z)) * t->Sy[i],
+            2.0f * (y * z + w * x) * t->Sy[i],
+            2.0f * (x * z + w * y) * t->Sz[i],
+            2.0f * (y * z - w * x) * t->Sz[i],
+            (1.0f - 2.0f * (x * x + y * y)) * t->Sz[i],
+            t->Tx[i],
+            t->Ty[i],
+            t->Tz[i],
+        };
+        for (int k = 0; k < 12; ++k)
+        {
+            out[k][l] = m[k];
+        }
     }
+#endif
+}
 
-    NyasHandle data_texarr[4];
-    for (int i = 0; i < tac; ++i)
+// out = parent * local, local being an affine 3x4 in column major order.
+static inline void _AffineMul(float *out, const float *parent, const float *local)
+{
+#if defined(NYAS_X86)
+    __m128 p0 = _mm_loadu_ps(parent);
+    __m128 p1 = _mm_loadu_ps(parent + 4);
+    __m128 p2 = _mm_loadu_ps(parent + 8);
+    __m128 p3 = _mm_loadu_ps(parent + 12);
+    for (int c = 0; c < 4; ++c)
     {
-        NyasTexture *itx = _SyncTex(s->TexArrays[i]);
-        data_texarr[i] = (int)itx->Resource.Id;
+        const float *l = local + c * 3;
+        __m128 col = _mm_add_ps(_mm_mul_ps(p0, _mm_set1_ps(l[0])),
+            _mm_add_ps(_mm_mul_ps(p1, _mm_set1_ps(l[1])), _mm_mul_ps(p2, _mm_set1_ps(l[2]))));
+        _mm_storeu_ps(out + c * 4, c == 3 ? _mm_add_ps(col, p3) : col);
+    }
+#else
+    for (int c = 0; c < 4; ++c)
+    {
+        const float *l = local + c * 3;
+        for (int r = 0; r < 4; ++r)
+        {
+            out[c * 4 + r] = parent[r] * l[0] + parent[4 + r] * l[1] + parent[8 + r] * l[2] +
+                (c == 3 ? parent[12 + r] : 0.0f);
+        }
     }
+#endif
+}
 
-    // set opengl uniforms
-    if (tc)
+static void _UpdateTransforms(void *args)
+{
+    static const float identity[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+    _NyTransformJob *job = (_NyTransformJob *)args;
+    NyTransforms *t = job->T;
+    for (int i = job->Begin; i < job->End; i += 4)
     {
-        _NySetShaderTex(tl, data_tex, tc, tex_unit);
+        int lanes = job->End - i < 4 ? job->End - i : 4;
+        int s[4];
+        for (int l = 0; l < 4; ++l)
+        {
+            s[l] = job->Slots[i + (l < lanes ? l : 0)];
+        }
+
+        float m[12][4];
+        _LocalMatrices4(t, s, m);
+        for (int l = 0; l < lanes; ++l)
+        {
+            float local[12];
+            for (int k = 0; k < 12; ++k)
+            {
+                local[k] = m[k][l];
+            }
+
+            int p = t->Parent[s[l]];
+            float *world = t->World.Buf.Data + s[l] * 16;
+            _AffineMul(world, p >= 0 ? t->World.Buf.Data + p * 16 : identity, local);
+            if (t->Entity[s[l]] >= 0)
+            {
+                memcpy(Nyas::Entities[t->Entity[s[l]]].Transform, world, 16 * sizeof(float));
+            }
+        }
     }
+}
 
-    if (cc)
+void NyTransforms::Update(NySched *sched)
+{
+    if (Unsorted)
     {
-        _NySetShaderCubemap(cl, data_tex + tc, cc, tex_unit + tc);
+        _Sort();
     }
 
-    if (tac)
+    int *slots = (int *)NyFrameAllocator::Alloc((Tx.Size + 1) * sizeof(int));
+    int updated = 0;
+    for (int d = 0; d + 1 < Levels.Size; ++d)
     {
-        _NySetShaderTexArray(tal, data_texarr, tac, tex_unit + tc + cc);
+        // Parents are final, their flags tell which children have to follow.
+        int count = 0;
+        for (int i = Levels[d]; i < Levels[d + 1]; ++i)
+        {
+            Dirty[i] |= Parent[i] >= 0 && Dirty[Parent[i]];
+            if (Dirty[i])
+            {
+                slots[updated + count++] = i;
+            }
+        }
+
+        int chunk_count = (count + NYAS_TRANSFORM_CHUNK - 1) / NYAS_TRANSFORM_CHUNK;
+        _NyTransformJob *jobs =
+            (_NyTransformJob *)NyFrameAllocator::Alloc(chunk_count * sizeof(_NyTransformJob));
+        for (int c = 0; c < chunk_count; ++c)
+        {
+            int begin = c * NYAS_TRANSFORM_CHUNK;
+            jobs[c] = { this, slots + updated, begin,
+                begin + NYAS_TRANSFORM_CHUNK < count ? begin + NYAS_TRANSFORM_CHUNK : count };
+            if (sched && chunk_count > 1)
+            {
+                sched->Do(NySched::Job(_UpdateTransforms, &jobs[c]));
+            }
+            else
+            {
+                _UpdateTransforms(&jobs[c]);
+            }
+        }
+
+        if (sched && chunk_count > 1)
+        {
+            sched->Wait();
+        }
+        updated += count;
+    }
+
+    for (int i = 0; i < updated; ++i)
+    {
+        int slot = slots[i];
+        Dirty[slot] = 0;
+        if (Entity[slot] >= 0)
+        {
+            Nyas::UpdateEntity(Entity[slot]);
+        }
     }
 }
 
-void _SyncShader(NyasShader *s)
+struct _NyCullChunk
 {
-    static const char *uniforms[] = { "u_common_tex",
-        "u_common_cube", "u_textures" };
+    const float (*Planes)[4];
+    const int *Ids; // Entity of each slot.
+    float *X, *Y, *Z, *R; // Scratch of the whole range.
+    int Begin;
+    int End;
+    int *Visible; // Entities are written from Begin.
+    int Count;
+};
 
-    if (!(s->Resource.Flags & NyasResourceFlags_Created))
+// Gathers the world space spheres of the chunk entities in SoA and culls them.
+static void _CullChunk(void *args)
+{
+    _NyCullChunk *c = (_NyCullChunk *)args;
+    for (int i = c->Begin; i < c->End; ++i)
     {
-        _NyCreateShader(&s->Resource.Id);
-        s->Resource.Flags |= NyasResourceFlags_Created;
+        float sphere[4];
+        Nyas::_EntitySphere(c->Ids[i], sphere);
+        c->X[i] = sphere[0];
+        c->Y[i] = sphere[1];
+        c->Z[i] = sphere[2];
+        c->R[i] = sphere[3];
     }
 
-    if (s->Resource.Flags & NyasResourceFlags_Dirty)
+    int b = c->Begin;
+    c->Count = NyUtil::CullSpheres(
+        c->Planes, c->X + b, c->Y + b, c->Z + b, c->R + b, c->End - b, c->Visible + b);
+    for (int i = 0; i < c->Count; ++i)
     {
-        NYAS_ASSERT(s->Name && *s->Name && "Shader name needed.");
-        _NyCompileShader(s->Resource.Id, s->Name, s);
-        _NyShaderLocations(s->Resource.Id, &s->SharedTexLocation, &uniforms[0], 3);
-        s->Resource.Flags &= ~NyasResourceFlags_Dirty;
+        c->Visible[b + i] = c->Ids[b + c->Visible[b + i]];
     }
-    _NySetShaderUniformBuffer(s);
 }
 
-static void _SyncFramebuf(NyasHandle framebuffer)
+// Entities indexed in the tree are narrowed down to the ones whose box touches the frustum and
+// sorted back to entity order before the sphere test. Otherwise every entity in use is tested.
+int Nyas::CullEntities(const float *view_proj, int *visible, NySched *sched)
 {
-    struct NyasFramebuffer *fb = &Framebufs[framebuffer];
-    if (!(fb->Resource.Flags & NyasResourceFlags_Created))
+    int count = Entities.Count;
+    if (!count)
     {
-        _NyCreateFramebuf(fb);
-        fb->Resource.Flags |= NyasResourceFlags_Created;
+        return 0;
     }
 
-    _NyUseFramebuf(fb->Resource.Id);
-    if (fb->Resource.Flags & NyasResourceFlags_Dirty)
+    float planes[6][4];
+    FrustumPlanes(planes, view_proj);
+    const int *ids = NULL;
+    if (!_EntitiesIndexed())
     {
-        for (int i = 0; fb->Target[i].Tex != NyasCode_None; ++i)
+        int *live = (int *)NyFrameAllocator::Alloc(count * sizeof(int));
+        count = Entities.LiveIds(live);
+        ids = live;
+    }
+    else
+    {
+        NyArray<int> candidates;
+        EntityTree.QueryFrustum(planes, candidates);
+        count = candidates.Size;
+        if (!count)
         {
-            struct NyasTexture *t = _SyncTex(fb->Target[i].Tex);
-            _NySetFramebuf(fb->Resource.Id, t->Resource.Id, &fb->Target[i]);
+            return 0;
         }
-        fb->Resource.Flags &= ~NyasResourceFlags_Dirty;
+
+        uint64_t *keys = (uint64_t *)NyFrameAllocator::Alloc(count * sizeof(uint64_t));
+        uint32_t *order = (uint32_t *)NyFrameAllocator::Alloc(count * sizeof(uint32_t));
+        for (int i = 0; i < count; ++i)
+        {
+            keys[i] = (uint64_t)candidates[i];
+        }
+        NyUtil::RadixSort(keys, order, count);
+        int *sorted = (int *)NyFrameAllocator::Alloc(count * sizeof(int));
+        for (int i = 0; i < count; ++i)
+        {
+            sorted[i] = (int)keys[i];
+        }
+        ids = sorted;
     }
-}
 
-void Draw(NyasDrawCmd *cmd)
-{
-    if (cmd->Framebuf != NyasCode_NoOp)
+    float *soa = (float *)NyFrameAllocator::Alloc(count * 4 * sizeof(float));
+    int chunk_count = (count + NYAS_CULL_CHUNK - 1) / NYAS_CULL_CHUNK;
+    _NyCullChunk *chunks =
+        (_NyCullChunk *)NyFrameAllocator::Alloc(chunk_count * sizeof(_NyCullChunk));
+    for (int i = 0; i < chunk_count; ++i)
     {
-        if (cmd->Framebuf == NyasCode_Default)
+        _NyCullChunk *c = &chunks[i];
+        c->Planes = planes;
+        c->Ids = ids;
+        c->X = soa;
+        c->Y = soa + count;
+        c->Z = soa + count * 2;
+        c->R = soa + count * 3;
+        c->Begin = i * NYAS_CULL_CHUNK;
+        c->End = c->Begin + NYAS_CULL_CHUNK < count ? c->Begin + NYAS_CULL_CHUNK : count;
+        c->Visible = visible;
+        c->Count = 0;
+        if (sched && chunk_count > 1)
         {
-            _NyUseFramebuf(0);
+            sched->Do(NySched::Job(_CullChunk, c));
         }
         else
         {
-            _SyncFramebuf(cmd->Framebuf);
+            _CullChunk(c);
         }
     }
 
-    if (cmd->Shader != NyasCode_NoOp)
+    if (sched && chunk_count > 1)
     {
-        _NyCheckHandle(cmd->Shader, Shaders);
-        NyasShader *s = &Shaders[cmd->Shader];
-        NyasHandle *SharedTex = (NyasHandle*)NyFrameAllocator::Alloc((s->SharedTexCount + s->SharedCubemapCount) * sizeof(NyasHandle));
-        memcpy(SharedTex, s->Shared, (s->SharedTexCount + s->SharedCubemapCount) * sizeof(NyasHandle));
-        _SyncShader(s);
-        _NyUseShader(s->Resource.Id);
-        _SyncShaderData(s, SharedTex, true);
+        sched->Wait();
     }
 
-    NyasDrawState &s = cmd->State;
-    _NyClearColor(s.BgColorR, s.BgColorG, s.BgColorB, s.BgColorA);
-    _NyClear(s.EnableFlags & NyasDrawFlags_ColorClear, s.EnableFlags & NyasDrawFlags_DepthClear,
-        s.EnableFlags & NyasDrawFlags_StencilClear);
-
-    _NyViewport({ s.ViewportMinX, s.ViewportMinY, s.ViewportMaxX, s.ViewportMaxY });
-    _NyScissor({ s.ScissorMinX, s.ScissorMinY, s.ScissorMaxX, s.ScissorMaxY });
-
-    if (s.DisableFlags & NyasDrawFlags_DepthTest)
-    {
-        _NyDisableDepthTest();
-    }
-    else if (s.EnableFlags & NyasDrawFlags_DepthTest)
+    int n = chunks[0].Count;
+    for (int i = 1; i < chunk_count; ++i)
     {
-        _NyEnableDepthTest();
+        memmove(visible + n, visible + chunks[i].Begin, chunks[i].Count * sizeof(int));
+        n += chunks[i].Count;
     }
+    return n;
+}
 
-    if (s.DisableFlags & NyasDrawFlags_DepthWrite)
+// Whether the sort key field keeps the values seen so far apart. Negative values all map to zero,
+// so only one of them can be told apart.
+static inline bool _KeyFieldExact(int value, int bits, int *negative)
+{
+    if (value >= 0)
     {
-        _NyDisableDepthMask();
+        return value < (1 << bits) - 1;
     }
-    else if (s.EnableFlags & NyasDrawFlags_DepthWrite)
+    *negative = *negative ? *negative : value;
+    return *negative == value;
+}
+
+struct _NyBatchTuple
+{
+    int Shader, Material, Mesh, Lod, Index;
+};
+
+static int _CompareBatchTuple(const void *a, const void *b)
+{
+    const int *x = &((const _NyBatchTuple *)a)->Shader;
+    const int *y = &((const _NyBatchTuple *)b)->Shader;
+    for (int i = 0; i < 5; ++i)
     {
-        _NyEnableDepthMask();
+        if (x[i] != y[i])
+        {
+            return x[i] < y[i] ? -1 : 1;
+        }
     }
+    return 0;
+}
 
-    if (s.DisableFlags & NyasDrawFlags_StencilTest)
+int Nyas::BatchEntities(int *visible, const int *lods, int count, NyasInstanceBatch *batches)
+{
+    if (!count)
     {
-        _NyDisableStencilTest();
+        return 0;
     }
-    else if (s.EnableFlags & NyasDrawFlags_StencilTest)
+
+    // Shader, material and mesh in the order of Nyas::SortKey, the level of detail last. The key
+    // fields are truncated, so aliased values could interleave and split both batches and the
+    // instances of a shader. When any value does not fit its field, the full fields are sorted.
+    uint64_t *keys = (uint64_t *)NyFrameAllocator::Alloc(count * sizeof(uint64_t));
+    uint32_t *order = (uint32_t *)NyFrameAllocator::Alloc(count * sizeof(uint32_t));
+    int *entities = (int *)NyFrameAllocator::Alloc(count * sizeof(int));
+    int negative[3] = { 0, 0, 0 };
+    bool exact = true;
+    for (int i = 0; i < count; ++i)
     {
-        _NyEnableStencilTest();
+        const NyasEntity &e = Entities[visible[i]];
+        int lod = lods ? lods[i] : 0;
+        keys[i] = SortKey(0, NyasCode_None, e.Shader, e.Material, e.Mesh, 0.0f) |
+            (uint64_t)(lod & 0xFFF);
+        entities[i] = visible[i];
+        exact = exact && _KeyFieldExact(e.Shader, 11, &negative[0]) &&
+            _KeyFieldExact(e.Material, 12, &negative[1]) &&
+            _KeyFieldExact(e.Mesh, 12, &negative[2]) && lod >= 0 && lod <= 0xFFF;
     }
 
-    if (s.DisableFlags & NyasDrawFlags_StencilWrite)
+    if (exact)
     {
-        _NyDisableStencilMask();
+        NyUtil::RadixSort(keys, order, count);
     }
-    else if (s.EnableFlags & NyasDrawFlags_StencilWrite)
+    else
     {
-        _NyEnableStencilMask();
+        _NyBatchTuple *tuples =
+            (_NyBatchTuple *)NyFrameAllocator::Alloc(count * sizeof(_NyBatchTuple));
+        for (int i = 0; i < count; ++i)
+        {
+            const NyasEntity &e = Entities[visible[i]];
+            tuples[i] = { e.Shader, e.Material, e.Mesh, lods ? lods[i] : 0, i };
+        }
+        qsort(tuples, count, sizeof(_NyBatchTuple), _CompareBatchTuple);
+        for (int i = 0; i < count; ++i)
+        {
+            order[i] = (uint32_t)tuples[i].Index;
+        }
     }
 
-    if (s.DisableFlags & NyasDrawFlags_Blend)
+    int batch_count = 0;
+    int shader_first = 0; // Position of the first entity of the current shader.
+    for (int i = 0; i < count; ++i)
     {
-        _NyDisableBlend();
+        visible[i] = entities[order[i]];
+        int lod = lods ? lods[order[i]] : 0;
+        const NyasEntity &e = Entities[visible[i]];
+        NyasInstanceBatch *b = batch_count ? &batches[batch_count - 1] : NULL;
+        if (b && b->Shader == e.Shader && b->Material == e.Material && b->Mesh == e.Mesh &&
+            b->Lod == lod)
+        {
+            ++b->Count;
+            continue;
+        }
+
+        shader_first = b && b->Shader == e.Shader ? shader_first : i;
+        batches[batch_count++] = { e.Shader, e.Mesh, e.Material, lod, i, 1, i - shader_first };
     }
-    else if (s.EnableFlags & NyasDrawFlags_Blend)
+    return batch_count;
+}
+
+#if defined(NYAS_IO_URING)
+struct _NyUring
+{
+    int Fd;
+    unsigned Entries;
+    unsigned *SqHead;
+    unsigned *SqTail;
+    unsigned *SqMask;
+    unsigned *SqArray;
+    unsigned *CqHead;
+    unsigned *CqTail;
+    unsigned *CqMask;
+    io_uring_sqe *Sqes;
+    io_uring_cqe *Cqes;
+    void *SqRing;
+    void *CqRing;
+    size_t SqRingSize;
+    size_t CqRingSize;
+};
+#endif
+
+struct _NyAsyncIO
+{
+    NyArray<NyAsyncIO::Read *> Queued; // Waiting for a free submission slot.
+    NyArray<NyAsyncIO::Read *> Completed;
+    pthread_mutex_t Mtx; // Guards Completed, filled by the reader threads.
+    NySched *Readers;
+    int InFlight;
+#if defined(NYAS_IO_URING)
+    _NyUring Ring;
+    bool UseRing;
+#endif
+
+    _NyAsyncIO() : Readers(NULL), InFlight(0) {}
+};
+
+#if defined(NYAS_IO_URING)
+static bool _UringInit(_NyUring *r, unsigned depth)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->Fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+    if (r->Fd < 0)
     {
-        _NyEnableBlend();
+        return false;
     }
 
-    if (s.DisableFlags & NyasDrawFlags_FaceCulling)
+    // IORING_OP_READ predates fast poll, older kernels fall back to the reader threads.
+    if (!(p.features & IORING_FEAT_FAST_POLL))
     {
-        _NyDisableCull();
+        close(r->Fd);
+        return false;
     }
-    else if (s.EnableFlags & NyasDrawFlags_FaceCulling)
+
+    r->Entries = p.sq_entries;
+    r->SqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->CqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
     {
-        _NyEnableCull();
+        r->SqRingSize = r->CqRingSize =
+            r->SqRingSize > r->CqRingSize ? r->SqRingSize : r->CqRingSize;
     }
 
-    if (s.DisableFlags & NyasDrawFlags_Scissor)
+    r->SqRing = mmap(NULL, r->SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        r->Fd, IORING_OFF_SQ_RING);
+    r->CqRing = single_mmap ? r->SqRing :
+                              mmap(NULL, r->CqRingSize, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, r->Fd, IORING_OFF_CQ_RING);
+    r->Sqes = (io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->Fd, IORING_OFF_SQES);
+    if (r->SqRing == MAP_FAILED || r->CqRing == MAP_FAILED || r->Sqes == MAP_FAILED)
     {
-        _NyDisableScissor();
+        NYAS_LOG_WARN("io_uring ring mapping failed.");
+        close(r->Fd);
+        return false;
     }
-    else if (s.EnableFlags & NyasDrawFlags_Scissor)
+
+    char *sq = (char *)r->SqRing;
+    char *cq = (char *)r->CqRing;
+    r->SqHead = (unsigned *)(sq + p.sq_off.head);
+    r->SqTail = (unsigned *)(sq + p.sq_off.tail);
+    r->SqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->SqArray = (unsigned *)(sq + p.sq_off.array);
+    r->CqHead = (unsigned *)(cq + p.cq_off.head);
+    r->CqTail = (unsigned *)(cq + p.cq_off.tail);
+    r->CqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->Cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+static void _UringRelease(_NyUring *r)
+{
+    munmap(r->Sqes, r->Entries * sizeof(io_uring_sqe));
+    if (r->CqRing != r->SqRing)
     {
-        _NyEnableScissor();
+        munmap(r->CqRing, r->CqRingSize);
     }
+    munmap(r->SqRing, r->SqRingSize);
+    close(r->Fd);
+}
 
-    _NySetDepthFunc(s.Depth);
-    _NySetBlend(s.BlendSrc, s.BlendDst);
-    _NySetCull(s.FaceCulling);
+static void _UringPushRead(_NyUring *r, NyAsyncIO::Read *read)
+{
+    unsigned tail = *r->SqTail;
+    unsigned idx = tail & *r->SqMask;
+    io_uring_sqe *sqe = &r->Sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = read->_Fd;
+    sqe->addr = (uint64_t)(uintptr_t)(read->Data + read->_Offset);
+    size_t left = read->Size - read->_Offset;
+    sqe->len = (uint32_t)(left < 0x7FFFF000 ? left : 0x7FFFF000); // Linux read limit.
+    sqe->off = read->_Offset;
+    sqe->user_data = (uint64_t)(uintptr_t)read;
+    r->SqArray[idx] = idx;
+    __atomic_store_n(r->SqTail, tail + 1, __ATOMIC_RELEASE);
+}
 
-    for (int i = 0; i < cmd->UnitCount; ++i)
+// Submits the pushed reads and waits for at least min_complete completions.
+static void _UringEnter(_NyUring *r, unsigned min_complete)
+{
+    unsigned to_submit = *r->SqTail - __atomic_load_n(r->SqHead, __ATOMIC_ACQUIRE);
+    while (syscall(__NR_io_uring_enter, r->Fd, to_submit, min_complete,
+               min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0 &&
+        errno == EINTR)
     {
-        NyasMesh *imsh = &Meshes[cmd->Units[i].Mesh];
-        _NyCheckHandle(cmd->Units[i].Mesh, Meshes);
-        NYAS_ASSERT(imsh->ElementCount && "Attempt to draw an uninitialized mesh");
+    }
+}
 
-        if (imsh->Resource.Flags & NyasResourceFlags_Dirty)
-        {
-            _SyncMesh(cmd->Units[i].Mesh, cmd->Units[i].Shader);
-        }
+// Moves queued reads to the free ring slots. Returns the reads left in the ring.
+static unsigned _UringFlush(_NyAsyncIO *io)
+{
+    _NyUring *r = &io->Ring;
+    unsigned in_ring = io->InFlight - io->Queued.Size - io->Completed.Size;
+    unsigned pushed = 0;
+    for (; io->Queued.Size && in_ring < r->Entries; ++in_ring, ++pushed)
+    {
+        _UringPushRead(r, io->Queued.Back());
+        io->Queued.Pop();
+    }
 
-        NyasShader *s = &Shaders[cmd->Units[i].Shader];
-        _NyUseMesh(imsh, s);
-        _NyDraw(imsh->ElementCount, sizeof(NyDrawIdx) == 4, cmd->Units[i].Instances);
+    if (pushed)
+    {
+        _UringEnter(r, 0);
     }
+    return in_ring;
 }
-} // namespace Nyas
-
-NyasHandle NYAS_SPHERE;
-NyasHandle NYAS_CUBE;
-NyasHandle NYAS_QUAD;
+#endif
 
-void NyasCamera::Navigate()
+static void _AsyncReadFinish(_NyAsyncIO *io, NyAsyncIO::Read *read, int err)
 {
-    NyVec3 eye = Eye();
-    NyVec3 fwd = Fwd();
-    vec3_negative(fwd, vec3_normalize(fwd, fwd));
-    static NyVec2 mouse_down_pos;
-    float speed = G_Ctx->Cfg.Navigation.Speed * G_Ctx->Platform.DeltaTime;
-
-    // Rotation
-    if (G_Ctx->IO.MouseButton[NyasMouseButton_Right] == NyasKeyState_DOWN)
+    if (read->_Fd >= 0)
     {
-        mouse_down_pos = G_Ctx->IO.MousePosition;
+        close(read->_Fd);
+        read->_Fd = -1;
     }
 
-    float tmp_vec[3];
-    if (G_Ctx->IO.MouseButton[NyasMouseButton_Right] == NyasKeyState_PRESSED)
+    read->Err = err;
+    if (err != NyasCode_Ok)
     {
-        NyVec2 curr_pos = G_Ctx->IO.MousePosition;
-        NyVec2 offset = { (curr_pos.X - mouse_down_pos.X) * G_Ctx->Cfg.Navigation.DragSensibility,
-            (mouse_down_pos.Y - curr_pos.Y) * G_Ctx->Cfg.Navigation.DragSensibility };
+        NYAS_LOG_ERR("Async read of %s failed (%d).", read->Path, err);
+        NYAS_FREE(read->Data);
+        read->Data = NULL;
+        read->Size = 0;
+    }
+    else
+    {
+        read->Data[read->Size] = '\0';
+    }
 
-        vec3_add(
-            fwd, fwd, vec3_multiply_f(tmp_vec, vec3_cross(tmp_vec, NyVec3::Up(), fwd), -offset.X));
-        vec3_add(fwd, fwd, vec3_multiply_f(tmp_vec, NyVec3::Up(), offset.Y));
+    pthread_mutex_lock(&io->Mtx);
+    io->Completed.Push(read);
+    pthread_mutex_unlock(&io->Mtx);
+}
 
-        mouse_down_pos = curr_pos;
+static void _AsyncReadJob(void *arg)
+{
+    NyAsyncIO::Read *read = (NyAsyncIO::Read *)arg;
+    int err = Nyas::ReadFile(read->Path, &read->Data, &read->Size);
+    if (err != NyasCode_Ok)
+    {
+        read->Data = NULL; // ReadFile may leave it dangling on failure.
+        read->Size = 1;
     }
+    read->Size -= 1;
+    _AsyncReadFinish(read->_IO, read, err);
+}
 
-    // Position
-    if (G_Ctx->IO.Keys[NyasKey_W] == NyasKeyState_PRESSED)
+NyAsyncIO::NyAsyncIO(int depth)
+{
+    _IO = (_NyAsyncIO *)NYAS_ALLOC(sizeof(_NyAsyncIO));
+    *_IO = _NyAsyncIO();
+    pthread_mutex_init(&_IO->Mtx, NULL);
+
+#if defined(NYAS_IO_URING)
+    _IO->UseRing = _UringInit(&_IO->Ring, (unsigned)depth);
+    if (_IO->UseRing)
     {
-        vec3_add(eye, eye, vec3_multiply_f(tmp_vec, fwd, speed));
+        return;
     }
+#endif
 
-    if (G_Ctx->IO.Keys[NyasKey_S] == NyasKeyState_PRESSED)
+    NY_UNUSED(depth);
+    _IO->Readers = (NySched *)NYAS_ALLOC(sizeof(NySched));
+    new (_IO->Readers) NySched(NYAS_ASYNC_IO_THREADS);
+}
+
+NyAsyncIO::~NyAsyncIO()
+{
+    Wait();
+    if (_IO->Readers)
     {
-        vec3_add(eye, eye, vec3_multiply_f(tmp_vec, fwd, -speed));
+        _IO->Readers->~NySched();
+        NYAS_FREE(_IO->Readers);
     }
 
-    if (G_Ctx->IO.Keys[NyasKey_A] == NyasKeyState_PRESSED)
+#if defined(NYAS_IO_URING)
+    if (_IO->UseRing)
     {
-        vec3_add(eye, eye, vec3_multiply_f(tmp_vec, vec3_cross(tmp_vec, NyVec3::Up(), fwd), speed));
+        _UringRelease(&_IO->Ring);
     }
+#endif
 
-    if (G_Ctx->IO.Keys[NyasKey_D] == NyasKeyState_PRESSED)
+    pthread_mutex_destroy(&_IO->Mtx);
+    _IO->~_NyAsyncIO();
+    NYAS_FREE(_IO);
+}
+
+void NyAsyncIO::Submit(Read *read)
+{
+    read->_IO = _IO;
+    read->_Fd = -1;
+    read->_Offset = 0;
+    read->Data = NULL;
+    read->Size = 0;
+    ++_IO->InFlight;
+
+#if defined(NYAS_IO_URING)
+    // Packs are already mapped and platform readers are opaque, only disk reads go to the ring.
+    NyasFileView view;
+    if (_IO->UseRing && !G_Ctx->Platform.ReadFile && !Nyas::_PakLookup(read->Path, &view))
     {
-        vec3_add(
-            eye, eye, vec3_multiply_f(tmp_vec, vec3_cross(tmp_vec, NyVec3::Up(), fwd), -speed));
-    }
+        struct stat st;
+        read->_Fd = open(read->Path, O_RDONLY | O_CLOEXEC);
+        if (read->_Fd < 0 || fstat(read->_Fd, &st) != 0)
+        {
+            _AsyncReadFinish(_IO, read, NyasError_File);
+            return;
+        }
+
+        read->Size = (size_t)st.st_size;
+        read->Data = (char *)NYAS_ALLOC(read->Size + 1);
+        if (!read->Data)
+        {
+            _AsyncReadFinish(_IO, read, NyasError_Alloc);
+            return;
+        }
+
+        if (!read->Size)
+        {
+            _AsyncReadFinish(_IO, read, NyasCode_Ok);
+            return;
+        }
 
-    if (G_Ctx->IO.Keys[NyasKey_Space] == NyasKeyState_PRESSED)
-    {
-        vec3_add(eye, eye, vec3_multiply_f(tmp_vec, NyVec3::Up(), speed));
+        _IO->Queued.Push(read);
+        _UringFlush(_IO);
+        return;
     }
+#endif
 
-    if (G_Ctx->IO.Keys[NyasKey_LeftShift] == NyasKeyState_PRESSED)
+    if (_IO->Readers)
     {
-        vec3_add(eye, eye, vec3_multiply_f(tmp_vec, NyVec3::Up(), -speed));
+        _IO->Readers->Do({ _AsyncReadJob, read });
     }
-
-    mat4_look_at(View, eye, vec3_add(tmp_vec, eye, fwd), NyVec3::Up());
-
-    // Zoom
-    if (G_Ctx->IO.MouseScroll.Y != 0.0f)
+    else
     {
-        Fov -= G_Ctx->IO.MouseScroll.Y * G_Ctx->Cfg.Navigation.ScrollSensibility;
-        Fov = clampf(Fov, 1.0f, 120.0f);
-        mat4_perspective(Proj, to_radians(Fov),
-            (float)G_Ctx->Platform.WindowSize.X / (float)G_Ctx->Platform.WindowSize.Y, 0.1f, Far);
+        _AsyncReadJob(read);
     }
 }
 
-static void *_Worker(void *data)
+int NyAsyncIO::Poll()
 {
-    _NyScheduler *s = (_NyScheduler *)data;
-    while (1)
+#if defined(NYAS_IO_URING)
+    if (_IO->UseRing)
     {
-        ++s->Waiting;
-        pthread_mutex_lock(&s->Mtx);
-        while (!(s->Queue.Size))
+        _NyUring *r = &_IO->Ring;
+        unsigned head = *r->CqHead;
+        while (head != __atomic_load_n(r->CqTail, __ATOMIC_ACQUIRE))
         {
-            pthread_cond_wait(&s->Cond, &s->Mtx);
-            if (s->State == NyasSchedState_Closing)
+            io_uring_cqe *cqe = &r->Cqes[head & *r->CqMask];
+            Read *read = (Read *)(uintptr_t)cqe->user_data;
+            if (cqe->res <= 0)
             {
-                --s->Waiting;
-                pthread_mutex_unlock(&s->Mtx);
-                goto exit_worker;
+                _AsyncReadFinish(_IO, read, NyasError_File); // Error or truncated file.
+            }
+            else if ((read->_Offset += cqe->res) < read->Size)
+            {
+                _IO->Queued.Push(read); // Short read, queue the rest.
+            }
+            else
+            {
+                _AsyncReadFinish(_IO, read, NyasCode_Ok);
             }
+            ++head;
         }
-
-        --s->Waiting;
-        NySched::Job job = s->Queue.Back();
-        s->Queue.Pop();
-        pthread_mutex_unlock(&s->Mtx);
-        (*(job.Func))(job.Args);
+        __atomic_store_n(r->CqHead, head, __ATOMIC_RELEASE);
+        _UringFlush(_IO);
     }
+#endif
 
-exit_worker:
-    return NULL;
-}
-
-NySched::NySched(int thread_count)
-{
-    _Sched = (_NyScheduler *)NYAS_ALLOC(sizeof(_NyScheduler));
-    *_Sched = _NyScheduler();
-
-    pthread_mutex_init(&_Sched->Mtx, NULL);
-    pthread_cond_init(&_Sched->Cond, NULL);
-
-    for (int i = 0; i < thread_count; ++i)
+    pthread_mutex_lock(&_IO->Mtx);
+    while (_IO->Completed.Size)
     {
-        pthread_t thread;
-        if (pthread_create(&thread, NULL, _Worker, _Sched))
+        Read *read = _IO->Completed.Back();
+        _IO->Completed.Pop();
+        --_IO->InFlight;
+        pthread_mutex_unlock(&_IO->Mtx);
+        if (read->Done)
         {
-            NYAS_LOG_ERR("Thread creation error.");
-            return;
+            read->Done(read);
         }
-        _Sched->Threads.Push(thread);
+        pthread_mutex_lock(&_IO->Mtx);
     }
+    pthread_mutex_unlock(&_IO->Mtx);
 
-    _Sched->State = NyasSchedState_Running;
+    return _IO->InFlight;
 }
 
-NySched::~NySched()
+void NyAsyncIO::Wait()
 {
-    pthread_mutex_lock(&_Sched->Mtx);
-    _Sched->State = NyasSchedState_Closing;
-    pthread_cond_broadcast(&_Sched->Cond);
-    pthread_mutex_unlock(&_Sched->Mtx);
-    for (int i = 0; i < _Sched->Threads.Size; ++i)
+    while (Poll())
     {
-        pthread_join(_Sched->Threads[i], NULL);
+#if defined(NYAS_IO_URING)
+        // Queued reads only remain while the ring is full, so there is something to wait for.
+        if (_IO->UseRing && _UringFlush(_IO))
+        {
+            _UringEnter(&_IO->Ring, 1);
+            continue;
+        }
+#endif
+        const timespec sleep_time({ 0, 1000000L });
+        nanosleep(&sleep_time, NULL);
     }
-
-    pthread_mutex_lock(&_Sched->Mtx);
-    pthread_mutex_unlock(&_Sched->Mtx);
-    pthread_mutex_destroy(&_Sched->Mtx);
-    pthread_cond_destroy(&_Sched->Cond);
-
-    _Sched->~_NyScheduler();
-    NYAS_FREE(_Sched);
 }
 
-void NySched::Do(Job job)
+static void _TexLoader(void *arg)
 {
-    if (!_Sched->Threads.Size)
+    NyAssetLoader::TexArgs *a = (NyAssetLoader::TexArgs *)arg;
+    for (int i = 0; i < a->Descriptor.Count; ++i)
     {
-        (*(job.Func))(job.Args);
-        return;
+        Nyas::LoadTexture(a->Tex, &a->Descriptor, a->Path[i], i);
     }
-    pthread_mutex_lock(&_Sched->Mtx);
-    _Sched->Queue.Push(job);
-    pthread_cond_signal(&_Sched->Cond);
-    pthread_mutex_unlock(&_Sched->Mtx);
 }
 
-void NySched::Wait()
+// Texture files go through NyAsyncIO, decoding starts once all of a texture's images are read.
+struct _NyTexLoad
 {
-    if (!_Sched->Threads.Size)
-    {
-        return;
-    }
+    NyAssetLoader::TexArgs *Args;
+    NySched *Sched;
+    NyAsyncIO::Read Reads[9];
+    int Pending;
+};
 
-    while (_Sched->Queue.Size || _Sched->Waiting != _Sched->Threads.Size)
+static void _TexDecoder(void *arg)
+{
+    _NyTexLoad *l = (_NyTexLoad *)arg;
+    for (int i = 0; i < l->Args->Descriptor.Count; ++i)
     {
-        pthread_cond_broadcast(&_Sched->Cond);
-        const timespec sleep_time({ 0, 50000000L });
-        nanosleep(&sleep_time, NULL);
+        NyAsyncIO::Read *r = &l->Reads[i];
+        Nyas::LoadTexture(l->Args->Tex, &l->Args->Descriptor, r->Data, r->Size, i);
+        NYAS_FREE(r->Data);
+        r->Data = NULL;
     }
 }
 
-static void _TexLoader(void *arg)
+static void _TexReadDone(NyAsyncIO::Read *read)
 {
-    NyAssetLoader::TexArgs *a = (NyAssetLoader::TexArgs *)arg;
-    for (int i = 0; i < a->Descriptor.Count; ++i)
+    _NyTexLoad *l = (_NyTexLoad *)read->User;
+    if (!--l->Pending)
     {
-        Nyas::LoadTexture(a->Tex, &a->Descriptor, a->Path[i], i);
+        l->Sched->Do({ _TexDecoder, l });
     }
 }
 
@@ -1262,13 +5252,6 @@ static void _MeshLoader(void *arg)
                                         // avoid concurrent writes in mesh_pool
 }
 
-static void _ShaderLoader(void *arg)
-{
-    NyAssetLoader::ShaderArgs *a = (NyAssetLoader::ShaderArgs *)arg;
-    *a->Shader = Nyas::CreateShader(&a->Descriptor);
-    // TODO: Shaders compilation and program linking.
-}
-
 static void _EnvLoader(void *args)
 {
     NyAssetLoader::EnvArgs *ea = (NyAssetLoader::EnvArgs *)args;
@@ -1282,12 +5265,12 @@ void NyAssetLoader::AddMesh(MeshArgs *args)
 
 void NyAssetLoader::AddTex(TexArgs *args)
 {
-    Async.Push({ _TexLoader, args });
+    Textures.Push(args);
 }
 
 void NyAssetLoader::AddShader(ShaderArgs *args)
 {
-    Sequential.Push({ _ShaderLoader, args });
+    Shaders.Push(args);
 }
 
 void NyAssetLoader::AddEnv(EnvArgs *args)
@@ -1315,12 +5298,53 @@ void NyAssetLoader::Load(int threads)
         load_sched.Do(Async[i]);
     }
 
+    NyAsyncIO io;
+    _NyTexLoad *tex_loads = (_NyTexLoad *)NYAS_ALLOC(Textures.Size * sizeof(_NyTexLoad));
+    for (int i = 0; i < Textures.Size; ++i)
+    {
+        TexArgs *args = Textures[i];
+        if (Nyas::_TexFaces(args->Descriptor.Type) != 1)
+        {
+            load_sched.Do({ _TexLoader, args }); // Face paths are resolved by LoadTexture.
+            continue;
+        }
+
+        _NyTexLoad *l = &tex_loads[i];
+        *l = _NyTexLoad();
+        l->Args = args;
+        l->Sched = &load_sched;
+        l->Pending = args->Descriptor.Count;
+        for (int j = 0; j < args->Descriptor.Count; ++j)
+        {
+            l->Reads[j].Path = args->Path[j];
+            l->Reads[j].Done = _TexReadDone;
+            l->Reads[j].User = l;
+            io.Submit(&l->Reads[j]);
+        }
+    }
+
     for (int i = 0; i < Sequential.Size; ++i)
     {
         (*Sequential[i].Func)(Sequential[i].Args);
+        io.Poll();
+    }
+
+    if (Shaders.Size)
+    {
+        NyasHandle *handles = (NyasHandle *)NYAS_ALLOC(Shaders.Size * sizeof(NyasHandle));
+        for (int i = 0; i < Shaders.Size; ++i)
+        {
+            handles[i] = *Shaders[i]->Shader = Nyas::CreateShader(&Shaders[i]->Descriptor);
+        }
+        Nyas::CompileShaders(handles, Shaders.Size);
+        NYAS_FREE(handles);
     }
 
-    load_sched.Wait(); // TODO(Check): sched_destroy waits?
+    // Read completions queue the decode jobs, so the reads finish first and then the jobs. After
+    // both waits nothing references the loads.
+    io.Wait();
+    load_sched.Wait();
+    NYAS_FREE(tex_loads);
 }
 
 static void _MeshSetCube(NyasMesh *mesh)
@@ -1588,7 +5612,7 @@ static void _MeshSetSphere(NyasMesh *mesh, int x_segments, int y_segments)
 
     mesh->Attribs = NyasVtxAttribFlags_Position | NyasVtxAttribFlags_Normal | NyasVtxAttribFlags_UV;
     mesh->VtxSize = y_segments * x_segments * 8 * sizeof(float);
-    mesh->ElementCount = y_segments * x_segments * 6;
+    mesh->ElementCount = (y_segments - 1) * (x_segments - 1) * 6;
     mesh->Vtx = (float *)NYAS_ALLOC(mesh->VtxSize);
     mesh->Indices = (NyDrawIdx *)NYAS_ALLOC(mesh->ElementCount * sizeof(NyDrawIdx));
 
@@ -1612,10 +5636,11 @@ static void _MeshSetSphere(NyasMesh *mesh, int x_segments, int y_segments)
         }
     }
 
+    // The last row and column only close the quads, the seam and the poles repeat vertices.
     NyDrawIdx *i = mesh->Indices;
-    for (int y = 0; y < x_segments; ++y)
+    for (int y = 0; y < x_segments - 1; ++y)
     {
-        for (int x = 0; x < y_segments; ++x)
+        for (int x = 0; x < y_segments - 1; ++x)
         {
             *i++ = y * y_segments + x;
             *i++ = y * y_segments + x + 1;
@@ -1669,29 +5694,491 @@ static void _MeshSetQuad(NyasMesh *mesh)
     NYAS_FREE(mesh->Vtx);
     NYAS_FREE(mesh->Indices);
 
-    mesh->Attribs = NyasVtxAttribFlags_Position | NyasVtxAttribFlags_Normal | NyasVtxAttribFlags_UV;
-    mesh->Vtx = (float *)NYAS_ALLOC(sizeof(VERTICES));
-    memcpy(mesh->Vtx, VERTICES, sizeof(VERTICES));
-    mesh->Indices = (NyDrawIdx *)NYAS_ALLOC(sizeof(INDICES));
-    memcpy(mesh->Indices, INDICES, sizeof(INDICES));
-    mesh->VtxSize = sizeof(VERTICES);
-    mesh->ElementCount = sizeof(INDICES) / sizeof(*INDICES);
+    mesh->Attribs = NyasVtxAttribFlags_Position | NyasVtxAttribFlags_Normal | NyasVtxAttribFlags_UV;
+    mesh->Vtx = (float *)NYAS_ALLOC(sizeof(VERTICES));
+    memcpy(mesh->Vtx, VERTICES, sizeof(VERTICES));
+    mesh->Indices = (NyDrawIdx *)NYAS_ALLOC(sizeof(INDICES));
+    memcpy(mesh->Indices, INDICES, sizeof(INDICES));
+    mesh->VtxSize = sizeof(VERTICES);
+    mesh->ElementCount = sizeof(INDICES) / sizeof(*INDICES);
+}
+
+namespace NyUtil
+{
+static void _MeshSetGeometry(NyasHandle msh, NyasGeometry geo)
+{
+    NyasMesh *m = &Nyas::Meshes[msh];
+
+    switch (geo)
+    {
+        case NyasGeometry_Quad: _MeshSetQuad(m); break;
+        case NyasGeometry_Cube: _MeshSetCube(m); break;
+        case NyasGeometry_Sphere: _MeshSetSphere(m, 32, 32); break;
+        default: break;
+    }
+    Nyas::_MeshBounds(m);
+    Nyas::_MeshGenerateLods(m);
+    m->Resource.Flags |= NyasResourceFlags_Dirty;
+}
+
+// Round to nearest even, same as the hardware conversions. NaN maps to quiet NaN.
+static inline uint16_t _FloatToHalf(float value)
+{
+    const uint32_t f32_inf = 255 << 23;
+    const uint32_t f16_max = (127 + 16) << 23;
+    const uint32_t denorm_magic_bits = ((127 - 15) + (23 - 10) + 1) << 23;
+    float denorm_magic;
+    memcpy(&denorm_magic, &denorm_magic_bits, sizeof(float));
+
+    uint32_t f;
+    memcpy(&f, &value, sizeof(float));
+    uint32_t sign = f & 0x80000000u;
+    f ^= sign;
+
+    uint16_t h;
+    if (f >= f16_max)
+    {
+        h = (f > f32_inf) ? 0x7E00 : 0x7C00; // Out of range to Inf, NaN to quiet NaN.
+    }
+    else if (f < (113 << 23))
+    {
+        // Subnormal or zero: align the mantissa with a float add (rounds to nearest even).
+        float tmp;
+        memcpy(&tmp, &f, sizeof(float));
+        tmp += denorm_magic;
+        memcpy(&f, &tmp, sizeof(float));
+        h = (uint16_t)(f - denorm_magic_bits);
+    }
+    else
+    {
+        uint32_t mant_odd = (f >> 13) & 1;
+        f += ((uint32_t)(15 - 127) << 23) + 0xFFF;
+        f += mant_odd;
+        h = (uint16_t)(f >> 13);
+    }
+    return h | (uint16_t)(sign >> 16);
+}
+
+#if defined(NYAS_X86)
+__attribute__((target("f16c"))) static void
+_FloatToHalfF16C(uint16_t *dst, const float *src, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 f = _mm256_loadu_ps(src + i);
+        __m128i h = _mm256_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm_storeu_si128((__m128i *)(dst + i), h);
+    }
+    for (; i < count; ++i)
+    {
+        dst[i] = _FloatToHalf(src[i]);
+    }
+}
+#endif
+
+void FloatToHalf(uint16_t *dst, const float *src, size_t count)
+{
+#if defined(NYAS_X86)
+    static const bool f16c = __builtin_cpu_supports("f16c") && __builtin_cpu_supports("avx");
+    if (f16c)
+    {
+        _FloatToHalfF16C(dst, src, count);
+        return;
+    }
+    size_t i = 0;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        float16x4_t h = vcvt_f16_f32(vld1q_f32(src + i));
+        vst1_u16(dst + i, vreinterpret_u16_f16(h));
+    }
+#else
+    size_t i = 0;
+#endif
+    for (; i < count; ++i)
+    {
+        dst[i] = _FloatToHalf(src[i]);
+    }
+}
+
+// Appends the indices of the set bits of a lane mask.
+static inline int _PushVisible(int *visible, int n, int base, int mask)
+{
+    while (mask)
+    {
+        visible[n++] = base + __builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+    return n;
+}
+
+static int _CullSpheresScalar(const float planes[6][4], const float *x, const float *y,
+    const float *z, const float *r, int begin, int count, int *visible, int n)
+{
+    for (int i = begin; i < count; ++i)
+    {
+        bool inside = true;
+        for (int p = 0; p < 6 && inside; ++p)
+        {
+            const float *pl = planes[p];
+            inside = pl[0] * x[i] + pl[1] * y[i] + pl[2] * z[i] + pl[3] + r[i] >= 0.0f;
+        }
+        if (inside)
+        {
+            visible[n++] = i;
+        }
+    }
+    return n;
+}
+
+#if defined(NYAS_X86)
+__attribute__((target("avx"))) static int _CullSpheresAVX(const float planes[6][4],
+    const float *x, const float *y, const float *z, const float *r, int count, int *visible)
+{
+    int n = 0;
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 px = _mm256_loadu_ps(x + i);
+        __m256 py = _mm256_loadu_ps(y + i);
+        __m256 pz = _mm256_loadu_ps(z + i);
+        __m256 pr = _mm256_loadu_ps(r + i);
+        int mask = 0xFF;
+        for (int p = 0; p < 6 && mask; ++p)
+        {
+            __m256 d = _mm256_add_ps(_mm256_mul_ps(px, _mm256_set1_ps(planes[p][0])),
+                _mm256_mul_ps(py, _mm256_set1_ps(planes[p][1])));
+            d = _mm256_add_ps(d, _mm256_mul_ps(pz, _mm256_set1_ps(planes[p][2])));
+            d = _mm256_add_ps(d, _mm256_add_ps(pr, _mm256_set1_ps(planes[p][3])));
+            mask &= _mm256_movemask_ps(_mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_GE_OQ));
+        }
+        n = _PushVisible(visible, n, i, mask);
+    }
+    return _CullSpheresScalar(planes, x, y, z, r, i, count, visible, n);
+}
+
+static int _CullSpheresSSE(const float planes[6][4], const float *x, const float *y,
+    const float *z, const float *r, int count, int *visible)
+{
+    int n = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 px = _mm_loadu_ps(x + i);
+        __m128 py = _mm_loadu_ps(y + i);
+        __m128 pz = _mm_loadu_ps(z + i);
+        __m128 pr = _mm_loadu_ps(r + i);
+        int mask = 0xF;
+        for (int p = 0; p < 6 && mask; ++p)
+        {
+            __m128 d = _mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(planes[p][0])),
+                _mm_mul_ps(py, _mm_set1_ps(planes[p][1])));
+            d = _mm_add_ps(d, _mm_mul_ps(pz, _mm_set1_ps(planes[p][2])));
+            d = _mm_add_ps(d, _mm_add_ps(pr, _mm_set1_ps(planes[p][3])));
+            mask &= _mm_movemask_ps(_mm_cmpge_ps(d, _mm_setzero_ps()));
+        }
+        n = _PushVisible(visible, n, i, mask);
+    }
+    return _CullSpheresScalar(planes, x, y, z, r, i, count, visible, n);
+}
+#endif
+
+int CullSpheres(const float planes[6][4], const float *x, const float *y, const float *z,
+    const float *r, int count, int *visible)
+{
+#if defined(NYAS_X86)
+    static const bool avx = __builtin_cpu_supports("avx");
+    if (avx)
+    {
+        return _CullSpheresAVX(planes, x, y, z, r, count, visible);
+    }
+    return _CullSpheresSSE(planes, x, y, z, r, count, visible);
+#else
+    return _CullSpheresScalar(planes, x, y, z, r, 0, count, visible, 0);
+#endif
+}
+
+#if defined(NYAS_X86)
+static inline void _Mat4MulSSE(float *out, __m128 a0, __m128 a1, __m128 a2, __m128 a3,
+    const float *b)
+{
+    __m128 r[4];
+    for (int c = 0; c < 4; ++c)
+    {
+        __m128 col = _mm_loadu_ps(b + c * 4);
+        r[c] = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(a0, _mm_shuffle_ps(col, col, 0x00)),
+                _mm_mul_ps(a1, _mm_shuffle_ps(col, col, 0x55))),
+            _mm_add_ps(_mm_mul_ps(a2, _mm_shuffle_ps(col, col, 0xAA)),
+                _mm_mul_ps(a3, _mm_shuffle_ps(col, col, 0xFF))));
+    }
+
+    for (int c = 0; c < 4; ++c)
+    {
+        _mm_storeu_ps(out + c * 4, r[c]);
+    }
+}
+
+// Two columns per register, both lanes hold the same column of a.
+__attribute__((target("avx"))) static void _Mat4MulBatchAVX(float *out, const float *a,
+    const float *b, int count)
+{
+    __m256 a0 = _mm256_broadcast_ps((const __m128 *)a);
+    __m256 a1 = _mm256_broadcast_ps((const __m128 *)(a + 4));
+    __m256 a2 = _mm256_broadcast_ps((const __m128 *)(a + 8));
+    __m256 a3 = _mm256_broadcast_ps((const __m128 *)(a + 12));
+    for (int i = 0; i < count; ++i, b += 16, out += 16)
+    {
+        __m256 b01 = _mm256_loadu_ps(b);
+        __m256 b23 = _mm256_loadu_ps(b + 8);
+        __m256 r01 = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(a0, _mm256_shuffle_ps(b01, b01, 0x00)),
+                _mm256_mul_ps(a1, _mm256_shuffle_ps(b01, b01, 0x55))),
+            _mm256_add_ps(_mm256_mul_ps(a2, _mm256_shuffle_ps(b01, b01, 0xAA)),
+                _mm256_mul_ps(a3, _mm256_shuffle_ps(b01, b01, 0xFF))));
+        __m256 r23 = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(a0, _mm256_shuffle_ps(b23, b23, 0x00)),
+                _mm256_mul_ps(a1, _mm256_shuffle_ps(b23, b23, 0x55))),
+            _mm256_add_ps(_mm256_mul_ps(a2, _mm256_shuffle_ps(b23, b23, 0xAA)),
+                _mm256_mul_ps(a3, _mm256_shuffle_ps(b23, b23, 0xFF))));
+        _mm256_storeu_ps(out, r01);
+        _mm256_storeu_ps(out + 8, r23);
+    }
+}
+
+// Products of 2x2 blocks stored as (m00, m01, m10, m11): A * B, adj(A) * B and A * adj(B).
+static inline __m128 _Mat2Mul(__m128 a, __m128 b)
+{
+    return _mm_add_ps(_mm_mul_ps(a, _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 3, 0))),
+        _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)),
+            _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 2, 1, 2))));
+}
+
+static inline __m128 _Mat2AdjMul(__m128 a, __m128 b)
+{
+    return _mm_sub_ps(_mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 0, 3, 3)), b),
+        _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 1, 1)),
+            _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 0, 3, 2))));
+}
+
+static inline __m128 _Mat2MulAdj(__m128 a, __m128 b)
+{
+    return _mm_sub_ps(_mm_mul_ps(a, _mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 3, 0, 3))),
+        _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)),
+            _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 2, 1, 2))));
+}
+
+// Block inverse of [A B; C D] with 2x2 blocks. Works on the transpose as well, so columns are
+// read as rows and the result comes out column major.
+static bool _Mat4InverseSSE(float *out, const float *m)
+{
+    __m128 r0 = _mm_loadu_ps(m);
+    __m128 r1 = _mm_loadu_ps(m + 4);
+    __m128 r2 = _mm_loadu_ps(m + 8);
+    __m128 r3 = _mm_loadu_ps(m + 12);
+    __m128 a = _mm_movelh_ps(r0, r1);
+    __m128 b = _mm_movehl_ps(r1, r0);
+    __m128 c = _mm_movelh_ps(r2, r3);
+    __m128 d = _mm_movehl_ps(r3, r2);
+
+    // (|A|, |B|, |C|, |D|)
+    __m128 det_sub = _mm_sub_ps(
+        _mm_mul_ps(_mm_shuffle_ps(r0, r2, _MM_SHUFFLE(2, 0, 2, 0)),
+            _mm_shuffle_ps(r1, r3, _MM_SHUFFLE(3, 1, 3, 1))),
+        _mm_mul_ps(_mm_shuffle_ps(r0, r2, _MM_SHUFFLE(3, 1, 3, 1)),
+            _mm_shuffle_ps(r1, r3, _MM_SHUFFLE(2, 0, 2, 0))));
+    __m128 det_a = _mm_shuffle_ps(det_sub, det_sub, 0x00);
+    __m128 det_b = _mm_shuffle_ps(det_sub, det_sub, 0x55);
+    __m128 det_c = _mm_shuffle_ps(det_sub, det_sub, 0xAA);
+    __m128 det_d = _mm_shuffle_ps(det_sub, det_sub, 0xFF);
+
+    __m128 d_c = _Mat2AdjMul(d, c);
+    __m128 a_b = _Mat2AdjMul(a, b);
+    __m128 x = _mm_sub_ps(_mm_mul_ps(det_d, a), _Mat2Mul(b, d_c));
+    __m128 w = _mm_sub_ps(_mm_mul_ps(det_a, d), _Mat2Mul(c, a_b));
+    __m128 y = _mm_sub_ps(_mm_mul_ps(det_b, c), _Mat2MulAdj(d, a_b));
+    __m128 z = _mm_sub_ps(_mm_mul_ps(det_c, b), _Mat2MulAdj(a, d_c));
+
+    // |M| = |A||D| + |B||C| - tr(adj(A) B adj(D) C)
+    __m128 tr = _mm_mul_ps(a_b, _mm_shuffle_ps(d_c, d_c, _MM_SHUFFLE(3, 1, 2, 0)));
+    tr = _mm_add_ps(tr, _mm_shuffle_ps(tr, tr, _MM_SHUFFLE(2, 3, 0, 1)));
+    tr = _mm_add_ps(tr, _mm_shuffle_ps(tr, tr, _MM_SHUFFLE(1, 0, 3, 2)));
+    __m128 det = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(det_a, det_d), _mm_mul_ps(det_b, det_c)), tr);
+    if (_mm_cvtss_f32(det) == 0.0f)
+    {
+        return false;
+    }
+
+    __m128 rdet = _mm_div_ps(_mm_setr_ps(1.0f, -1.0f, -1.0f, 1.0f), det);
+    x = _mm_mul_ps(x, rdet);
+    y = _mm_mul_ps(y, rdet);
+    z = _mm_mul_ps(z, rdet);
+    w = _mm_mul_ps(w, rdet);
+    _mm_storeu_ps(out, _mm_shuffle_ps(x, y, _MM_SHUFFLE(1, 3, 1, 3)));
+    _mm_storeu_ps(out + 4, _mm_shuffle_ps(x, y, _MM_SHUFFLE(0, 2, 0, 2)));
+    _mm_storeu_ps(out + 8, _mm_shuffle_ps(z, w, _MM_SHUFFLE(1, 3, 1, 3)));
+    _mm_storeu_ps(out + 12, _mm_shuffle_ps(z, w, _MM_SHUFFLE(0, 2, 0, 2)));
+    return true;
+}
+#endif
+
+void Mat4Mul(float *out, const float *a, const float *b)
+{
+#if defined(NYAS_X86)
+    _Mat4MulSSE(out, _mm_loadu_ps(a), _mm_loadu_ps(a + 4), _mm_loadu_ps(a + 8),
+        _mm_loadu_ps(a + 12), b);
+#else
+    float r[16];
+    for (int c = 0; c < 4; ++c)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            r[c * 4 + i] = a[i] * b[c * 4] + a[4 + i] * b[c * 4 + 1] + a[8 + i] * b[c * 4 + 2] +
+                a[12 + i] * b[c * 4 + 3];
+        }
+    }
+    memcpy(out, r, sizeof(r));
+#endif
+}
+
+void Mat4MulBatch(float *out, const float *a, const float *b, int count)
+{
+#if defined(NYAS_X86)
+    static const bool avx = __builtin_cpu_supports("avx");
+    if (avx)
+    {
+        float a_copy[16]; // out[0] may alias a.
+        memcpy(a_copy, a, sizeof(a_copy));
+        _Mat4MulBatchAVX(out, a_copy, b, count);
+        return;
+    }
+
+    __m128 a0 = _mm_loadu_ps(a);
+    __m128 a1 = _mm_loadu_ps(a + 4);
+    __m128 a2 = _mm_loadu_ps(a + 8);
+    __m128 a3 = _mm_loadu_ps(a + 12);
+    for (int i = 0; i < count; ++i)
+    {
+        _Mat4MulSSE(out + i * 16, a0, a1, a2, a3, b + i * 16);
+    }
+#else
+    float a_copy[16];
+    memcpy(a_copy, a, sizeof(a_copy));
+    for (int i = 0; i < count; ++i)
+    {
+        Mat4Mul(out + i * 16, a_copy, b + i * 16);
+    }
+#endif
+}
+
+bool Mat4Inverse(float *out, const float *m)
+{
+#if defined(NYAS_X86)
+    return _Mat4InverseSSE(out, m);
+#else
+    float inv[16];
+    mat4_inverse(inv, (float *)m);
+    for (int i = 0; i < 16; ++i)
+    {
+        if (!isfinite(inv[i]))
+        {
+            return false;
+        }
+    }
+    memcpy(out, inv, sizeof(inv));
+    return true;
+#endif
 }
 
-namespace NyUtil
+void TransformPoints(float *out, const float *m, const float *p, int count)
 {
-static void _MeshSetGeometry(NyasHandle msh, NyasGeometry geo)
+#if defined(NYAS_X86)
+    __m128 c0 = _mm_loadu_ps(m);
+    __m128 c1 = _mm_loadu_ps(m + 4);
+    __m128 c2 = _mm_loadu_ps(m + 8);
+    __m128 c3 = _mm_loadu_ps(m + 12);
+    for (int i = 0; i < count; ++i, p += 3, out += 3)
+    {
+        __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(p[0])),
+                                  _mm_mul_ps(c1, _mm_set1_ps(p[1]))),
+            _mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(p[2])), c3));
+        float v[4];
+        _mm_storeu_ps(v, r);
+        out[0] = v[0];
+        out[1] = v[1];
+        out[2] = v[2];
+    }
+#else
+    for (int i = 0; i < count; ++i, p += 3, out += 3)
+    {
+        float x = p[0], y = p[1], z = p[2];
+        out[0] = m[0] * x + m[4] * y + m[8] * z + m[12];
+        out[1] = m[1] * x + m[5] * y + m[9] * z + m[13];
+        out[2] = m[2] * x + m[6] * y + m[10] * z + m[14];
+    }
+#endif
+}
+
+void RadixSort(uint64_t *keys, uint32_t *order, int count)
 {
-    NyasMesh *m = &Nyas::Meshes[msh];
+    if (count <= 0)
+    {
+        return;
+    }
 
-    switch (geo)
+    uint32_t hist[8][256];
+    memset(hist, 0, sizeof(hist));
+    for (int i = 0; i < count; ++i)
     {
-        case NyasGeometry_Quad: _MeshSetQuad(m); break;
-        case NyasGeometry_Cube: _MeshSetCube(m); break;
-        case NyasGeometry_Sphere: _MeshSetSphere(m, 32, 32); break;
-        default: break;
+        order[i] = i;
+        for (int b = 0; b < 8; ++b)
+        {
+            ++hist[b][(keys[i] >> (b * 8)) & 0xFF];
+        }
+    }
+
+    uint64_t *tmp_keys = (uint64_t *)NyFrameAllocator::Alloc(count * sizeof(uint64_t));
+    uint32_t *tmp_order = (uint32_t *)NyFrameAllocator::Alloc(count * sizeof(uint32_t));
+    uint64_t *src_k = keys, *dst_k = tmp_keys;
+    uint32_t *src_o = order, *dst_o = tmp_order;
+    for (int b = 0; b < 8; ++b)
+    {
+        int shift = b * 8;
+        if (hist[b][(keys[0] >> shift) & 0xFF] == (uint32_t)count)
+        {
+            continue;
+        }
+
+        uint32_t sum = 0;
+        for (int v = 0; v < 256; ++v)
+        {
+            uint32_t c = hist[b][v];
+            hist[b][v] = sum;
+            sum += c;
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            uint32_t dst = hist[b][(src_k[i] >> shift) & 0xFF]++;
+            dst_k[dst] = src_k[i];
+            dst_o[dst] = src_o[i];
+        }
+
+        uint64_t *k = src_k;
+        src_k = dst_k;
+        dst_k = k;
+        uint32_t *o = src_o;
+        src_o = dst_o;
+        dst_o = o;
+    }
+
+    if (src_k != keys)
+    {
+        memcpy(keys, src_k, count * sizeof(uint64_t));
+        memcpy(order, src_o, count * sizeof(uint32_t));
     }
-    m->Resource.Flags |= NyasResourceFlags_Dirty;
 }
 
 void LoadBasicGeometries(void)
@@ -1704,15 +6191,33 @@ void LoadBasicGeometries(void)
     _MeshSetGeometry(NYAS_QUAD, NyasGeometry_Quad);
 }
 
+// Sequential reader over a file view, zero fills past the end.
+static void _EnvRead(void *dst, size_t size, NyasFileView *file, size_t *cursor)
+{
+    size_t avail = *cursor < file->Size ? file->Size - *cursor : 0;
+    size_t count = size < avail ? size : avail;
+    memcpy(dst, file->Data + *cursor, count);
+    memset((char *)dst + count, 0, size - count);
+    *cursor += size;
+}
+
 void LoadEnv(const char *path, NyasHandle *lut, NyasHandle *sky, NyasHandle *irr, NyasHandle *pref)
 {
-    FILE *f = fopen(path, "r");
+    NyasFileView f;
+    if (Nyas::FileView(path, &f) != NyasCode_Ok)
+    {
+        NYAS_LOG_ERR("Aborting load_env of %s.", path);
+        return;
+    }
+
+    size_t cursor = 0;
     char hdr[9];
-    fread(hdr, 8, 1, f);
+    _EnvRead(hdr, 8, &f, &cursor);
     hdr[8] = '\0';
     if (strncmp("NYAS_ENV", hdr, 9) != 0)
     {
         NYAS_LOG_ERR("Header of .env file is invalid. Aborting load_env of %s.", path);
+        Nyas::ReleaseFileView(&f);
         return;
     }
 
@@ -1736,8 +6241,8 @@ void LoadEnv(const char *path, NyasHandle *lut, NyasHandle *sky, NyasHandle *irr
         NyasTexImg img;
         img.Face = i;
         img.Pix = NYAS_ALLOC(size);
-        fread(img.Pix, size, 1, f);
         NYAS_ASSERT(img.Pix && "The image couldn't be loaded");
+        _EnvRead(img.Pix, size, &f, &cursor);
         t->Img.Push(img);
     }
 
@@ -1760,8 +6265,8 @@ void LoadEnv(const char *path, NyasHandle *lut, NyasHandle *sky, NyasHandle *irr
         NyasTexImg img;
         img.Face = i;
         img.Pix = NYAS_ALLOC(size);
-        fread(img.Pix, size, 1, f);
         NYAS_ASSERT(img.Pix && "The image couldn't be loaded");
+        _EnvRead(img.Pix, size, &f, &cursor);
         t->Img.Push(img);
     }
 
@@ -1788,8 +6293,8 @@ void LoadEnv(const char *path, NyasHandle *lut, NyasHandle *sky, NyasHandle *irr
             img.MipLevel = lod;
             img.Face = face;
             img.Pix = NYAS_ALLOC(size);
-            fread(img.Pix, size, 1, f);
             NYAS_ASSERT(img.Pix && "The image couldn't be loaded");
+            _EnvRead(img.Pix, size, &f, &cursor);
             t->Img.Push(img);
         }
         size /= 4;
@@ -1813,15 +6318,215 @@ void LoadEnv(const char *path, NyasHandle *lut, NyasHandle *sky, NyasHandle *irr
 
     NyasTexImg img;
     img.Pix = NYAS_ALLOC(size);
-    fread(img.Pix, size, 1, f);
     NYAS_ASSERT(img.Pix && "The image couldn't be loaded");
+    _EnvRead(img.Pix, size, &f, &cursor);
     t->Img.Push(img);
-    fclose(f);
+    Nyas::ReleaseFileView(&f);
 }
 } // namespace NyUtil
 
 #if defined(NYAS_GL3)
 
+#define NYAS_GL_TEX_UNITS 128
+#define NYAS_GL_UNIFORM_BINDINGS 36
+
+enum _GL_Cap_
+{
+    _GL_Cap_Blend,
+    _GL_Cap_Cull,
+    _GL_Cap_DepthTest,
+    _GL_Cap_StencilTest,
+    _GL_Cap_Scissor,
+    _GL_Cap_COUNT
+};
+
+// Shadow of the GL state set by the backend, used to skip redundant calls. Raw GL calls made
+// outside the backend must be followed by _NyInvalidateState.
+static struct
+{
+    GLuint Program;
+    GLuint Vao;
+    GLuint Framebuf;
+    GLuint ActiveUnit;
+    GLuint Tex[NYAS_GL_TEX_UNITS][3]; // 2D, cubemap and 2D array bindings.
+    struct
+    {
+        GLuint Buf;
+        GLintptr Offset;
+        GLsizeiptr Size;
+    } Ubo[NYAS_GL_UNIFORM_BINDINGS];
+    GLfloat ClearColor[4];
+    NyRect Viewport;
+    NyRect Scissor;
+    GLenum BlendSrc;
+    GLenum BlendDst;
+    GLenum CullFace;
+    GLenum DepthFunc;
+    GLuint DepthMask;
+    GLuint StencilMask;
+    int Caps[_GL_Cap_COUNT]; // -1 unknown.
+    int Calls;
+    int Skipped;
+} G_GLState;
+
+// Frame counters, kept apart from the shadow state that gets invalidated.
+static struct
+{
+    int Draws;
+    int64_t UploadBytes;
+} G_GLCounters;
+
+static GLuint G_TimerQueries[NYAS_PROFILE_FRAMES][NYAS_PROFILE_SCOPES];
+
+void _NyInvalidateState(void)
+{
+    int calls = G_GLState.Calls;
+    int skipped = G_GLState.Skipped;
+    memset((void *)&G_GLState, 0xFF, sizeof(G_GLState)); // Never matches a real value.
+    G_GLState.Calls = calls;
+    G_GLState.Skipped = skipped;
+}
+
+void _NyFrameStats(NyasStats *stats)
+{
+    stats->StateCalls = G_GLState.Calls;
+    stats->SkippedStateCalls = G_GLState.Skipped;
+    stats->DrawCalls = G_GLCounters.Draws;
+    stats->UploadBytes = G_GLCounters.UploadBytes;
+    G_GLState.Calls = 0;
+    G_GLState.Skipped = 0;
+    G_GLCounters.Draws = 0;
+    G_GLCounters.UploadBytes = 0;
+}
+
+void _NyReadFramebuffer(int w, int h, uint8_t *rgb)
+{
+    _NyUseFramebuf(0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+}
+
+bool _NyTimerBegin(int frame, int idx)
+{
+    if (!GLAD_GL_VERSION_3_3)
+    {
+        return false;
+    }
+
+    if (!G_TimerQueries[0][0])
+    {
+        glGenQueries(NYAS_PROFILE_FRAMES * NYAS_PROFILE_SCOPES, &G_TimerQueries[0][0]);
+    }
+    glBeginQuery(GL_TIME_ELAPSED, G_TimerQueries[frame][idx]);
+    return true;
+}
+
+void _NyTimerEnd()
+{
+    glEndQuery(GL_TIME_ELAPSED);
+}
+
+bool _NyTimerResult(int frame, int idx, float *ms)
+{
+    GLint done = 0;
+    glGetQueryObjectiv(G_TimerQueries[frame][idx], GL_QUERY_RESULT_AVAILABLE, &done);
+    if (!done)
+    {
+        return false;
+    }
+
+    GLuint64 ns = 0;
+    glGetQueryObjectui64v(G_TimerQueries[frame][idx], GL_QUERY_RESULT, &ns);
+    *ms = (float)NyChrono::MilliSeconds((double)ns);
+    return true;
+}
+
+// Counts the call as issued or skipped, true if it has to be issued.
+static inline bool _GL_StateChanged(bool changed)
+{
+    ++(changed ? G_GLState.Calls : G_GLState.Skipped);
+    return changed;
+}
+
+static void _GL_SetCap(int cap, bool enable)
+{
+    static const GLenum caps[_GL_Cap_COUNT] = { GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST,
+        GL_STENCIL_TEST, GL_SCISSOR_TEST };
+    if (_GL_StateChanged(G_GLState.Caps[cap] != (int)enable))
+    {
+        enable ? glEnable(caps[cap]) : glDisable(caps[cap]);
+        G_GLState.Caps[cap] = enable;
+    }
+}
+
+static int _GL_TexSlot(GLenum target)
+{
+    switch (target)
+    {
+        case GL_TEXTURE_CUBE_MAP: return 1;
+        case GL_TEXTURE_2D_ARRAY: return 2;
+        default: return 0;
+    }
+}
+
+static void _GL_ActiveUnit(GLuint unit)
+{
+    if (_GL_StateChanged(G_GLState.ActiveUnit != unit))
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        G_GLState.ActiveUnit = unit;
+    }
+}
+
+// Binds for sampling, the active unit is only changed if the binding does.
+static void _GL_BindTex(GLuint unit, GLenum target, GLuint id)
+{
+    NYAS_ASSERT(unit < NYAS_GL_TEX_UNITS);
+    GLuint *bound = &G_GLState.Tex[unit][_GL_TexSlot(target)];
+    if (_GL_StateChanged(*bound != id))
+    {
+        _GL_ActiveUnit(unit);
+        glBindTexture(target, id);
+        *bound = id;
+    }
+}
+
+// Binds to unit 0 for texture object edits.
+static void _GL_EditTex(GLenum target, GLuint id)
+{
+    _GL_ActiveUnit(0);
+    _GL_BindTex(0, target, id);
+}
+
+static void _GL_ForgetTex(GLuint id)
+{
+    for (int i = 0; i < NYAS_GL_TEX_UNITS; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            G_GLState.Tex[i][j] = G_GLState.Tex[i][j] == id ? 0 : G_GLState.Tex[i][j];
+        }
+    }
+}
+
+static void _GL_BindVao(GLuint id)
+{
+    if (_GL_StateChanged(G_GLState.Vao != id))
+    {
+        glBindVertexArray(id);
+        G_GLState.Vao = id;
+    }
+}
+
+static void _GL_BindFramebuf(GLuint id)
+{
+    if (_GL_StateChanged(G_GLState.Framebuf != id))
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, id);
+        G_GLState.Framebuf = id;
+    }
+}
+
 static const GLint attrib_sizes[NyasVtxAttrib_COUNT] = { 3, 3, 3, 3, 2, 4 };
 static const char *attrib_names[NyasVtxAttrib_COUNT] = { "a_position", "a_normal", "a_tangent",
     "a_bitangent", "a_uv", "a_color" };
@@ -1912,7 +6617,10 @@ static struct _GL_TexFmtResult _GL_TexFmt(NyasTexFmt fmt)
         case NyasTexFmt_RG_16F: return { GL_RG16F, GL_RG, GL_HALF_FLOAT };
         case NyasTexFmt_RGB_16F: return { GL_RGB16F, GL_RGB, GL_HALF_FLOAT };
         case NyasTexFmt_RGBA_16F: return { GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT };
+        case NyasTexFmt_R_32F: return { GL_R32F, GL_RED, GL_FLOAT };
+        case NyasTexFmt_RG_32F: return { GL_RG32F, GL_RG, GL_FLOAT };
         case NyasTexFmt_RGB_32F: return { GL_RGB32F, GL_RGB, GL_FLOAT };
+        case NyasTexFmt_RGBA_32F: return { GL_RGBA32F, GL_RGBA, GL_FLOAT };
         case NyasTexFmt_Depth: return { GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_FLOAT };
         default: NYAS_LOG_ERR("Unrecognized texture format: (%d).", fmt); return { 0, 0, 0 };
     }
@@ -1923,8 +6631,7 @@ void _NyCreateTex(NyasTexture *t)
     NyGL_TexDesc d = _GL_TexDesc(&t->Data);
     _GL_TexFmtResult fmt = _GL_TexFmt(t->Data.Format);
     glGenTextures(1, &t->Resource.Id);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(d.target, t->Resource.Id);
+    _GL_EditTex(d.target, t->Resource.Id);
     if (d.min_f)
     {
         glTexParameteri(d.target, GL_TEXTURE_MIN_FILTER, d.min_f);
@@ -1960,8 +6667,7 @@ void _NySetTex(struct NyasTexture *t)
 {
     GLenum type = _GL_TexTarget(t->Data.Type);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(type, t->Resource.Id);
+    _GL_EditTex(type, t->Resource.Id);
     struct _GL_TexFmtResult fmt = _GL_TexFmt(t->Data.Format);
 
     if (type == GL_TEXTURE_2D_ARRAY)
@@ -1993,8 +6699,40 @@ void _NySetTex(struct NyasTexture *t)
     }
 }
 
+void _NyAllocTex(NyasTexture *t)
+{
+    GLenum type = _GL_TexTarget(t->Data.Type);
+    if (type == GL_TEXTURE_2D_ARRAY)
+    {
+        return; // Storage for every layer is allocated on creation.
+    }
+
+    _GL_EditTex(type, t->Resource.Id);
+    struct _GL_TexFmtResult fmt = _GL_TexFmt(t->Data.Format);
+    for (int i = 0; i < t->Img.Size; ++i)
+    {
+        GLint target = (t->Data.Type == NyasTexType_2D) ?
+                        GL_TEXTURE_2D :
+                        GL_TEXTURE_CUBE_MAP_POSITIVE_X + t->Img[i].Face;
+        int w = t->Data.Width >> t->Img[i].MipLevel;
+        int h = t->Data.Height >> t->Img[i].MipLevel;
+        glTexImage2D(target, t->Img[i].MipLevel, fmt.ifmt, w, h, 0, fmt.fmt, fmt.type, NULL);
+    }
+}
+
+void _NyFinishTex(NyasTexture *t)
+{
+    if (t->Data.Flags & NyasTexFlags_GenMipMaps)
+    {
+        GLenum type = _GL_TexTarget(t->Data.Type);
+        _GL_EditTex(type, t->Resource.Id);
+        glGenerateMipmap(type);
+    }
+}
+
 void _NyReleaseTex(uint32_t *id)
 {
+    _GL_ForgetTex(*id);
     glDeleteTextures(1, id);
 }
 
@@ -2008,22 +6746,15 @@ void _NyCreateMesh(uint32_t *id, uint32_t *vid, uint32_t *iid)
 void _NyUseMesh(NyasMesh *m, NyasShader *s)
 {
     (void)s;
-    if (m)
-    {
-        glBindVertexArray(m->Resource.Id);
-    }
-    else
-    {
-        glBindVertexArray(0);
-    }
+    _GL_BindVao(m ? m->Resource.Id : 0);
 }
 
-static GLsizei _GetAttribStride(int32_t attr_flags)
+int _NyVtxStride(NyasVtxAttribFlags attribs)
 {
     GLsizei stride = 0;
     for (int i = 0; i < NyasVtxAttrib_COUNT; ++i)
     {
-        if (attr_flags & (1 << i))
+        if (attribs & (1 << i))
         {
             stride += attrib_sizes[i];
         }
@@ -2031,17 +6762,14 @@ static GLsizei _GetAttribStride(int32_t attr_flags)
     return stride * sizeof(float);
 }
 
-void _NySetMesh(NyasMesh *mesh, uint32_t shader_id)
+// Interleaved float attributes of the bound vertex array and array buffer.
+static void _GL_SetVtxLayout(NyasVtxAttribFlags attribs, uint32_t shader_id)
 {
-    glBindVertexArray(mesh->Resource.Id);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh->ResVtx.Id);
-    glBufferData(GL_ARRAY_BUFFER, mesh->VtxSize, mesh->Vtx, GL_STATIC_DRAW);
-
     GLint offset = 0;
-    GLsizei stride = _GetAttribStride(mesh->Attribs);
+    GLsizei stride = _NyVtxStride(attribs);
     for (int i = 0; i < NyasVtxAttrib_COUNT; ++i)
     {
-        if (!(mesh->Attribs & (1 << i)))
+        if (!(attribs & (1 << i)))
         {
             continue;
         }
@@ -2056,18 +6784,28 @@ void _NySetMesh(NyasMesh *mesh, uint32_t shader_id)
         }
         offset += size;
     }
+}
+
+// Allocates the buffers and sets the vertex layout. Data is streamed through the staging buffer.
+void _NyAllocMesh(NyasMesh *mesh, uint32_t shader_id)
+{
+    _GL_BindVao(mesh->Resource.Id);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->ResVtx.Id);
+    glBufferData(GL_ARRAY_BUFFER, mesh->VtxSize, NULL, GL_STATIC_DRAW);
+    _GL_SetVtxLayout(mesh->Attribs, shader_id);
 
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ResIdx.Id);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh->ElementCount * sizeof(NyDrawIdx),
-        (const void *)mesh->Indices, GL_STATIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh->ElementCount * sizeof(NyDrawIdx), NULL,
+        GL_STATIC_DRAW);
 
-    glBindVertexArray(0);
+    _GL_BindVao(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
 void _NyReleaseMesh(uint32_t *id, uint32_t *vid, uint32_t *iid)
 {
+    G_GLState.Vao = G_GLState.Vao == *id ? 0 : G_GLState.Vao;
     glDeleteVertexArrays(1, id);
     glDeleteBuffers(1, vid);
     glDeleteBuffers(1, iid);
@@ -2078,8 +6816,186 @@ void _NyCreateShader(uint32_t *id)
     *id = glCreateProgram();
 }
 
-void _NyCompileShader(uint32_t id, const char *name, NyasShader *shader)
+#define NYAS_PROGRAM_CACHE_MAGIC 0x4E59504247424E31ULL // "NYPBGBN1"
+
+// Header of the cached program binaries, followed by Length bytes of binary.
+struct _GL_ProgramCacheHeader
+{
+    uint64_t Magic;
+    uint64_t SourceHash;
+    uint64_t DriverHash;
+    uint32_t Format;
+    uint32_t Length;
+};
+
+static struct
+{
+    int Hits;
+    int Misses;
+} G_ProgramCache;
+
+static uint64_t _GL_DriverHash(void)
+{
+    static uint64_t hash = 0;
+    if (!hash)
+    {
+        const GLenum names[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+        hash = _NyHash(NULL, 0);
+        for (int i = 0; i < 3; ++i)
+        {
+            const char *str = (const char *)glGetString(names[i]);
+            hash = str ? _NyHash(str, strlen(str), hash) : hash;
+        }
+    }
+    return hash;
+}
+
+static bool _GL_ProgramCacheSupported(void)
+{
+    GLint formats = 0;
+    if (GLAD_GL_VERSION_4_1)
+    {
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    }
+    return formats > 0;
+}
+
+static void _GL_ProgramCachePath(char *path, size_t size, const NyasShader *s)
+{
+    if (s->Defines && *s->Defines)
+    {
+        snprintf(path, size, "%s%s-%016llx.glbin", NYAS_PROGRAM_CACHE_DIR, s->Name,
+            (unsigned long long)_NyHash(s->Defines, strlen(s->Defines)));
+    }
+    else
+    {
+        snprintf(path, size, "%s%s.glbin", NYAS_PROGRAM_CACHE_DIR, s->Name);
+    }
+}
+
+// Restores a program from the cache. False on miss or if the driver rejects the binary.
+static bool _GL_LoadProgramBinary(GLuint id, const NyasShader *s, uint64_t src_hash)
+{
+    char path[256];
+    _GL_ProgramCachePath(path, sizeof(path), s);
+
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        return false;
+    }
+
+    bool ok = false;
+    _GL_ProgramCacheHeader h;
+    if (fread(&h, sizeof(h), 1, f) == 1 && h.Magic == NYAS_PROGRAM_CACHE_MAGIC &&
+        h.SourceHash == src_hash && h.DriverHash == _GL_DriverHash())
+    {
+        void *bin = NYAS_ALLOC(h.Length);
+        if (bin && fread(bin, h.Length, 1, f) == 1)
+        {
+            GLint status = GL_FALSE;
+            glProgramBinary(id, h.Format, bin, h.Length);
+            glGetProgramiv(id, GL_LINK_STATUS, &status);
+            ok = status == GL_TRUE;
+        }
+        NYAS_FREE(bin);
+    }
+
+    fclose(f);
+    return ok;
+}
+
+static void _GL_SaveProgramBinary(GLuint id, const NyasShader *s, uint64_t src_hash)
+{
+    GLint length = 0;
+    glGetProgramiv(id, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+    {
+        return;
+    }
+
+    _GL_ProgramCacheHeader h;
+    h.Magic = NYAS_PROGRAM_CACHE_MAGIC;
+    h.SourceHash = src_hash;
+    h.DriverHash = _GL_DriverHash();
+    h.Length = length;
+
+    void *bin = NYAS_ALLOC(length);
+    GLenum format;
+    glGetProgramBinary(id, length, NULL, &format, bin);
+    h.Format = format;
+
+    char path[256];
+    _GL_ProgramCachePath(path, sizeof(path), s);
+    mkdir(NYAS_PROGRAM_CACHE_DIR, 0755);
+    FILE *f = fopen(path, "wb");
+    if (!f || fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(bin, length, 1, f) != 1)
+    {
+        NYAS_LOG_WARN("Program cache write failed for %s.", path);
+    }
+
+    if (f)
+    {
+        fclose(f);
+    }
+    NYAS_FREE(bin);
+}
+
+#ifndef GL_MAX_SHADER_COMPILER_THREADS_KHR
+#define GL_MAX_SHADER_COMPILER_THREADS_KHR 0x91B0
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+typedef void (*_GL_MaxShaderCompilerThreadsFn)(GLuint count);
+
+// True when the driver compiles in the background and GL_COMPLETION_STATUS_KHR can be polled.
+static bool _GL_ParallelCompile(void)
+{
+    static int parallel = -1;
+    if (parallel < 0)
+    {
+        parallel = 0;
+        GLint ext_count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &ext_count);
+        for (GLint i = 0; i < ext_count; ++i)
+        {
+            const char *ext = (const char *)glGetStringi(GL_EXTENSIONS, i);
+            bool khr = !strcmp(ext, "GL_KHR_parallel_shader_compile");
+            if (khr || !strcmp(ext, "GL_ARB_parallel_shader_compile"))
+            {
+                _GL_MaxShaderCompilerThreadsFn max_threads =
+                    (_GL_MaxShaderCompilerThreadsFn)glfwGetProcAddress(
+                        khr ? "glMaxShaderCompilerThreadsKHR" : "glMaxShaderCompilerThreadsARB");
+                if (max_threads)
+                {
+                    max_threads(0xFFFFFFFF); // Implementation-chosen thread count.
+                }
+                parallel = 1;
+                break;
+            }
+        }
+        NYAS_LOG("Parallel shader compile: %s.", parallel ? "enabled" : "unavailable");
+    }
+    return parallel;
+}
+
+// Program submitted to the driver whose status has not been queried yet.
+struct _GL_PendingProgram
+{
+    GLuint Program;
+    GLuint Vert;
+    GLuint Frag;
+    uint64_t SrcHash;
+    bool Cached;
+};
+
+static NyArray<_GL_PendingProgram> G_PendingPrograms;
+
+// Issues the compile and link commands without any status query.
+void _NySubmitShader(NyasShader *s, const char *vert, size_t vert_size, const char *frag,
+    size_t frag_size)
 {
+    GLuint id = s->Resource.Id;
+
     // For shader hot-recompilations
     GLuint shaders[8];
     GLsizei attach_count;
@@ -2089,65 +7005,81 @@ void _NyCompileShader(uint32_t id, const char *name, NyasShader *shader)
         glDetachShader(id, shaders[i]);
     }
 
-    size_t shsrc_size; // Shader source size in bytes
-    char *shsrc;
-    char vert_path[256] = { '\0' };
-    char frag_path[256] = { '\0' };
-    strcpy(frag_path, "assets/shaders/");
-    strcat(frag_path, name);
-    strcpy(vert_path, frag_path);
-    strcat(vert_path, "-vert.glsl");
-    strcat(frag_path, "-frag.glsl");
-
-    GLint err;
-    GLchar output_log[1024];
+    _GL_PendingProgram p = {};
+    p.Program = id;
+    p.SrcHash = _NyHash(frag, frag_size, _NyHash(vert, vert_size));
+
+    bool cache = _GL_ProgramCacheSupported();
+    _GL_ParallelCompile();
+    p.Cached = cache && _GL_LoadProgramBinary(id, s, p.SrcHash);
+    if (!p.Cached)
+    {
+        p.Vert = glCreateShader(GL_VERTEX_SHADER);
+        p.Frag = glCreateShader(GL_FRAGMENT_SHADER);
+        glShaderSource(p.Vert, 1, &vert, NULL);
+        glShaderSource(p.Frag, 1, &frag, NULL);
+        glCompileShader(p.Vert);
+        glCompileShader(p.Frag);
+        glAttachShader(id, p.Vert);
+        glAttachShader(id, p.Frag);
+        if (cache)
+        {
+            glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
+        glLinkProgram(id);
+    }
+
+    G_PendingPrograms.Push(p);
+}
 
-    GLuint vert = glCreateShader(GL_VERTEX_SHADER);
-    GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
+// Queries link status (compile logs only on failure) and creates the uniform buffers.
+static void _GL_FinishProgram(_GL_PendingProgram *p, NyasShader *shader)
+{
+    GLuint id = shader->Resource.Id;
+    const char *name = shader->Name;
 
-    if (Nyas::ReadFile(vert_path, &shsrc, &shsrc_size) != NyasCode_Ok)
+    if (p->Cached)
     {
-        NYAS_ASSERT(!"Error loading shader vert file.");
+        ++G_ProgramCache.Hits;
+        NYAS_LOG("Program cache hit: %s (hits %d, misses %d).", name, G_ProgramCache.Hits,
+            G_ProgramCache.Misses);
     }
-
-    glShaderSource(vert, 1, (const char *const *)&shsrc, NULL);
-    glCompileShader(vert);
-    glGetShaderiv(vert, GL_COMPILE_STATUS, &err);
-    if (!err)
+    else
     {
-        glGetShaderInfoLog(vert, 1024, NULL, output_log);
-        NYAS_LOG_ERR("%s vert:\n%s\n", name, output_log);
-    }
-    NYAS_FREE(shsrc);
+        GLint err;
+        GLchar output_log[1024];
+        glGetProgramiv(id, GL_LINK_STATUS, &err);
+        if (!err)
+        {
+            glGetShaderiv(p->Vert, GL_COMPILE_STATUS, &err);
+            if (!err)
+            {
+                glGetShaderInfoLog(p->Vert, 1024, NULL, output_log);
+                NYAS_LOG_ERR("%s vert:\n%s\n", name, output_log);
+            }
 
-    if (Nyas::ReadFile(frag_path, &shsrc, &shsrc_size) != NyasCode_Ok)
-    {
-        NYAS_ASSERT(!"Error loading shader frag file.");
-    }
+            glGetShaderiv(p->Frag, GL_COMPILE_STATUS, &err);
+            if (!err)
+            {
+                glGetShaderInfoLog(p->Frag, 1024, NULL, output_log);
+                NYAS_LOG_ERR("%s frag:\n%s\n", name, output_log);
+            }
 
-    glShaderSource(frag, 1, (const char *const *)&shsrc, NULL);
-    glCompileShader(frag);
-    glGetShaderiv(frag, GL_COMPILE_STATUS, &err);
-    if (!err)
-    {
-        glGetShaderInfoLog(frag, 1024, NULL, output_log);
-        NYAS_LOG_ERR("%s frag:\n%s\n", name, output_log);
-    }
-    NYAS_FREE(shsrc);
+            glGetProgramInfoLog(id, 1024, NULL, output_log);
+            NYAS_LOG_ERR("%s program:\n%s\n", name, output_log);
+        }
+        else if (_GL_ProgramCacheSupported())
+        {
+            ++G_ProgramCache.Misses;
+            _GL_SaveProgramBinary(id, shader, p->SrcHash);
+            NYAS_LOG("Program cache miss: %s (hits %d, misses %d).", name, G_ProgramCache.Hits,
+                G_ProgramCache.Misses);
+        }
 
-    glAttachShader(id, vert);
-    glAttachShader(id, frag);
-    glLinkProgram(id);
-    glGetProgramiv(id, GL_LINK_STATUS, &err);
-    if (!err)
-    {
-        glGetProgramInfoLog(id, 1024, NULL, output_log);
-        NYAS_LOG_ERR("%s program:\n%s\n", name, output_log);
+        glDeleteShader(p->Vert);
+        glDeleteShader(p->Frag);
     }
 
-    glDeleteShader(vert);
-    glDeleteShader(frag);
-
     if (!shader->UnitSize || !(shader->ResUnif.Flags & NyasResourceFlags_Unused))
     {
         glGenBuffers(1, &shader->ResUnif.Id);
@@ -2165,6 +7097,37 @@ void _NyCompileShader(uint32_t id, const char *name, NyasShader *shader)
     }
 }
 
+// False while the driver is still compiling, which is only known with parallel compile support.
+bool _NyFinishShader(NyasShader *s)
+{
+    int i = 0;
+    while (i < G_PendingPrograms.Size && G_PendingPrograms[i].Program != s->Resource.Id)
+    {
+        ++i;
+    }
+
+    if (i == G_PendingPrograms.Size)
+    {
+        return true;
+    }
+
+    _GL_PendingProgram *p = &G_PendingPrograms[i];
+    if (_GL_ParallelCompile() && !p->Cached)
+    {
+        GLint complete = GL_FALSE;
+        glGetProgramiv(p->Program, GL_COMPLETION_STATUS_KHR, &complete);
+        if (!complete)
+        {
+            return false;
+        }
+    }
+
+    _GL_FinishProgram(p, s);
+    G_PendingPrograms[i] = G_PendingPrograms.Back();
+    G_PendingPrograms.Pop();
+    return true;
+}
+
 void _NyShaderLocations(uint32_t id, int *o_loc, const char **i_unif, int count)
 {
     for (int i = 0; i < count; ++i)
@@ -2182,8 +7145,7 @@ static void _SetTex(int loc, int *t, int c, int unit, GLenum target)
 {
     for (int i = 0; i < c; ++i)
     {
-        glActiveTexture(GL_TEXTURE0 + unit + i);
-        glBindTexture(target, t[i]);
+        _GL_BindTex(unit + i, target, t[i]);
         t[i] = unit + i;
     }
     glUniform1iv(loc, c, t);
@@ -2204,31 +7166,33 @@ void _NySetShaderTexArray(int loc, int *tex, int count, int texunit_offset)
     _SetTex(loc, tex, count, texunit_offset, GL_TEXTURE_2D_ARRAY);
 }
 
-void _NySetShaderUniformBuffer(NyasShader* shader)
+static void _GL_SetUniformBlock(GLuint binding, const void *block, int size, GLuint fallback);
+
+void _NySetShaderUniformBuffer(NyasShader *shader, const void *unit, const void *shared)
 {
-    if (!shader->UnitSize || !(shader->ResUnif.Flags & NyasResourceFlags_Unused))
+    if (shader->UnitSize && !(shader->ResUnif.Flags & NyasResourceFlags_Unused))
     {
-        glBindBuffer(GL_UNIFORM_BUFFER, shader->ResUnif.Id);
-        glBufferData(GL_UNIFORM_BUFFER, shader->UnitSize, shader->UnitBlock, GL_DYNAMIC_DRAW);
-        glBindBufferBase(GL_UNIFORM_BUFFER, 30, shader->ResUnif.Id);
+        _GL_SetUniformBlock(30, unit, shader->UnitSize, shader->ResUnif.Id);
     }
-    
 
-    if (!shader->SharedSize || !(shader->ResSharedUnif.Flags & NyasResourceFlags_Unused))
+    if (shader->SharedSize && !(shader->ResSharedUnif.Flags & NyasResourceFlags_Unused))
     {
-        glBindBuffer(GL_UNIFORM_BUFFER, shader->ResSharedUnif.Id);
-        glBufferData(GL_UNIFORM_BUFFER, shader->SharedSize, shader->SharedBlock, GL_DYNAMIC_DRAW);
-        glBindBufferBase(GL_UNIFORM_BUFFER, 10, shader->ResSharedUnif.Id);
+        _GL_SetUniformBlock(10, shared, shader->SharedSize, shader->ResSharedUnif.Id);
     }
 }
 
 void _NyUseShader(uint32_t id)
 {
-    glUseProgram(id);
+    if (_GL_StateChanged(G_GLState.Program != id))
+    {
+        glUseProgram(id);
+        G_GLState.Program = id;
+    }
 }
 
 void _NyReleaseShader(uint32_t id)
 {
+    G_GLState.Program = G_GLState.Program == id ? 0 : G_GLState.Program;
     glDeleteProgram(id);
 }
 
@@ -2250,7 +7214,7 @@ int _GL_FramebufAttach(NyasFbAttach a)
 
 void _NySetFramebuf(uint32_t fb_id, uint32_t tex_id, NyasTexTarget *tt)
 {
-    glBindFramebuffer(GL_FRAMEBUFFER, fb_id);
+    _GL_BindFramebuf(fb_id);
     GLenum face =
         tt->Face == NyasTexFace_2D ? GL_TEXTURE_2D : GL_TEXTURE_CUBE_MAP_POSITIVE_X + tt->Face;
     GLint slot = _GL_FramebufAttach(tt->Attach);
@@ -2259,14 +7223,396 @@ void _NySetFramebuf(uint32_t fb_id, uint32_t tex_id, NyasTexTarget *tt)
 
 void _NyUseFramebuf(uint32_t id)
 {
-    glBindFramebuffer(GL_FRAMEBUFFER, id);
+    _GL_BindFramebuf(id);
 }
 
 void _NyReleaseFramebuf(NyasFramebuffer *fb)
 {
+    GLuint id = fb->Resource.Id;
+    G_GLState.Framebuf = G_GLState.Framebuf == id ? 0 : G_GLState.Framebuf;
     glDeleteFramebuffers(1, &fb->Resource.Id);
 }
 
+#define NYAS_UPLOAD_REGION_SIZE (NYAS_UPLOAD_STAGING_SIZE / NYAS_UPLOAD_STAGING_FRAMES)
+
+// Staging buffer split in per-frame regions. Each region is fenced after its frame's
+// copies and only reused once the GPU has consumed it.
+static struct
+{
+    GLuint Buf;
+    char *Ptr; // Persistent mapping, NULL if buffer storage is not available.
+    GLsync Fence[NYAS_UPLOAD_STAGING_FRAMES];
+    int Region;
+    GLintptr Offset;
+} G_Staging;
+
+bool _NyStagingBegin(int64_t *capacity)
+{
+    if (!G_Staging.Buf)
+    {
+        glGenBuffers(1, &G_Staging.Buf);
+        glBindBuffer(GL_COPY_READ_BUFFER, G_Staging.Buf);
+        if (GLAD_GL_VERSION_4_4)
+        {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_COPY_READ_BUFFER, NYAS_UPLOAD_STAGING_SIZE, NULL, flags);
+            G_Staging.Ptr =
+                (char *)glMapBufferRange(GL_COPY_READ_BUFFER, 0, NYAS_UPLOAD_STAGING_SIZE, flags);
+        }
+        else
+        {
+            glBufferData(GL_COPY_READ_BUFFER, NYAS_UPLOAD_STAGING_SIZE, NULL, GL_STREAM_DRAW);
+        }
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    }
+
+    GLsync *fence = &G_Staging.Fence[G_Staging.Region];
+    if (*fence)
+    {
+        if (glClientWaitSync(*fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+        {
+            return false;
+        }
+        glDeleteSync(*fence);
+        *fence = 0;
+    }
+
+    G_Staging.Offset = 0;
+    *capacity = NYAS_UPLOAD_REGION_SIZE;
+    return true;
+}
+
+int64_t _NyStagingPush(const void *src, int64_t size)
+{
+    NYAS_ASSERT(G_Staging.Offset + size <= NYAS_UPLOAD_REGION_SIZE && "Staging region overflow.");
+    GLintptr offset = G_Staging.Region * NYAS_UPLOAD_REGION_SIZE + G_Staging.Offset;
+    if (G_Staging.Ptr)
+    {
+        memcpy(G_Staging.Ptr + offset, src, size);
+    }
+    else
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, G_Staging.Buf);
+        glBufferSubData(GL_COPY_READ_BUFFER, offset, size, src);
+    }
+    G_Staging.Offset += _NyAlign(size);
+    G_GLCounters.UploadBytes += size;
+    return offset;
+}
+
+void _NyStagingTex(NyasTexture *t, NyasTexImg *img, int y, int rows, int64_t offset)
+{
+    GLenum type = _GL_TexTarget(t->Data.Type);
+    struct _GL_TexFmtResult fmt = _GL_TexFmt(t->Data.Format);
+    int w = t->Data.Width >> img->MipLevel;
+
+    _GL_EditTex(type, t->Resource.Id);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, G_Staging.Buf);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (type == GL_TEXTURE_2D_ARRAY)
+    {
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, img->MipLevel, 0, y, img->Index, w, rows, 1, fmt.fmt,
+            fmt.type, (const void *)offset);
+    }
+    else
+    {
+        GLint target = (t->Data.Type == NyasTexType_2D) ? GL_TEXTURE_2D :
+                                                          GL_TEXTURE_CUBE_MAP_POSITIVE_X + img->Face;
+        glTexSubImage2D(
+            target, img->MipLevel, 0, y, w, rows, fmt.fmt, fmt.type, (const void *)offset);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void _NyStagingBuf(uint32_t buf, int64_t dst_offset, int64_t src_offset, int64_t size)
+{
+    glBindBuffer(GL_COPY_READ_BUFFER, G_Staging.Buf);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buf);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, src_offset, dst_offset, size);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+}
+
+void _NyStagingEnd(void)
+{
+    G_Staging.Fence[G_Staging.Region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    G_Staging.Region = (G_Staging.Region + 1) % NYAS_UPLOAD_STAGING_FRAMES;
+}
+
+#define NYAS_UNIFORM_REGION_SIZE (NYAS_UNIFORM_RING_SIZE / NYAS_UNIFORM_RING_FRAMES)
+
+// Uniform blocks are written to a persistently mapped ring split in per-frame regions. Like the
+// staging buffer, each region is fenced at the end of its frame and waited on before reuse.
+static struct
+{
+    GLuint Buf;
+    char *Ptr; // NULL if buffer storage is not available, blocks use the shader buffers then.
+    GLsync Fence[NYAS_UNIFORM_RING_FRAMES];
+    int Region;
+    GLintptr Offset;
+    GLint Align;
+    uint32_t Frame;
+} G_UniformRing;
+
+// Last upload of a block, keyed by its CPU memory so variants sharing blocks share the upload.
+struct _GL_UniformUpload
+{
+    const void *Block;
+    void *Copy; // Contents at upload time, unchanged blocks are bound again within a frame.
+    int Size;
+    GLintptr Offset;
+    uint32_t Frame;
+};
+
+static NyArray<_GL_UniformUpload> G_UniformUploads;
+
+// Copies size bytes but reserves at least reserve, for ranges bound past the copied data.
+static bool _GL_UniformRingPush(const void *data, int size, GLintptr *offset, int reserve = 0)
+{
+    if (!G_UniformRing.Buf)
+    {
+        glGenBuffers(1, &G_UniformRing.Buf);
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &G_UniformRing.Align);
+        if (GLAD_GL_VERSION_4_4)
+        {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBindBuffer(GL_UNIFORM_BUFFER, G_UniformRing.Buf);
+            glBufferStorage(GL_UNIFORM_BUFFER, NYAS_UNIFORM_RING_SIZE, NULL, flags);
+            G_UniformRing.Ptr =
+                (char *)glMapBufferRange(GL_UNIFORM_BUFFER, 0, NYAS_UNIFORM_RING_SIZE, flags);
+        }
+    }
+
+    if (!G_UniformRing.Ptr)
+    {
+        return false;
+    }
+
+    GLsync *fence = &G_UniformRing.Fence[G_UniformRing.Region];
+    if (*fence)
+    {
+        while (glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) ==
+            GL_TIMEOUT_EXPIRED)
+        {
+        }
+        glDeleteSync(*fence);
+        *fence = 0;
+    }
+
+    GLintptr aligned = (G_UniformRing.Offset + G_UniformRing.Align - 1) / G_UniformRing.Align *
+        G_UniformRing.Align;
+    reserve = reserve > size ? reserve : size;
+    if (aligned + reserve > NYAS_UNIFORM_REGION_SIZE)
+    {
+        NYAS_LOG_WARN("Uniform ring region full (%d bytes requested).", reserve);
+        return false;
+    }
+
+    *offset = G_UniformRing.Region * NYAS_UNIFORM_REGION_SIZE + aligned;
+    memcpy(G_UniformRing.Ptr + *offset, data, size);
+    G_UniformRing.Offset = aligned + reserve;
+    G_GLCounters.UploadBytes += size;
+    return true;
+}
+
+static void _GL_BindUniformRange(GLuint binding, GLuint buf, GLintptr offset, GLsizeiptr size)
+{
+    NYAS_ASSERT(binding < NYAS_GL_UNIFORM_BINDINGS);
+    bool changed = G_GLState.Ubo[binding].Buf != buf ||
+        G_GLState.Ubo[binding].Offset != offset || G_GLState.Ubo[binding].Size != size;
+    if (_GL_StateChanged(changed))
+    {
+        glBindBufferRange(GL_UNIFORM_BUFFER, binding, buf, offset, size);
+        G_GLState.Ubo[binding].Buf = buf;
+        G_GLState.Ubo[binding].Offset = offset;
+        G_GLState.Ubo[binding].Size = size;
+    }
+}
+
+static void _GL_SetUniformBlock(GLuint binding, const void *block, int size, GLuint fallback)
+{
+    _GL_UniformUpload *u = NULL;
+    for (int i = 0; i < G_UniformUploads.Size && !u; ++i)
+    {
+        u = G_UniformUploads[i].Block == block ? &G_UniformUploads[i] : NULL;
+    }
+
+    if (!u)
+    {
+        G_UniformUploads.Push({ block, NULL, 0, 0, 0 });
+        u = &G_UniformUploads[G_UniformUploads.Size - 1];
+    }
+
+    // Only ranges of the current region can be bound again, older regions are only fenced for the
+    // frame that wrote them. Unchanged blocks of older frames go to the ring again, but skip the
+    // update of their copy.
+    bool unchanged = u->Copy && u->Size == size && !memcmp(u->Copy, block, size);
+    if (!unchanged || u->Frame != G_UniformRing.Frame)
+    {
+        GLintptr offset;
+        if (!_GL_UniformRingPush(block, size, &offset))
+        {
+            glBindBuffer(GL_UNIFORM_BUFFER, fallback);
+            glBufferData(GL_UNIFORM_BUFFER, size, block, GL_DYNAMIC_DRAW);
+            G_GLCounters.UploadBytes += size;
+            _GL_BindUniformRange(binding, fallback, 0, size);
+            NYAS_FREE(u->Copy);
+            u->Copy = NULL;
+            u->Size = 0;
+            return;
+        }
+
+        if (!unchanged)
+        {
+            if (u->Size != size)
+            {
+                NYAS_FREE(u->Copy);
+                u->Copy = NYAS_ALLOC(size);
+                u->Size = size;
+            }
+            memcpy(u->Copy, block, size);
+        }
+        u->Offset = offset;
+        u->Frame = G_UniformRing.Frame;
+    }
+
+    _GL_BindUniformRange(binding, G_UniformRing.Buf, u->Offset, size);
+}
+
+// Binds the unit block from offset on, keeping the block size. The tail of the range is not
+// written, the instances drawn never read it.
+void _NySetShaderUnitBlock(NyasShader *shader, const void *unit, int offset)
+{
+    if (!shader->UnitSize || (shader->ResUnif.Flags & NyasResourceFlags_Unused))
+    {
+        return;
+    }
+
+    if (!offset)
+    {
+        _GL_SetUniformBlock(30, unit, shader->UnitSize, shader->ResUnif.Id);
+        return;
+    }
+
+    const char *slice = (const char *)unit + offset;
+    GLintptr ring_offset;
+    if (_GL_UniformRingPush(slice, shader->UnitSize - offset, &ring_offset, shader->UnitSize))
+    {
+        _GL_BindUniformRange(30, G_UniformRing.Buf, ring_offset, shader->UnitSize);
+        return;
+    }
+
+    glBindBuffer(GL_UNIFORM_BUFFER, shader->ResUnif.Id);
+    glBufferData(GL_UNIFORM_BUFFER, shader->UnitSize, NULL, GL_DYNAMIC_DRAW);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, shader->UnitSize - offset, slice);
+    _GL_BindUniformRange(30, shader->ResUnif.Id, 0, shader->UnitSize);
+}
+
+// Swaps to the other copy on the first upload of a frame, so the previous frame draws can still
+// read theirs, and uploads the instances written since that copy was current. Copies that are
+// too small are reallocated whole.
+void _NySyncInstances(
+    NyasInstanceBuffer *inst, const char *data, int count, int pending_begin, int pending_end)
+{
+    if (!_NyInstanceBuffersSupported())
+    {
+        static bool warned = false;
+        if (!warned)
+        {
+            NYAS_LOG_ERR("Instance buffers need shader storage buffers (GL 4.3).");
+            warned = true;
+        }
+        return;
+    }
+
+    if (inst->Frame != G_UniformRing.Frame)
+    {
+        inst->Frame = G_UniformRing.Frame;
+        inst->Current ^= 1;
+    }
+
+    // Both copies miss the range written since the last sync.
+    for (int i = 0; pending_begin != pending_end && i < 2; ++i)
+    {
+        bool clean = inst->DirtyBegin[i] == inst->DirtyEnd[i];
+        inst->DirtyBegin[i] =
+            clean || pending_begin < inst->DirtyBegin[i] ? pending_begin : inst->DirtyBegin[i];
+        inst->DirtyEnd[i] =
+            clean || pending_end > inst->DirtyEnd[i] ? pending_end : inst->DirtyEnd[i];
+    }
+
+    int c = inst->Current;
+    NyasResource *res = &inst->Res[c];
+    if (!res->Id)
+    {
+        glGenBuffers(1, &res->Id);
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, res->Id);
+    if (inst->GpuCapacity[c] < count)
+    {
+        inst->GpuCapacity[c] = count + count / 2;
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)inst->GpuCapacity[c] * inst->Stride,
+            NULL, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, (GLsizeiptr)count * inst->Stride, data);
+        G_GLCounters.UploadBytes += (int64_t)count * inst->Stride;
+    }
+    else if (inst->DirtyBegin[c] != inst->DirtyEnd[c])
+    {
+        int end = inst->DirtyEnd[c] < count ? inst->DirtyEnd[c] : count;
+        GLintptr offset = (GLintptr)inst->DirtyBegin[c] * inst->Stride;
+        if (end > inst->DirtyBegin[c])
+        {
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset,
+                (GLsizeiptr)(end - inst->DirtyBegin[c]) * inst->Stride, data + offset);
+            G_GLCounters.UploadBytes += (int64_t)(end - inst->DirtyBegin[c]) * inst->Stride;
+        }
+    }
+    inst->DirtyBegin[c] = 0;
+    inst->DirtyEnd[c] = 0;
+
+    if (count)
+    {
+        glBindBufferRange(
+            GL_SHADER_STORAGE_BUFFER, 0, res->Id, 0, (GLsizeiptr)count * inst->Stride);
+    }
+}
+
+bool _NyInstanceBuffersSupported()
+{
+    return GLAD_GL_VERSION_4_3;
+}
+
+void _NyReleaseInstances(NyasInstanceBuffer *inst)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        if (inst->Res[i].Id)
+        {
+            glDeleteBuffers(1, &inst->Res[i].Id);
+            inst->Res[i].Id = 0;
+        }
+        inst->GpuCapacity[i] = 0;
+    }
+}
+
+void _NySetShaderInstanceBase(int loc, int first)
+{
+    glUniform1i(loc, first);
+}
+
+void _NyUniformRingEnd(void)
+{
+    if (G_UniformRing.Offset)
+    {
+        G_UniformRing.Fence[G_UniformRing.Region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    G_UniformRing.Region = (G_UniformRing.Region + 1) % NYAS_UNIFORM_RING_FRAMES;
+    G_UniformRing.Offset = 0;
+    ++G_UniformRing.Frame;
+}
+
 void _NyClear(bool color, bool depth, bool stencil)
 {
     GLbitfield mask = 0;
@@ -2279,57 +7625,171 @@ void _NyClear(bool color, bool depth, bool stencil)
     }
 }
 
-void _NyDraw(int elem_count, int index_type, int instances)
+void _NyDraw(int elem_count, int index_type, int instances, int64_t first)
+{
+    void *offset = (void *)(first * (index_type ? sizeof(GLuint) : sizeof(GLushort)));
+    glDrawElementsInstanced(GL_TRIANGLES, elem_count,
+        index_type ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT, offset, instances);
+    G_GLCounters.Draws++;
+}
+
+void _NyCreateMergedMesh(NyMergedMesh *mm)
+{
+    glGenVertexArrays(1, &mm->Resource.Id);
+    glGenBuffers(1, &mm->ResVtx.Id);
+    glGenBuffers(1, &mm->ResIdx.Id);
+    glGenBuffers(1, &mm->ResCmd.Id);
+}
+
+// Storage is sized once, meshes are written into their ranges without reallocating.
+void _NyAllocMergedMesh(NyMergedMesh *mm, uint32_t shader_id)
+{
+    _GL_BindVao(mm->Resource.Id);
+    glBindBuffer(GL_ARRAY_BUFFER, mm->ResVtx.Id);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mm->ResIdx.Id);
+    if (GLAD_GL_VERSION_4_4)
+    {
+        glBufferStorage(GL_ARRAY_BUFFER, mm->VtxCapacity, NULL, GL_DYNAMIC_STORAGE_BIT);
+        glBufferStorage(GL_ELEMENT_ARRAY_BUFFER, mm->IdxCapacity * sizeof(NyDrawIdx), NULL,
+            GL_DYNAMIC_STORAGE_BIT);
+    }
+    else
+    {
+        glBufferData(GL_ARRAY_BUFFER, mm->VtxCapacity, NULL, GL_STATIC_DRAW);
+        glBufferData(
+            GL_ELEMENT_ARRAY_BUFFER, mm->IdxCapacity * sizeof(NyDrawIdx), NULL, GL_STATIC_DRAW);
+    }
+    _GL_SetVtxLayout(mm->Attribs, shader_id);
+    _GL_BindVao(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void _NyWriteMergedMesh(NyMergedMesh *mm, const NyMeshOffset *range, const NyasMesh *src)
+{
+    glBindBuffer(GL_COPY_WRITE_BUFFER, mm->ResVtx.Id);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, range->BaseVtx * _NyVtxStride(mm->Attribs),
+        src->VtxSize, src->Vtx);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, mm->ResIdx.Id);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, range->FirstIdx * sizeof(NyDrawIdx),
+        range->ElementCount * sizeof(NyDrawIdx), src->Indices);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+// Commands go to the uniform ring when it is mapped, to the merged mesh buffer otherwise. Without
+// multi-draw indirect support every command is issued on its own.
+void _NyDrawIndirect(NyMergedMesh *mm)
+{
+    GLenum type = sizeof(NyDrawIdx) == 4 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+    const NyDrawIndirect *cmds = &mm->Cmds[0];
+    GLsizei count = mm->Cmds.Size;
+    _GL_BindVao(mm->Resource.Id);
+    if (!GLAD_GL_VERSION_4_3)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES, cmds[i].Count, type,
+                (void *)(cmds[i].FirstIdx * sizeof(NyDrawIdx)), cmds[i].InstanceCount,
+                cmds[i].BaseVtx);
+        }
+        G_GLCounters.Draws += count;
+        return;
+    }
+
+    GLintptr offset = 0;
+    int size = count * sizeof(NyDrawIndirect);
+    if (_GL_UniformRingPush(cmds, size, &offset))
+    {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, G_UniformRing.Buf);
+    }
+    else
+    {
+        offset = 0;
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mm->ResCmd.Id);
+        if (count > mm->CmdCapacity)
+        {
+            mm->CmdCapacity = count * 2;
+            glBufferData(GL_DRAW_INDIRECT_BUFFER, mm->CmdCapacity * sizeof(NyDrawIndirect), NULL,
+                GL_DYNAMIC_DRAW);
+        }
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, size, cmds);
+        G_GLCounters.UploadBytes += size;
+    }
+
+    glMultiDrawElementsIndirect(GL_TRIANGLES, type, (void *)offset, count, 0);
+    G_GLCounters.Draws++;
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void _NyReleaseMergedMesh(NyMergedMesh *mm)
 {
-    glDrawElementsInstanced(GL_TRIANGLES, elem_count, index_type ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT, 0, instances);
+    G_GLState.Vao = G_GLState.Vao == mm->Resource.Id ? 0 : G_GLState.Vao;
+    glDeleteVertexArrays(1, &mm->Resource.Id);
+    glDeleteBuffers(1, &mm->ResVtx.Id);
+    glDeleteBuffers(1, &mm->ResIdx.Id);
+    glDeleteBuffers(1, &mm->ResCmd.Id);
 }
 
 void _NyClearColor(float r, float g, float b, float a)
 {
-    if (a >= 0.0f)
+    GLfloat *c = G_GLState.ClearColor;
+    if (a >= 0.0f && _GL_StateChanged(c[0] != r || c[1] != g || c[2] != b || c[3] != a))
     {
         glClearColor(r, g, b, a);
+        c[0] = r;
+        c[1] = g;
+        c[2] = b;
+        c[3] = a;
     }
 }
 
 void _NyEnableBlend(void)
 {
-    glEnable(GL_BLEND);
+    _GL_SetCap(_GL_Cap_Blend, true);
 }
 
 void _NyDisableBlend(void)
 {
-    glDisable(GL_BLEND);
+    _GL_SetCap(_GL_Cap_Blend, false);
 }
 
 void _NyEnableCull(void)
 {
-    glEnable(GL_CULL_FACE);
+    _GL_SetCap(_GL_Cap_Cull, true);
 }
 
 void _NyDisableCull(void)
 {
-    glDisable(GL_CULL_FACE);
+    _GL_SetCap(_GL_Cap_Cull, false);
 }
 
 void _NyEnableDepthTest(void)
 {
-    glEnable(GL_DEPTH_TEST);
+    _GL_SetCap(_GL_Cap_DepthTest, true);
 }
 
 void _NyDisableDepthTest(void)
 {
-    glDisable(GL_DEPTH_TEST);
+    _GL_SetCap(_GL_Cap_DepthTest, false);
+}
+
+static void _GL_DepthMask(GLuint mask)
+{
+    if (_GL_StateChanged(G_GLState.DepthMask != mask))
+    {
+        glDepthMask((GLboolean)mask);
+        G_GLState.DepthMask = mask;
+    }
 }
 
 void _NyEnableDepthMask(void)
 {
-    glDepthMask(GL_TRUE);
+    _GL_DepthMask(GL_TRUE);
 }
 
 void _NyDisableDepthMask(void)
 {
-    glDepthMask(GL_FALSE);
+    _GL_DepthMask(GL_FALSE);
 }
 
 static GLenum _GL_Blend(NyasBlendFunc blend_func)
@@ -2348,9 +7808,17 @@ static GLenum _GL_Blend(NyasBlendFunc blend_func)
 void _NySetBlend(NyasBlendFunc blend_func_src, NyasBlendFunc blend_func_dst)
 {
     GLenum gl_src = _GL_Blend(blend_func_src);
-    if (gl_src != 0xFFFF)
+    if (gl_src == 0xFFFF)
+    {
+        return;
+    }
+
+    GLenum gl_dst = _GL_Blend(blend_func_dst);
+    if (_GL_StateChanged(G_GLState.BlendSrc != gl_src || G_GLState.BlendDst != gl_dst))
     {
-        glBlendFunc(gl_src, _GL_Blend(blend_func_dst));
+        glBlendFunc(gl_src, gl_dst);
+        G_GLState.BlendSrc = gl_src;
+        G_GLState.BlendDst = gl_dst;
     }
 }
 
@@ -2369,9 +7837,10 @@ static GLenum _GL_Cull(NyasFaceCull cull)
 void _NySetCull(NyasFaceCull cull_face)
 {
     GLenum gl_value = _GL_Cull(cull_face);
-    if (gl_value)
+    if (gl_value && _GL_StateChanged(G_GLState.CullFace != gl_value))
     {
-        glCullFace(_GL_Cull(cull_face));
+        glCullFace(gl_value);
+        G_GLState.CullFace = gl_value;
     }
 }
 
@@ -2389,55 +7858,72 @@ static GLenum _GL_DepthFunc(NyasDepthFunc df)
 void _NySetDepthFunc(NyasDepthFunc depth_func)
 {
     GLenum gl_value = _GL_DepthFunc(depth_func);
-    if (gl_value)
+    if (gl_value && _GL_StateChanged(G_GLState.DepthFunc != gl_value))
     {
         glDepthFunc(gl_value);
+        G_GLState.DepthFunc = gl_value;
     }
 }
 
 void _NyEnableStencilTest(void)
 {
-    glEnable(GL_STENCIL);
+    _GL_SetCap(_GL_Cap_StencilTest, true);
 }
 
 void _NyDisableStencilTest(void)
 {
-    glDisable(GL_STENCIL);
+    _GL_SetCap(_GL_Cap_StencilTest, false);
+}
+
+static void _GL_StencilMask(GLuint mask)
+{
+    if (_GL_StateChanged(G_GLState.StencilMask != mask))
+    {
+        glStencilMask(mask);
+        G_GLState.StencilMask = mask;
+    }
 }
 
 void _NyEnableStencilMask(void)
 {
-    glStencilMask(GL_TRUE);
+    _GL_StencilMask(GL_TRUE);
 }
 
 void _NyDisableStencilMask(void)
 {
-    glStencilMask(GL_FALSE);
+    _GL_StencilMask(GL_FALSE);
 }
 
 void _NyEnableScissor(void)
 {
-    glEnable(GL_SCISSOR_TEST);
+    _GL_SetCap(_GL_Cap_Scissor, true);
 }
 
 void _NyDisableScissor(void)
 {
-    glDisable(GL_SCISSOR_TEST);
+    _GL_SetCap(_GL_Cap_Scissor, false);
+}
+
+static inline bool _GL_RectEq(const NyRect &a, const NyRect &b)
+{
+    return a.X == b.X && a.Y == b.Y && a.W == b.W && a.H == b.H;
 }
 
 void _NyViewport(NyRect rect)
 {
-    if (rect.X != rect.W)
+    if (rect.X != rect.W && _GL_StateChanged(!_GL_RectEq(G_GLState.Viewport, rect)))
     {
         glViewport(rect.X, rect.Y, rect.W, rect.H);
+        G_GLState.Viewport = rect;
     }
 }
 
 void _NyScissor(NyRect rect)
 {
-    if (rect.X != rect.W)
+    if (rect.X != rect.W && _GL_StateChanged(!_GL_RectEq(G_GLState.Scissor, rect)))
     {
         glScissor(rect.X, rect.Y, rect.W, rect.H);
+        G_GLState.Scissor = rect;
     }
 }
 
@@ -29,7 +29,11 @@
 
 #ifndef NYAS_GET_TIME_NS
 #include <chrono>
-#define NYAS_GET_TIME_NS (std::chrono::system_clock::now().time_since_epoch().count())
+// Monotonic, NyChrono only measures intervals.
+#define NYAS_GET_TIME_NS                                                                           \
+    ((int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(                                \
+        std::chrono::steady_clock::now().time_since_epoch())                                       \
+            .count())
 #endif
 
 #define NY_UNUSED(_VAR) (void)(_VAR)
@@ -89,6 +93,9 @@ struct NyasDrawUnit;
 struct NyasDrawCmd;
 struct NyasCamera;
 struct NyasEntity;
+struct NyasFileView;
+struct NyasStats;
+struct NyMergedMesh;
 
 // Flags
 typedef int NyasResourceFlags; // enum NyasResourceFlags_
@@ -119,6 +126,8 @@ NyasHandle CreateTexture();
 NyasHandle CreateTexture(int w, int h, NyasTexType t, NyasTexFmt f, int count = 1);
 void SetTexture(NyasHandle tex, NyasTexDesc *desc);
 void LoadTexture(NyasHandle tex, NyasTexDesc *desc, const char *path, int index = 0);
+// Decodes an already read image file, for single face textures.
+void LoadTexture(NyasHandle tex, NyasTexDesc *desc, const void *file, size_t size, int index = 0);
 
 NyasHandle CreateFramebuffer();
 void SetFramebufferTarget(NyasHandle fb, int index, NyasTexTarget target);
@@ -127,18 +136,52 @@ void SetFramebufferTarget(NyasHandle fb, int index, NyasTexTarget target);
 NyasHandle CreateMesh();
 NyasHandle LoadMesh(const char *path);
 void ReloadMesh(NyasHandle mesh, const char *path);
+// Copies the geometry, interleaved in attribute order, and builds its bounds and LOD chain.
+void SetMesh(NyasHandle mesh, NyasVtxAttribFlags attribs, const float *vtx, uint32_t vtx_size,
+    const NyDrawIdx *indices, int64_t index_count);
+// Writes the mesh in the msh format, level of detail chain included.
+int SaveMesh(NyasHandle mesh, const char *path);
 
 NyasHandle CreateShader(const NyasShaderDesc *desc);
+// False below GL 4.3, where instance buffers are not uploaded and per-instance data has to go
+// through the unit block instead.
+bool InstanceBuffersSupported();
 void ReloadShader(NyasHandle shader);
+// Compiles and links the dirty shaders as one batch, querying status after all are submitted.
+void CompileShaders(const NyasHandle *shaders, int count);
+// Permutation of base built with the given defines ("NAME" or "NAME=VALUE", whitespace separated),
+// sharing its data blocks. The same define string returns the same handle and must outlive it.
+// Compiled in the background on first draw, drawing with base until then.
+NyasHandle ShaderVariant(NyasHandle base, const char *defines);
 
 void Draw(NyasDrawCmd *command);
+// Packs a draw sort key, depth normalized to [0, 1]. Pass goes first because framebuffers depend
+// on each other. Opaque draws then group by framebuffer, shader, material and mesh, front to back.
+// Blended draws group by framebuffer and go back to front.
+uint64_t SortKey(int pass, NyasHandle framebuf, NyasHandle shader, int material, NyasHandle mesh,
+    float depth, bool blended = false);
+// Radix sorts the commands, and the units of each command, by key. Equal keys keep their order.
+void SortDraws(NyasDrawCmd *commands, int count);
+// Forgets the cached render state, call after issuing graphics API calls outside of Nyas.
+void InvalidateState();
 
 NyasCtx *GetCurrentCtx();
 
-bool InitIO(const char *title, int win_w, int win_h);
+// Headless creates a hidden window of fixed size, whose default framebuffer is only read with
+// SaveFrame. Without a display it needs GLFW built for OSMesa (NYAS_HEADLESS in CMake).
+bool InitIO(const char *title, int win_w, int win_h, bool headless = false);
 void PollIO();
 void WindowSwap();
+// Writes the default framebuffer as a binary PPM image, call it before WindowSwap.
+int SaveFrame(const char *path);
 int ReadFile(const char *path, char **dst, size_t *size);
+
+// Asset packs: ReadFile and FileView look up mounted packs before falling back to disk.
+bool MountPack(const char *path);
+void UnmountPacks();
+int BuildPack(const char *pack_path, const char *const *files, int count);
+int FileView(const char *path, NyasFileView *view);
+void ReleaseFileView(NyasFileView *view);
 } // namespace Nyas
 
 struct NyAllocator
@@ -184,13 +227,56 @@ template<size_t CAP> char NyCircularAllocator<CAP>::Arena[CAP] = { 0 };
 template<size_t CAP> ptrdiff_t NyCircularAllocator<CAP>::Offset = { 0 };
 typedef NyCircularAllocator<NYAS_FRAME_ALLOCATOR_ARENA_SIZE> NyFrameAllocator;
 
+// Per-thread counterpart of NyFrameAllocator for jobs that record frame data in parallel. Each
+// thread allocates its own arena on first use and releases it when the thread exits.
+template<size_t CAP> struct NyThreadCircularAllocator
+{
+    struct Arena
+    {
+        char *Data;
+        ptrdiff_t Offset;
+        Arena() : Data(NULL), Offset(0) {}
+        ~Arena() { NYAS_FREE(Data); }
+    };
+
+    static thread_local Arena Tls;
+    static inline void *Alloc(size_t size, void *_ = NULL)
+    {
+        NY_UNUSED(_);
+
+        if (!Tls.Data)
+        {
+            Tls.Data = (char *)NYAS_ALLOC(CAP);
+        }
+
+        if (Tls.Offset + size > CAP)
+        {
+            Tls.Offset = size;
+            return (void *)Tls.Data;
+        }
+
+        void *ret = (void *)&Tls.Data[Tls.Offset];
+        Tls.Offset += size;
+        return ret;
+    }
+    static inline void Free(void *ptr, void *_ = NULL)
+    {
+        NY_UNUSED(_);
+        NY_UNUSED(ptr);
+    }
+};
+
+template<size_t CAP>
+thread_local typename NyThreadCircularAllocator<CAP>::Arena NyThreadCircularAllocator<CAP>::Tls;
+typedef NyThreadCircularAllocator<NYAS_THREAD_FRAME_ARENA_SIZE> NyThreadFrameAllocator;
+
 template<typename T, typename A = NyAllocator> struct NyBuffer
 {
     T *Data;
     int Capacity;
 
     inline NyBuffer() : Data(NULL), Capacity(0) {}
-    inline NyBuffer(int capacity) { Reserve(capacity); }
+    inline NyBuffer(int capacity) : Data(NULL), Capacity(0) { Reserve(capacity); }
     inline ~NyBuffer()
     {
         A::Free(Data);
@@ -284,6 +370,38 @@ template<typename T, typename A = NyAllocator> struct NyPool
         Next = id;
         --Count;
     }
+
+    // Writes the ids in use in increasing order, out needs room for Count ids. Removed ids leave
+    // holes, so 0..Count-1 are not the ids in use after a removal.
+    inline int LiveIds(int *out) const
+    {
+        if (Count == Arr.Size)
+        {
+            for (int i = 0; i < Count; ++i)
+            {
+                out[i] = i;
+            }
+            return Count;
+        }
+
+        char *freed = (char *)NYAS_ALLOC(Arr.Size);
+        memset(freed, 0, Arr.Size);
+        for (int i = Next; i < Arr.Size; i = *(const int *)&Arr[i])
+        {
+            freed[i] = 1;
+        }
+
+        int n = 0;
+        for (int i = 0; i < Arr.Size; ++i)
+        {
+            if (!freed[i])
+            {
+                out[n++] = i;
+            }
+        }
+        NYAS_FREE(freed);
+        return n;
+    }
 };
 
 struct NyVec2i
@@ -486,6 +604,7 @@ enum NyasResourceFlags_
     NyasResourceFlags_ReleaseAppStorage = 1 << 5,
     NyasResourceFlags_Unused = 1 << 6,
     NyasResourceFlags_Mapped = 1 << 7,
+    NyasResourceFlags_Streaming = 1 << 8, // Queued for upload, not drawable until resident.
 };
 
 enum NyasKey_
@@ -660,7 +779,7 @@ typedef struct NyasPlatform
     void *(*Alloc)(size_t size);
     void (*Free)(void *ptr);
     int64_t (*GetTime)(); // Get system time in nanoseconds.
-	int (*ReadFile)(const char *path, char **out_dst, size_t *out_size);
+	int (*ReadFile)(const char *path, char **out_dst, size_t *out_size); // Disk fallback of the VFS.
 
     float DeltaTime;
 	void *InternalWindow;
@@ -668,12 +787,17 @@ typedef struct NyasPlatform
     bool WindowClosed;
     bool WindowHovered;
     bool WindowFocused;
+    bool Headless; // Offscreen, see Nyas::InitIO.
 
 	bool ShowCursor;
     bool CaptureMouse;
     bool CaptureKeyboard;
 
-	NyasPlatform() : DeltaTime(1.0f / 60.0f), InternalWindow(NULL), WindowClosed(false), ShowCursor(true) {}
+	NyasPlatform() :
+        ReadFile(NULL), DeltaTime(1.0f / 60.0f), InternalWindow(NULL), WindowClosed(false),
+        Headless(false), ShowCursor(true)
+    {
+    }
 } NyasPlatform;
 
 typedef struct NyasConfig
@@ -684,6 +808,11 @@ typedef struct NyasConfig
 		float DragSensibility;
 		float ScrollSensibility;
 	} Navigation;
+    struct
+    {
+        int64_t FrameBytes; // Max bytes staged for GPU upload per frame.
+        int64_t FrameMicroSeconds; // Max CPU time spent staging uploads per frame.
+    } Upload;
 } NyasConfig;
 
 typedef struct NyasIO
@@ -694,11 +823,50 @@ typedef struct NyasIO
     NyVec2 MouseScroll; // x horizontal and y vertical scrolls
 } NyasIO;
 
+// Counters of the last presented frame.
+typedef struct NyasStats
+{
+    int StateCalls; // Render state calls issued to the driver.
+    int SkippedStateCalls; // Redundant render state calls filtered out.
+    int DrawCalls; // A multi-draw counts as one.
+    int64_t UploadBytes; // Staged uploads, uniform blocks, indirect commands and instance data.
+} NyasStats;
+
+// Time spent under one name: CPU scopes, or GPU draw commands grouped by shader.
+typedef struct NyasProfileTime
+{
+    const char *Name;
+    float Ms;
+    int Count; // Scopes or commands merged.
+} NyasProfileTime;
+
+// Frame profiler, active while Enabled. Every draw command is wrapped in a GL_TIME_ELAPSED query
+// that is read back NYAS_PROFILE_FRAMES - 1 swaps later without waiting: frames whose queries
+// are not done by then are dropped. Only the first NYAS_PROFILE_SCOPES commands of a frame are
+// timed, GPU times leave out the rest. CPU times are the NyProfileScope ended between the last
+// two swaps.
+typedef struct NyasProfile
+{
+    bool Enabled;
+    NyasProfileTime Cpu[NYAS_PROFILE_SCOPES];
+    NyasProfileTime Gpu[NYAS_PROFILE_SCOPES];
+    int CpuCount;
+    int GpuCount;
+    float GpuMs; // Of the timed commands of the last resolved frame.
+    int GpuUntimed; // Commands of the last resolved frame missing from GpuMs.
+    float FrameMs[NYAS_PROFILE_HISTORY]; // Time between swaps, ring starting at History.
+    float GpuFrameMs[NYAS_PROFILE_HISTORY]; // Timed commands only, 0 on dropped frames.
+    int History; // Oldest sample of both rings.
+    int DroppedFrames;
+} NyasProfile;
+
 typedef struct NyasCtx
 {
     NyasPlatform Platform;
     NyasConfig Cfg;
     NyasIO IO;
+    NyasStats Stats;
+    NyasProfile Profile;
 } NyasCtx;
 
 typedef struct NyasTexDesc
@@ -757,6 +925,16 @@ typedef struct NyasTexImg
     NyasTexImg(int aIndex) : Pix(NULL), Face(NyasTexFace_2D), MipLevel(0), Index(aIndex) {}
 } NyasTexImg;
 
+// Read-only file contents. Points into a mounted pack unless Owned.
+typedef struct NyasFileView
+{
+    const char *Data;
+    size_t Size;
+    bool Owned;
+
+    NyasFileView() : Data(NULL), Size(0), Owned(false) {}
+} NyasFileView;
+
 typedef struct NyasResource
 {
     uint32_t Id;
@@ -773,9 +951,13 @@ typedef struct NyasShaderDesc
     int TexArrCount;
     int UnitSize;
     int SharedSize;
+    const char *Defines;
+    int InstanceSize; // Bytes per element of the instance buffer, none if 0.
 
-    NyasShaderDesc(const char *id, int stcount = 0, int scmcount = 0, int tacount = 0, int unitsz = 0, int sharedsz = 0) :
-        Name(id), SharedTexCount(stcount), SharedCubemapCount(scmcount), TexArrCount(tacount), UnitSize(unitsz), SharedSize(sharedsz) 
+    NyasShaderDesc(const char *id, int stcount = 0, int scmcount = 0, int tacount = 0,
+        int unitsz = 0, int sharedsz = 0, const char *defines = NULL, int instancesz = 0) :
+        Name(id), SharedTexCount(stcount), SharedCubemapCount(scmcount), TexArrCount(tacount),
+        UnitSize(unitsz), SharedSize(sharedsz), Defines(defines), InstanceSize(instancesz)
     {
     }
 } NyasShaderDesc;
@@ -791,6 +973,14 @@ typedef struct NyasTexture
     NyasTexture(NyasTexDesc desc) : Data(desc) {}
 } NyasTexture;
 
+// Range of the mesh indices drawn at a level of detail. Every level shares the vertices.
+typedef struct NyasMeshLod
+{
+    int64_t FirstIdx;
+    int64_t ElementCount;
+    float Error; // Object space deviation from the full mesh.
+} NyasMeshLod;
+
 typedef struct NyasMesh
 {
     NyasResource Resource;
@@ -801,17 +991,58 @@ typedef struct NyasMesh
     int64_t ElementCount;
     uint32_t VtxSize;
     NyasVtxAttribFlags Attribs;
+    float BoundsMin[3]; // Object space bounding box.
+    float BoundsMax[3];
+    float Sphere[4]; // Object space bounding sphere: center and radius.
+    NyasMeshLod Lods[NYAS_MESH_LODS]; // Finest first, ElementCount covers all of them.
+    int LodCount;
 } NyasMesh;
 
+// Per-instance shader data in a shader storage buffer that grows with the instance count, bound
+// to the std430 block at binding 0. Instance gl_InstanceID of a draw unit reads the element
+// u_instance_base + gl_InstanceID, with u_instance_base set to the unit FirstInstance. Two GPU
+// copies alternate between frames and each one only receives the ranges written since its last
+// upload. Needs GL 4.3.
+struct NyasInstanceBuffer
+{
+    // Written by the thread that builds the frames.
+    char *Data;
+    int Stride;
+    int Count; // Instances uploaded on the next draw.
+    int Capacity;
+    int PendingBegin; // Range written since the last draw or packet submit.
+    int PendingEnd;
+
+    // Owned by the thread that draws.
+    NyasResource Res[2];
+    int GpuCapacity[2];
+    int DirtyBegin[2];
+    int DirtyEnd[2];
+    int Current; // Copy bound this frame.
+    uint64_t Frame; // Frame of the last upload.
+
+    NyasInstanceBuffer(int stride);
+    ~NyasInstanceBuffer();
+
+    // Returns the memory of the instances [first, first + count), growing the buffer and the
+    // instance count if needed, and marks them for upload. Not thread safe, but the returned
+    // memory can be filled from any thread before the draw.
+    void *Write(int first, int count);
+    inline void *At(int i) { return Data + (int64_t)i * Stride; }
+};
+
 typedef struct NyasShader
 {
     NyasResource Resource;
     NyasResource ResUnif;
     NyasResource ResSharedUnif;
     const char *Name;
+    const char *Defines;
+    NyasHandle Base; // Shader this one is a variant of, NyasCode_None otherwise.
     int SharedTexLocation;
     int SharedCubemapLocation;
     int TexArrLocation;
+    int InstanceBaseLocation;
     int SharedTexCount;
     int SharedCubemapCount;
     int TexArrCount;
@@ -821,13 +1052,14 @@ typedef struct NyasShader
     int UnitSize;
     int SharedSize;
     NyasHandle *TexArrays;
+    NyasInstanceBuffer *Instances; // Shared with the variants, NULL without instance data.
 
     NyasShader()
     {
         memset((void*)&Resource, 0, sizeof(*this));
     }
 
-    NyasShader(NyasShaderDesc *desc) : Name(desc->Name), SharedTexCount(desc->SharedTexCount), SharedCubemapCount(desc->SharedCubemapCount),
+    NyasShader(NyasShaderDesc *desc) : Name(desc->Name), Defines(desc->Defines), Base(NyasCode_None), SharedTexCount(desc->SharedTexCount), SharedCubemapCount(desc->SharedCubemapCount),
         TexArrCount(desc->TexArrCount), UnitSize(desc->UnitSize), SharedSize(desc->SharedSize)
     {
         Resource.Id = 0;
@@ -841,10 +1073,17 @@ typedef struct NyasShader
         SharedBlock = NYAS_ALLOC(SharedSize);
         Shared = (NyasHandle*)NYAS_ALLOC((SharedTexCount + SharedCubemapCount) * sizeof(NyasHandle));
         TexArrays = (NyasHandle*)NYAS_ALLOC(TexArrCount * sizeof(NyasHandle));
+        Instances = NULL; // Nyas::CreateShader creates the instance buffer.
     }
 
     ~NyasShader()
     {
+        if (Instances && Base == NyasCode_None)
+        {
+            Instances->~NyasInstanceBuffer();
+            NYAS_FREE(Instances);
+        }
+        Instances = NULL;
         NYAS_FREE(UnitBlock);
         NYAS_FREE(SharedBlock);
         NYAS_FREE(Shared);
@@ -899,8 +1138,12 @@ typedef struct NyasDrawUnit
     NyasHandle Shader;
     NyasHandle Mesh;
     int Instances;
+    int Lod;
+    int UnitBlockOffset; // Bytes of the shader unit block skipped, instance 0 reads from there.
+    int FirstInstance; // Instance buffer element read by instance 0.
+    uint64_t SortKey; // Order within the command, see Nyas::SortKey.
 
-    NyasDrawUnit() : Instances(1) {}
+    NyasDrawUnit() : Instances(1), Lod(0), UnitBlockOffset(0), FirstInstance(0), SortKey(0) {}
 } NyasDrawUnit;
 
 typedef struct NyasDrawCmd
@@ -910,7 +1153,12 @@ typedef struct NyasDrawCmd
     int UnitCount;
     NyasHandle Framebuf;
     NyasHandle Shader;
-    NyasDrawCmd() : Units(NULL), UnitCount(0), Framebuf(NyasCode_NoOp) {}
+    uint64_t SortKey; // Order within the frame, see Nyas::SortKey.
+    NyMergedMesh *Merged; // Draws every unit with one indirect call, see azdo.h.
+    NyasDrawCmd() :
+        Units(NULL), UnitCount(0), Framebuf(NyasCode_NoOp), SortKey(0), Merged(NULL)
+    {
+    }
 } NyasDrawCmd;
 
 typedef struct NyasCamera
@@ -919,32 +1167,34 @@ typedef struct NyasCamera
     float Proj[16];
     float Far;
     float Fov;
-    NyasCamera() { memset(this, 0, sizeof(*this)); }
+
+    // Derived data, recomputed on access when View or Proj differ from the ones it was built from.
+    mutable float _InvView[16];
+    mutable float _ViewProj[16];
+    mutable float _Planes[6][4];
+    mutable float _Source[32]; // View and Proj of the derived data.
+    mutable bool _Valid;
+
+    NyasCamera() { memset((void *)this, 0, sizeof(*this)); }
     void Navigate();
 
+    inline const float *InvView() const { return _Refresh()->_InvView; }
+    inline const float *ViewProj() const { return _Refresh()->_ViewProj; }
+    inline const float (*Planes() const)[4] { return _Refresh()->_Planes; } // See FrustumPlanes.
+
     // Position.
     inline NyVec3 Eye() const
     {
-        float inv[16];
-        mat4_inverse(inv, View);
+        const float *inv = InvView();
         return { inv[12], inv[13], inv[14] };
     }
 
     inline NyVec3 Fwd() const { return { View[2], View[6], View[10] }; } // Forward vector.
 
     // Matrix with zeroed translation (i.e., projection * vec4(vec3(view)). For skybox.
-    inline float *OriginViewProj(float out[16])
-    {
-        mat4_assign(out, View);
-        out[3] = 0.0f;
-        out[7] = 0.0f;
-        out[11] = 0.0f;
-        out[12] = 0.0f;
-        out[13] = 0.0f;
-        out[14] = 0.0f;
-        out[15] = 0.0f;
-        return mat4_multiply(out, Proj, out);
-    }
+    float *OriginViewProj(float out[16]) const;
+
+    const NyasCamera *_Refresh() const;
 
     inline void Init(const NyasCtx& ctx, NyVec3 pos = { 0.0f, 2.0f, 2.0f },
         NyVec3 target = { 0.0f, 0.0f, -1.0f }, float far = 300.0f, float fov = 70.0f)
@@ -961,8 +1211,21 @@ typedef struct NyasEntity
     float Transform[16];
     NyasHandle Mesh;
     NyasHandle Shader;
+    int Material; // Application defined variant, entities only share instanced draws if equal.
 } NyasEntity;
 
+// Run of visible entities drawn with one instanced draw.
+typedef struct NyasInstanceBatch
+{
+    NyasHandle Shader;
+    NyasHandle Mesh;
+    int Material;
+    int Lod;
+    int First; // Position of the first entity in the batched visible list.
+    int Count;
+    int Slot; // Instance index of the first entity in the shader unit block.
+} NyasInstanceBatch;
+
 namespace Nyas
 {
 extern NyPool<NyasMesh> Meshes;
@@ -996,6 +1259,18 @@ struct NyChrono
     int64_t Elapsed() { return GetTime() - Start; }
 };
 
+// Adds the time until the end of the enclosing scope to the CPU times of the profiler.
+struct NyProfileScope
+{
+    const char *Name; // Scopes are merged by name, it has to outlive the frame.
+    int64_t Start;
+
+    NyProfileScope(const char *name);
+    ~NyProfileScope();
+};
+
+#define NYAS_PROFILE_SCOPE(_NAME) NyProfileScope _ny_profile_scope(_NAME)
+
 struct NySched
 {
     struct Job
@@ -1014,6 +1289,191 @@ struct NySched
     void Wait();
 };
 
+// Dynamic AABB tree. Leaves store fattened boxes so small moves keep their place, insertion picks
+// the sibling with the lowest surface area cost and every refit path is improved with rotations.
+struct NyBVH
+{
+    struct Node
+    {
+        float Min[3];
+        float Max[3];
+        int Parent; // Next free node when unused.
+        int Child[2]; // -1 on leaves.
+        int Height; // 0 on leaves, -1 when free.
+        int User;
+    };
+
+    NyArray<Node> Nodes;
+    int Root;
+    int Free;
+    int Leaves;
+    float Margin;
+
+    NyBVH(float margin = NYAS_BVH_MARGIN) : Nodes(), Root(-1), Free(-1), Leaves(0), Margin(margin)
+    {
+    }
+
+    int Insert(const float *min, const float *max, int user); // Returns the leaf id.
+    void Remove(int leaf);
+    bool Move(int leaf, const float *min, const float *max); // True if the leaf was reinserted.
+
+    // Query results are the user values of the matching leaves, appended to out.
+    void QueryFrustum(const float planes[6][4], NyArray<int> &out) const;
+    void QuerySphere(const float *center, float radius, NyArray<int> &out) const;
+    void QueryRay(const float *origin, const float *dir, float max_t, NyArray<int> &out) const;
+
+    int _Alloc();
+    void _Free(int node);
+    void _InsertLeaf(int leaf);
+    void _RemoveLeaf(int leaf);
+    void _Refit(int node);
+    void _Rotate(int node);
+    void _Collect(int node, NyArray<int> &out) const;
+};
+
+// Draws the frames on a thread that owns the GL context from construction to destruction, so
+// building frame N + 1 overlaps with the driver work of frame N. Submit copies the commands, their
+// units and the data of their shaders (blocks, texture handles and instance data) into one of two
+// packets and only blocks while the render thread is still drawing the packet before. Each packet
+// ends with WindowSwap. Resources can not be created, reloaded or released while a frame is in
+// flight, call Wait first. Input polling stays on the constructing thread.
+struct NyRenderThread
+{
+    struct _NyRenderer *_Renderer;
+
+    NyRenderThread();
+    ~NyRenderThread();
+    void Submit(NyasDrawCmd *cmds, int count);
+    void Wait(); // Until every submitted frame is drawn.
+};
+
+// Parent/child transform hierarchy. Local translation, rotation (unit quaternion x, y, z, w) and
+// scale are stored in SoA arrays whose slots are sorted by depth, so parents always come before
+// their children and every level is contiguous. Update recomputes the world matrices of the nodes
+// whose local transform changed and of their subtrees, level by level in SIMD batches. Nodes keep
+// their id while their slot moves. Not thread safe.
+struct NyTransforms
+{
+    NyArray<float> Tx, Ty, Tz;
+    NyArray<float> Qx, Qy, Qz, Qw;
+    NyArray<float> Sx, Sy, Sz;
+    NyArray<float> World; // Column major, 16 floats per slot.
+    NyArray<int> Parent; // Slot of the parent, -1 for roots.
+    NyArray<int> Entity; // Entity whose Transform receives the world matrix, -1 if none.
+    NyArray<uint8_t> Dirty;
+    NyArray<int> Node; // Node id of each slot.
+    NyArray<int> Slot; // Slot of each node id, -1 once removed.
+    NyArray<int> Levels; // First slot of each depth, plus the slot count.
+    bool Unsorted;
+
+    NyTransforms() : Unsorted(false) {}
+
+    // Returns the node id. The node starts at the identity, parent NyasCode_None for a root.
+    int Add(int parent = NyasCode_None, int entity = NyasCode_None);
+    // Children are attached to the parent of the removed node, keeping their local transforms.
+    void Remove(int node);
+    // Returns NyasCode_Error if parent is the node or one of its descendants.
+    int SetParent(int node, int parent);
+    // Null components are left as they are.
+    void SetLocal(int node, const float *translation, const float *rotation, const float *scale);
+    inline const float *WorldMatrix(int node) const { return World.Buf.Data + Slot[node] * 16; }
+
+    // Recomputes the dirty subtrees and copies the new world matrices to their entities, which
+    // are then refitted in Nyas::EntityTree. Chunks of a level run in parallel when sched is set.
+    void Update(NySched *sched = NULL);
+
+    int _Depth(int slot) const;
+    void _Sort();
+};
+
+// Draw commands recorded by one job over the item range [Begin, End). Commands and units live in
+// the recording thread's frame memory, so the scheduler has to outlive the frame submission.
+struct NyasDrawBucket
+{
+    NyArray<NyasDrawCmd, NyThreadFrameAllocator> Cmds;
+    int Begin;
+    int End;
+    int Index;
+    void *User;
+    void (*_Record)(NyasDrawBucket *bucket);
+
+    NyasDrawBucket() : Cmds(), Begin(0), End(0), Index(0), User(NULL), _Record(NULL) {}
+    inline NyasDrawUnit *AllocUnits(int count)
+    {
+        NyasDrawUnit *units =
+            (NyasDrawUnit *)NyThreadFrameAllocator::Alloc(count * sizeof(NyasDrawUnit));
+        for (int i = 0; i < count; ++i)
+        {
+            units[i] = NyasDrawUnit();
+        }
+        return units;
+    }
+};
+
+namespace Nyas
+{
+// Splits [0, count) into one range per job and records them in parallel with sched. The buckets
+// are appended to frame in range order, so the result does not depend on thread timing.
+void RecordDraws(NyArray<NyasDrawCmd, NyFrameAllocator> &frame, NySched *sched, int count, int jobs,
+    void (*record)(NyasDrawBucket *bucket), void *user = NULL);
+
+// Spatial index of the entities, kept in sync with UpdateEntity and RemoveEntity. Culling and
+// picking use it once every entity is indexed and scan the entities otherwise.
+extern NyBVH EntityTree;
+// Transform hierarchy of the scene, entities attached to a node get their Transform from it.
+extern NyTransforms Transforms;
+// Indexes the entity or refits it after its transform or mesh changed.
+void UpdateEntity(int entity);
+// Removes the entity from the index and the entity pool.
+void RemoveEntity(int entity);
+// Nearest entity whose bounding sphere is hit by the ray, NyasCode_None if there is none.
+int PickEntity(const float *origin, const float *dir, float max_t = 1e30f);
+
+// Coarsest level of detail of the mesh whose error stays under NYAS_LOD_PIXEL_ERROR on screen with
+// the camera projection. Changes from previous (-1 if none) need to clear a hysteresis band.
+int SelectLod(NyasHandle mesh, const float *transform, const NyVec3 &eye, int previous);
+
+// Normalized planes (a, b, c, d) of a column major view projection, pointing inwards.
+void FrustumPlanes(float planes[6][4], const float *view_proj);
+// Writes to visible the indices of the entities whose mesh bounding sphere touches the frustum,
+// in increasing order, and returns how many. Chunks are culled in parallel when sched is set.
+int CullEntities(const float *view_proj, int *visible, NySched *sched = NULL);
+// Reorders visible so that entities sharing shader, material, mesh and level of detail (lods[i]
+// of visible[i], NULL for the full meshes) are contiguous and writes a batch per run. Entities
+// keep their relative order within a batch. Slots count up from 0 for every shader, an entity at
+// position i of visible goes to instance slot i - First + Slot of its batch. Returns the batches.
+int BatchEntities(int *visible, const int *lods, int count, NyasInstanceBatch *batches);
+} // namespace Nyas
+
+// Whole-file reads kept in flight concurrently. Uses io_uring on Linux and a pool of reader threads
+// elsewhere or when the kernel lacks support. Not thread safe: completions run in Poll and Wait.
+struct NyAsyncIO
+{
+    struct Read
+    {
+        const char *Path;
+        void (*Done)(Read *read);
+        void *User;
+        char *Data; // Null terminated, owned by the caller after completion.
+        size_t Size; // Without the terminator.
+        int Err;
+
+        struct _NyAsyncIO *_IO;
+        int _Fd;
+        size_t _Offset;
+
+        Read() : Path(NULL), Done(NULL), User(NULL), Data(NULL), Size(0), Err(NyasCode_Ok) {}
+    };
+
+    struct _NyAsyncIO *_IO;
+
+    NyAsyncIO(int depth = NYAS_ASYNC_IO_DEPTH);
+    ~NyAsyncIO();
+    void Submit(Read *read); // The read must stay valid until Done is called.
+    int Poll(); // Runs the available completions, returns the reads still in flight.
+    void Wait();
+};
+
 struct NyAssetLoader
 {
     struct TexArgs
@@ -1046,6 +1506,8 @@ struct NyAssetLoader
 
     NyArray<NySched::Job> Sequential;
     NyArray<NySched::Job> Async;
+    NyArray<ShaderArgs *> Shaders;
+    NyArray<TexArgs *> Textures;
     void AddMesh(MeshArgs *args);
     void AddTex(TexArgs *args);
     void AddShader(ShaderArgs *args);
@@ -1066,6 +1528,28 @@ namespace NyUtil
 {
 void LoadBasicGeometries(void);
 
+// IEEE 754 binary32 to binary16 (round to nearest even). F16C/NEON when available.
+void FloatToHalf(uint16_t *dst, const float *src, size_t count);
+
+// Writes the indices of the spheres (SoA centers and radii) in front of the six planes and returns
+// how many. Uses AVX or SSE when available.
+int CullSpheres(const float planes[6][4], const float *x, const float *y, const float *z,
+    const float *r, int count, int *visible);
+
+// Column major 4x4 matrices. SSE on x86, and AVX for the batches when the CPU supports it. out
+// can alias the inputs.
+void Mat4Mul(float *out, const float *a, const float *b);
+// out[i] = a * b[i] for count matrices, e.g. a view projection by every model matrix.
+void Mat4MulBatch(float *out, const float *a, const float *b, int count);
+// General inverse, false (and out untouched) if the matrix is singular.
+bool Mat4Inverse(float *out, const float *m);
+// Transforms count points (x, y, z, w = 1) by m, keeping x, y, z. out can alias points.
+void TransformPoints(float *out, const float *m, const float *points, int count);
+
+// Stable LSD radix sort, 8 bits per pass. Sorts the keys in place and writes to order the original
+// index of each sorted key. Byte positions equal in every key are skipped.
+void RadixSort(uint64_t *keys, uint32_t *order, int count);
+
 // Environment maps
 void LoadEnv(const char *path, NyasHandle *lut, NyasHandle *sky, NyasHandle *irr, NyasHandle *pref);
 
@@ -2,9 +2,31 @@
 #define NYAS_CONFIG_H
 
 #define NYAS_FRAME_ALLOCATOR_ARENA_SIZE (16 * 1024 * 1024)
+#define NYAS_THREAD_FRAME_ARENA_SIZE (4 * 1024 * 1024) // Per-thread frame memory, draw recording.
 #define NYAS_TEXUNIT_OFFSET_FOR_COMMON_SHADER_DATA (16)
 #define NYAS_PIPELINE_MAX_UNITS 1024
+#define NYAS_CULL_CHUNK 4096 // Entities per culling job.
+#define NYAS_BVH_MARGIN 0.1f // Leaf box fattening of the entity index.
+#define NYAS_TRANSFORM_CHUNK 2048 // Hierarchy nodes per world matrix update job.
+#define NYAS_MESH_LODS 5 // Levels of detail per mesh, including the full one.
+#define NYAS_LOD_PIXEL_ERROR 1.0f // Screen error allowed when selecting a mesh LOD.
+#define NYAS_LOD_HYSTERESIS 0.25f // Relative error band that keeps the current LOD.
 #define NYAS_TEX_ARRAY_SIZE 256
+#define NYAS_UPLOAD_STAGING_SIZE (24 * 1024 * 1024) // Persistent staging buffer for GPU uploads.
+#define NYAS_UPLOAD_STAGING_FRAMES 3 // Staging regions in flight, each fenced before reuse.
+#define NYAS_UPLOAD_FRAME_BYTES (4 * 1024 * 1024) // Default upload byte budget per frame.
+#define NYAS_UPLOAD_FRAME_US 2000 // Default upload time budget per frame (microseconds).
+#define NYAS_UNIFORM_RING_SIZE (6 * 1024 * 1024) // Persistent ring for shader uniform blocks.
+#define NYAS_UNIFORM_RING_FRAMES 3 // Ring regions in flight, each fenced before reuse.
+#define NYAS_PAK_ALIGN 4096 // Alignment of asset pack entries.
+#define NYAS_PROGRAM_CACHE_DIR "cache/" // Linked program binaries, keyed by source and driver.
+#define NYAS_SHADER_DIR "assets/shaders/"
+#define NYAS_SHADER_INCLUDE_DEPTH 16 // Nested #include limit of the shader preprocessor.
+#define NYAS_ASYNC_IO_DEPTH 64 // Reads in flight per NyAsyncIO.
+#define NYAS_ASYNC_IO_THREADS 8 // Reader threads when io_uring is not available.
+#define NYAS_PROFILE_FRAMES 4 // Frames of GPU timer queries in flight before reading them back.
+#define NYAS_PROFILE_SCOPES 64 // Timed CPU scopes and GPU draw commands per frame.
+#define NYAS_PROFILE_HISTORY 240 // Frame times kept for the profiler graphs.
 
 // #define NyDrawIdx unsigned int
 // #define NYAS_ASSERT(_COND) assert(_COND)
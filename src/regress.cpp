@@ -0,0 +1,781 @@
+// Regression gate: runs the scripted scenes of a baseline file through nyas_bench, compares the
+// last frame of each one with its golden image and the report metrics with the recorded values.
+// Exits with 1 if any image or metric regressed, or if something could not be checked, and with 2
+// if the gate is not armed because there is no baseline yet. Both fail a CI job.
+//
+// nyas_regress [--baseline path] [--scenes path] [--bench path] [--work dir] [--scene name]
+//     [--update]
+//
+// Metrics are dot paths into the nyas_bench report, lower is better for all of them. A metric
+// regresses when it goes over value * (1 + threshold). Images compare pixel by pixel, a pixel
+// differs when any channel is off by more than the channel tolerance, and the image regresses when
+// the fraction of differing pixels goes over the pixel tolerance. Golden images live next to the
+// baseline, in golden/<scene>.ppm. --update records the current run as the new baseline. Timings
+// and images only compare on the machine that recorded them, so the baseline is not versioned
+// until it is recorded on the reference machine. Until then --update starts from the scene
+// definitions of --scenes, which have thresholds but no values.
+
+#include "nyas.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+struct RegressConfig
+{
+    const char *Baseline;
+    const char *Scenes; // Read by --update while there is no baseline.
+    const char *Bench;
+    const char *Work;
+    const char *Scene;
+    bool Update;
+};
+
+struct RegressMetric
+{
+    char Path[64];
+    double Value;
+    double Threshold;
+    bool Recorded; // False until the first --update.
+};
+
+struct RegressScene
+{
+    char Name[64];
+    char Args[256]; // nyas_bench arguments, --capture is added by the runner.
+    double ChannelTol;
+    double PixelTol;
+    NyArray<RegressMetric> Metrics;
+};
+
+struct RegressImage
+{
+    int W, H;
+    uint8_t *Rgb;
+};
+
+// ---
+// [JSON]
+// ---
+
+// Just enough JSON for the baseline and the bench report: no unicode escapes.
+enum JsonType_
+{
+    JsonType_Null,
+    JsonType_Bool,
+    JsonType_Number,
+    JsonType_String,
+    JsonType_Array,
+    JsonType_Object
+};
+
+struct JsonNode
+{
+    int Type;
+    const char *Key; // Member name inside objects, points into the source text.
+    int KeyLen;
+    const char *Str;
+    int StrLen;
+    double Num;
+    int Child; // First element or member, -1 if none.
+    int Next; // Next sibling, -1 if last.
+};
+
+struct Json
+{
+    NyArray<JsonNode> Nodes;
+    const char *Cur;
+    bool Failed;
+};
+
+static void JsonSkip(Json *j)
+{
+    while (isspace((unsigned char)*j->Cur))
+    {
+        ++j->Cur;
+    }
+}
+
+static bool JsonString(Json *j, const char **str, int *len)
+{
+    if (*j->Cur != '"')
+    {
+        return false;
+    }
+
+    *str = ++j->Cur;
+    while (*j->Cur && *j->Cur != '"')
+    {
+        j->Cur += *j->Cur == '\\' && j->Cur[1] ? 2 : 1;
+    }
+
+    if (!*j->Cur)
+    {
+        return false;
+    }
+    *len = (int)(j->Cur++ - *str);
+    return true;
+}
+
+static bool JsonLiteral(Json *j, const char *lit)
+{
+    size_t len = strlen(lit);
+    if (strncmp(j->Cur, lit, len))
+    {
+        return false;
+    }
+    j->Cur += len;
+    return true;
+}
+
+// Returns the node index, or -1 with Failed set. Nodes reference each other by index because the
+// array moves while it grows.
+static int JsonValue(Json *j)
+{
+    JsonSkip(j);
+    int idx = j->Nodes.Size;
+    j->Nodes.Push({ JsonType_Null, NULL, 0, NULL, 0, 0.0, -1, -1 });
+
+    char c = *j->Cur;
+    if (c == '{' || c == '[')
+    {
+        bool object = c == '{';
+        j->Nodes[idx].Type = object ? JsonType_Object : JsonType_Array;
+        ++j->Cur;
+        JsonSkip(j);
+        int last = -1;
+        while (*j->Cur != (object ? '}' : ']'))
+        {
+            const char *key = NULL;
+            int key_len = 0;
+            if (object)
+            {
+                bool ok = JsonString(j, &key, &key_len);
+                JsonSkip(j);
+                if (!ok || *j->Cur++ != ':')
+                {
+                    j->Failed = true;
+                    return -1;
+                }
+            }
+
+            int child = JsonValue(j);
+            if (child < 0)
+            {
+                return -1;
+            }
+            j->Nodes[child].Key = key;
+            j->Nodes[child].KeyLen = key_len;
+            if (last < 0)
+            {
+                j->Nodes[idx].Child = child;
+            }
+            else
+            {
+                j->Nodes[last].Next = child;
+            }
+            last = child;
+
+            JsonSkip(j);
+            if (*j->Cur == ',')
+            {
+                ++j->Cur;
+                JsonSkip(j);
+            }
+            else if (*j->Cur != (object ? '}' : ']'))
+            {
+                j->Failed = true;
+                return -1;
+            }
+        }
+        ++j->Cur;
+    }
+    else if (c == '"')
+    {
+        j->Nodes[idx].Type = JsonType_String;
+        if (!JsonString(j, &j->Nodes[idx].Str, &j->Nodes[idx].StrLen))
+        {
+            j->Failed = true;
+            return -1;
+        }
+    }
+    else if (JsonLiteral(j, "true"))
+    {
+        j->Nodes[idx].Type = JsonType_Bool;
+        j->Nodes[idx].Num = 1.0;
+    }
+    else if (JsonLiteral(j, "false"))
+    {
+        j->Nodes[idx].Type = JsonType_Bool;
+    }
+    else if (JsonLiteral(j, "null"))
+    {
+        j->Nodes[idx].Type = JsonType_Null;
+    }
+    else
+    {
+        char *end = NULL;
+        j->Nodes[idx].Type = JsonType_Number;
+        j->Nodes[idx].Num = strtod(j->Cur, &end);
+        if (end == j->Cur)
+        {
+            j->Failed = true;
+            return -1;
+        }
+        j->Cur = end;
+    }
+    return idx;
+}
+
+// The text has to outlive the nodes, strings point into it.
+static bool JsonParse(Json *j, const char *text)
+{
+    j->Nodes.Size = 0;
+    j->Cur = text;
+    j->Failed = false;
+    JsonValue(j);
+    JsonSkip(j);
+    return !j->Failed && !*j->Cur;
+}
+
+static int JsonGet(const Json &j, int obj, const char *key, int key_len)
+{
+    if (obj < 0 || j.Nodes[obj].Type != JsonType_Object)
+    {
+        return -1;
+    }
+
+    for (int c = j.Nodes[obj].Child; c >= 0; c = j.Nodes[c].Next)
+    {
+        if (j.Nodes[c].KeyLen == key_len && !strncmp(j.Nodes[c].Key, key, key_len))
+        {
+            return c;
+        }
+    }
+    return -1;
+}
+
+static int JsonGet(const Json &j, int obj, const char *key)
+{
+    return JsonGet(j, obj, key, (int)strlen(key));
+}
+
+// Dot separated member path, "ms.build.p50".
+static int JsonPath(const Json &j, int obj, const char *path)
+{
+    while (obj >= 0 && *path)
+    {
+        const char *dot = strchr(path, '.');
+        int len = dot ? (int)(dot - path) : (int)strlen(path);
+        obj = JsonGet(j, obj, path, len);
+        path += dot ? len + 1 : len;
+    }
+    return obj;
+}
+
+static double JsonNumber(const Json &j, int node, double fallback)
+{
+    return node >= 0 && j.Nodes[node].Type == JsonType_Number ? j.Nodes[node].Num : fallback;
+}
+
+static void JsonCopyString(const Json &j, int node, char *dst, size_t size)
+{
+    int len = node >= 0 && j.Nodes[node].Type == JsonType_String ? j.Nodes[node].StrLen : 0;
+    snprintf(dst, size, "%.*s", len, len ? j.Nodes[node].Str : "");
+}
+
+// ---
+// [BASELINE]
+// ---
+
+static char *ReadText(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        return NULL;
+    }
+
+    NyArray<char> text;
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            text.Push(chunk[i]);
+        }
+    }
+    fclose(f);
+    text.Push('\0');
+
+    char *ret = (char *)malloc(text.Size);
+    memcpy(ret, &text[0], text.Size);
+    return ret;
+}
+
+static int LoadBaseline(const char *path, NyArray<RegressScene *> &scenes)
+{
+    char *text = ReadText(path);
+    if (!text)
+    {
+        fprintf(stderr, "Could not read %s.\n", path);
+        return NyasError_File;
+    }
+
+    Json j = {};
+    if (!JsonParse(&j, text))
+    {
+        fprintf(stderr, "Malformed JSON in %s, near offset %d.\n", path, (int)(j.Cur - text));
+        free(text);
+        return NyasError_File;
+    }
+
+    int list = JsonGet(j, 0, "scenes");
+    if (list < 0 || j.Nodes[list].Type != JsonType_Array)
+    {
+        fprintf(stderr, "%s has no scenes array.\n", path);
+        free(text);
+        return NyasError_File;
+    }
+
+    for (int s = j.Nodes[list].Child; s >= 0; s = j.Nodes[s].Next)
+    {
+        RegressScene *scene = new RegressScene();
+        JsonCopyString(j, JsonGet(j, s, "name"), scene->Name, sizeof(scene->Name));
+        JsonCopyString(j, JsonGet(j, s, "args"), scene->Args, sizeof(scene->Args));
+        scene->ChannelTol = JsonNumber(j, JsonPath(j, s, "tolerance.channel"), 0.0);
+        scene->PixelTol = JsonNumber(j, JsonPath(j, s, "tolerance.pixels"), 0.0);
+
+        int metrics = JsonGet(j, s, "metrics");
+        for (int m = metrics >= 0 ? j.Nodes[metrics].Child : -1; m >= 0; m = j.Nodes[m].Next)
+        {
+            RegressMetric metric;
+            snprintf(metric.Path, sizeof(metric.Path), "%.*s", j.Nodes[m].KeyLen, j.Nodes[m].Key);
+            int value = JsonGet(j, m, "value");
+            metric.Recorded = value >= 0 && j.Nodes[value].Type == JsonType_Number;
+            metric.Value = JsonNumber(j, value, 0.0);
+            metric.Threshold = JsonNumber(j, JsonGet(j, m, "threshold"), 0.0);
+            scene->Metrics.Push(metric);
+        }
+        scenes.Push(scene);
+    }
+
+    free(text);
+    return NyasCode_Ok;
+}
+
+static int SaveBaseline(const char *path, NyArray<RegressScene *> &scenes)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Could not write %s.\n", path);
+        return NyasError_File;
+    }
+
+    fprintf(f, "{\n  \"scenes\": [\n");
+    for (int s = 0; s < scenes.Size; ++s)
+    {
+        const RegressScene *scene = scenes[s];
+        fprintf(f, "    {\n");
+        fprintf(f, "      \"name\": \"%s\",\n", scene->Name);
+        fprintf(f, "      \"args\": \"%s\",\n", scene->Args);
+        fprintf(f, "      \"tolerance\": { \"channel\": %g, \"pixels\": %g },\n", scene->ChannelTol,
+            scene->PixelTol);
+        fprintf(f, "      \"metrics\": {\n");
+        for (int m = 0; m < scene->Metrics.Size; ++m)
+        {
+            const RegressMetric &metric = scene->Metrics[m];
+            fprintf(f, "        \"%s\": { \"value\": ", metric.Path);
+            if (metric.Recorded)
+            {
+                fprintf(f, "%.4f", metric.Value);
+            }
+            else
+            {
+                fprintf(f, "null");
+            }
+            fprintf(f, ", \"threshold\": %g }%s\n", metric.Threshold,
+                m == scene->Metrics.Size - 1 ? "" : ",");
+        }
+        fprintf(f, "      }\n");
+        fprintf(f, "    }%s\n", s == scenes.Size - 1 ? "" : ",");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+    return NyasCode_Ok;
+}
+
+// ---
+// [IMAGES]
+// ---
+
+// Binary PPM with 8 bit channels, the format of Nyas::SaveFrame.
+static int ReadPPM(const char *path, RegressImage *img)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        return NyasError_File;
+    }
+
+    int max = 0;
+    img->Rgb = NULL;
+    if (fscanf(f, "P6 %d %d %d", &img->W, &img->H, &max) != 3 || max != 255 || img->W < 1 ||
+        img->H < 1 || fgetc(f) == EOF)
+    {
+        fclose(f);
+        return NyasError_File;
+    }
+
+    size_t size = (size_t)img->W * img->H * 3;
+    img->Rgb = (uint8_t *)malloc(size);
+    bool ok = fread(img->Rgb, 1, size, f) == size;
+    fclose(f);
+    if (!ok)
+    {
+        free(img->Rgb);
+        img->Rgb = NULL;
+        return NyasError_File;
+    }
+    return NyasCode_Ok;
+}
+
+static int WritePPM(const char *path, const RegressImage &img)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+    {
+        return NyasError_File;
+    }
+
+    size_t size = (size_t)img.W * img.H * 3;
+    bool ok = fprintf(f, "P6\n%d %d\n255\n", img.W, img.H) > 0;
+    ok = ok && fwrite(img.Rgb, 1, size, f) == size;
+    fclose(f);
+    if (!ok)
+    {
+        return NyasError_File;
+    }
+    return NyasCode_Ok;
+}
+
+// Returns the fraction of differing pixels and marks them red over a darkened golden in diff.
+static double CompareImages(const RegressImage &golden, const RegressImage &frame, int tolerance,
+    RegressImage *diff)
+{
+    int64_t count = (int64_t)golden.W * golden.H;
+    int64_t differ = 0;
+    for (int64_t p = 0; p < count; ++p)
+    {
+        const uint8_t *a = &golden.Rgb[p * 3];
+        const uint8_t *b = &frame.Rgb[p * 3];
+        bool off = abs(a[0] - b[0]) > tolerance || abs(a[1] - b[1]) > tolerance ||
+            abs(a[2] - b[2]) > tolerance;
+        differ += off;
+
+        uint8_t *d = &diff->Rgb[p * 3];
+        d[0] = off ? 255 : a[0] / 4;
+        d[1] = off ? 0 : a[1] / 4;
+        d[2] = off ? 0 : a[2] / 4;
+    }
+    return (double)differ / count;
+}
+
+// ---
+// [RUNNER]
+// ---
+
+// Runs nyas_bench and keeps its JSON report, the frame capture is written to capture.
+static char *RunBench(const RegressConfig &cfg, const RegressScene &scene, const char *capture)
+{
+    char cmd[1024];
+    int len = snprintf(cmd, sizeof(cmd), "\"%s\" %s --capture \"%s\"", cfg.Bench, scene.Args,
+        capture);
+    if (len < 0 || len >= (int)sizeof(cmd))
+    {
+        fprintf(stderr, "%s: nyas_bench command too long.\n", scene.Name);
+        return NULL;
+    }
+
+    FILE *p = popen(cmd, "r");
+    if (!p)
+    {
+        return NULL;
+    }
+
+    NyArray<char> out;
+    int c;
+    while ((c = fgetc(p)) != EOF)
+    {
+        out.Push((char)c);
+    }
+    out.Push('\0');
+
+    if (pclose(p) != 0)
+    {
+        fprintf(stderr, "%s: nyas_bench failed, command: %s\n", scene.Name, cmd);
+        return NULL;
+    }
+
+    char *ret = (char *)malloc(out.Size);
+    memcpy(ret, &out[0], out.Size);
+    return ret;
+}
+
+// Returns the number of failures of the scene.
+static int CheckScene(const RegressConfig &cfg, RegressScene *scene, const char *golden_dir)
+{
+    char capture[512];
+    char golden_path[512];
+    int capture_len = snprintf(capture, sizeof(capture), "%s/%s.ppm", cfg.Work, scene->Name);
+    int golden_len =
+        snprintf(golden_path, sizeof(golden_path), "%s/%s.ppm", golden_dir, scene->Name);
+    printf("[%s] %s\n", scene->Name, scene->Args);
+    if (capture_len < 0 || capture_len >= (int)sizeof(capture) || golden_len < 0 ||
+        golden_len >= (int)sizeof(golden_path))
+    {
+        fprintf(stderr, "%s: image paths too long.\n", scene->Name);
+        return 1;
+    }
+
+    char *report = RunBench(cfg, *scene, capture);
+    if (!report)
+    {
+        return 1;
+    }
+
+    int failures = 0;
+    Json j = {};
+    if (!JsonParse(&j, report))
+    {
+        fprintf(stderr, "%s: malformed nyas_bench report.\n", scene->Name);
+        free(report);
+        return 1;
+    }
+
+    for (int m = 0; m < scene->Metrics.Size; ++m)
+    {
+        RegressMetric &metric = scene->Metrics[m];
+        int node = JsonPath(j, 0, metric.Path);
+        if (node < 0 || j.Nodes[node].Type != JsonType_Number)
+        {
+            printf("  %-32s missing from the report                 FAIL\n", metric.Path);
+            ++failures;
+            continue;
+        }
+
+        double current = j.Nodes[node].Num;
+        if (cfg.Update)
+        {
+            metric.Value = current;
+            metric.Recorded = true;
+            printf("  %-32s %12.4f                            RECORDED\n", metric.Path, current);
+            continue;
+        }
+
+        if (!metric.Recorded)
+        {
+            printf("  %-32s %12.4f   no baseline, use --update   FAIL\n", metric.Path, current);
+            ++failures;
+            continue;
+        }
+
+        double limit = metric.Value * (1.0 + metric.Threshold);
+        bool regressed = current > limit + 1e-9;
+        double delta = metric.Value > 0.0 ? (current / metric.Value - 1.0) * 100.0 : 0.0;
+        printf("  %-32s %12.4f -> %12.4f %+8.1f%%   %s\n", metric.Path, metric.Value, current,
+            delta, regressed ? "FAIL" : "ok");
+        failures += regressed;
+    }
+    free(report);
+
+    RegressImage frame;
+    if (ReadPPM(capture, &frame) != NyasCode_Ok)
+    {
+        printf("  %-32s could not read %s   FAIL\n", "image", capture);
+        return failures + 1;
+    }
+
+    if (cfg.Update)
+    {
+        bool ok = WritePPM(golden_path, frame) == NyasCode_Ok;
+        printf("  %-32s %s   %s\n", "image", golden_path, ok ? "RECORDED" : "FAIL");
+        free(frame.Rgb);
+        return failures + !ok;
+    }
+
+    RegressImage golden;
+    if (ReadPPM(golden_path, &golden) != NyasCode_Ok)
+    {
+        printf("  %-32s no golden %s, use --update   FAIL\n", "image", golden_path);
+        free(frame.Rgb);
+        return failures + 1;
+    }
+
+    if (golden.W != frame.W || golden.H != frame.H)
+    {
+        printf("  %-32s %dx%d -> %dx%d   FAIL\n", "image", golden.W, golden.H, frame.W, frame.H);
+        ++failures;
+    }
+    else
+    {
+        RegressImage diff = { frame.W, frame.H, (uint8_t *)malloc((size_t)frame.W * frame.H * 3) };
+        double differ = CompareImages(golden, frame, (int)scene->ChannelTol, &diff);
+        bool regressed = differ > scene->PixelTol;
+        printf("  %-32s %11.4f%% pixels differ (max %.4f%%)   %s\n", "image", differ * 100.0,
+            scene->PixelTol * 100.0, regressed ? "FAIL" : "ok");
+        if (regressed)
+        {
+            char diff_path[512];
+            int len =
+                snprintf(diff_path, sizeof(diff_path), "%s/%s.diff.ppm", cfg.Work, scene->Name);
+            bool fits = len >= 0 && len < (int)sizeof(diff_path);
+            if (fits && WritePPM(diff_path, diff) == NyasCode_Ok)
+            {
+                printf("  %-32s %s\n", "diff", diff_path);
+            }
+        }
+        failures += regressed;
+        free(diff.Rgb);
+    }
+
+    free(golden.Rgb);
+    free(frame.Rgb);
+    return failures;
+}
+
+static int ParseArgs(int argc, char **argv, RegressConfig *cfg)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        if (!strcmp(arg, "--update"))
+        {
+            cfg->Update = true;
+            continue;
+        }
+
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value)
+        {
+            fprintf(stderr, "Missing value of %s.\n", arg);
+            return NyasError_BadArg;
+        }
+        ++i;
+
+        if (!strcmp(arg, "--baseline"))
+        {
+            cfg->Baseline = value;
+        }
+        else if (!strcmp(arg, "--scenes"))
+        {
+            cfg->Scenes = value;
+        }
+        else if (!strcmp(arg, "--bench"))
+        {
+            cfg->Bench = value;
+        }
+        else if (!strcmp(arg, "--work"))
+        {
+            cfg->Work = value;
+        }
+        else if (!strcmp(arg, "--scene"))
+        {
+            cfg->Scene = value;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown argument %s.\n", arg);
+            return NyasError_BadArg;
+        }
+    }
+    return NyasCode_Ok;
+}
+
+int main(int argc, char **argv)
+{
+    // nyas_bench is built next to the runner.
+    char bench[512];
+    const char *slash = strrchr(argv[0], '/');
+    int bench_len = snprintf(bench, sizeof(bench), "%.*snyas_bench",
+        slash ? (int)(slash - argv[0] + 1) : 0, argv[0]);
+
+    RegressConfig cfg = {
+        "regress/baseline.json", "regress/scenes.json", bench, "regress/out", NULL, false };
+    if (ParseArgs(argc, argv, &cfg) != NyasCode_Ok)
+    {
+        return 1;
+    }
+
+    if (cfg.Bench == bench && (bench_len < 0 || bench_len >= (int)sizeof(bench)))
+    {
+        fprintf(stderr, "Path of nyas_bench too long, pass it with --bench.\n");
+        return 1;
+    }
+
+    struct stat baseline_stat;
+    const char *source = cfg.Baseline;
+    if (stat(cfg.Baseline, &baseline_stat) != 0)
+    {
+        if (!cfg.Update)
+        {
+            fprintf(stderr, "GATE NOT ARMED: no baseline at %s. Record it on the reference machine "
+                "with --update and commit it with its golden images.\n", cfg.Baseline);
+            return 2;
+        }
+        source = cfg.Scenes;
+    }
+
+    NyArray<RegressScene *> scenes;
+    if (LoadBaseline(source, scenes) != NyasCode_Ok)
+    {
+        return 1;
+    }
+
+    char golden_dir[512];
+    const char *base_slash = strrchr(cfg.Baseline, '/');
+    int golden_len = snprintf(golden_dir, sizeof(golden_dir), "%.*sgolden",
+        base_slash ? (int)(base_slash - cfg.Baseline + 1) : 0, cfg.Baseline);
+    if (golden_len < 0 || golden_len >= (int)sizeof(golden_dir))
+    {
+        fprintf(stderr, "Path of %s too long.\n", cfg.Baseline);
+        return 1;
+    }
+    mkdir(cfg.Work, 0755);
+    if (cfg.Update)
+    {
+        mkdir(golden_dir, 0755);
+    }
+
+    int failures = 0;
+    int checked = 0;
+    for (int s = 0; s < scenes.Size; ++s)
+    {
+        if (cfg.Scene && strcmp(cfg.Scene, scenes[s]->Name))
+        {
+            continue;
+        }
+        failures += CheckScene(cfg, scenes[s], golden_dir);
+        ++checked;
+    }
+
+    if (!checked)
+    {
+        fprintf(stderr, "No scene to check.\n");
+        ++failures;
+    }
+    else if (cfg.Update && !failures)
+    {
+        failures += SaveBaseline(cfg.Baseline, scenes) != NyasCode_Ok;
+    }
+
+    printf("%d scenes, %d failures.\n", checked, failures);
+    for (int s = 0; s < scenes.Size; ++s)
+    {
+        delete scenes[s];
+    }
+    return failures ? 1 : 0;
+}